@@ -0,0 +1,151 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "program/arena.h"
+#include "program/func.h"
+
+// Deterministic program generators shared by the benchmarks. The same
+// arguments always produce the same program.
+
+// Generates the text of a module of `func_count` funcs with a fixed mix
+// of straight-line code, calls and nested blocks
+inline std::string generate_module(unsigned func_count) {
+  std::ostringstream out;
+
+  for (unsigned f = 0; f < func_count; ++f) {
+    out << "func " << f << " args 2 returns i32\n";
+    out << "  registers bool i32 i32 i32\n";
+    for (unsigned i = 0; i < 8; ++i) {
+      out << "  load r2 " << (f * 8 + i) << "\n";
+      out << "  if r0\n";
+      out << "    call r3 _ " << (f + i) % func_count << " r0 r2\n";
+      out << "    repeat\n";
+      out << "      if r0\n";
+      out << "        break\n";
+      out << "      end\n";
+      out << "    end\n";
+      out << "  else\n";
+      out << "    try r3\n";
+      out << "      load r1 " << i << "\n";
+      out << "    catch\n";
+      out << "      throw r3\n";
+      out << "    end\n";
+      out << "  end\n";
+    }
+    out << "  return r1\n";
+    out << "end\n";
+  }
+
+  out << "interface 0 global\n";
+  for (unsigned f = 0; f < func_count; ++f) {
+    out << "  method " << f << " " << f << "\n";
+  }
+  out << "end\n";
+
+  return out.str();
+}
+
+// Fills `func` with `depth` nested Ifs, each guarded by a load of a
+// true condition, around a load and return of an i64
+inline void generate_if_nesting(zvm::Func& func, zvm::ProgramArena& arena, unsigned depth) {
+  using namespace zvm;
+
+  func.registers = {RegisterTypes::Bool, RegisterTypes::Int64};
+  func.return_type = RegisterTypes::Int64;
+
+  Block block = arena.block({
+    arena.create<LoadStatement>(1, 7),
+    arena.create<ReturnStatement>(1),
+  });
+
+  for (unsigned i = 0; i < depth; ++i) {
+    block = arena.block({
+      arena.create<LoadStatement>(0, 1),
+      arena.create<IfStatement>(0, std::move(block)),
+    });
+  }
+
+  func.block = std::move(block);
+}
+
+// Fills `func` with `length` loads into registers of every scalar
+// width, followed by a return
+inline void generate_load_run(zvm::Func& func, zvm::ProgramArena& arena, unsigned length) {
+  using namespace zvm;
+
+  func.registers = {
+    RegisterTypes::Int64,
+    RegisterTypes::Int32,
+    RegisterTypes::Int16,
+    RegisterTypes::Int8,
+    RegisterTypes::UInt64,
+    RegisterTypes::UInt32,
+    RegisterTypes::UInt16,
+    RegisterTypes::UInt8,
+  };
+  func.return_type = RegisterTypes::Int64;
+
+  func.block = arena.block(length + 1);
+  for (unsigned i = 0; i < length; ++i) {
+    func.block.push_back(arena.create<LoadStatement>(i % 8, i * 2654435761u));
+  }
+  func.block.push_back(arena.create<ReturnStatement>(0));
+}
+
+// A base interface type and `width` types which implement it. Each
+// implementation has the base's methods plus a few of its own, so
+// that every subtype check compares every base method.
+struct InterfaceHierarchy {
+  static constexpr zvm::RegisterType base_type = zvm::RegisterTypes::FirstInterfaceType + 1;
+
+  zvm::Func method;
+  std::vector<zvm::Interface> interfaces;
+  zvm::InterfaceTypeTable interface_types;
+
+  InterfaceHierarchy(unsigned width, unsigned method_count) :
+    interfaces(width + 1)
+  {
+    this->method.return_type = zvm::RegisterTypes::Int32;
+    for (unsigned i = 0; i <= width; ++i) {
+      auto count = method_count + (i == 0 ? 0 : i % 8);
+      for (unsigned name = 0; name < count; ++name) {
+        this->interfaces[i].func_map[static_cast<zvm::FuncName>(name)] = &this->method;
+      }
+      this->interface_types[base_type + i] = &this->interfaces[i];
+    }
+  }
+
+  InterfaceHierarchy(const InterfaceHierarchy& other) = delete;
+  InterfaceHierarchy& operator=(const InterfaceHierarchy& other) = delete;
+};
+
+// Fills `func` with one call per implementation in `hierarchy`,
+// passing it to `callee_name`, which takes the base type
+inline void generate_upcasts(
+  zvm::Func& func,
+  zvm::ProgramArena& arena,
+  const InterfaceHierarchy& hierarchy,
+  zvm::FuncName callee_name)
+{
+  using namespace zvm;
+
+  auto width = static_cast<Register>(hierarchy.interfaces.size() - 1);
+  std::vector<RegisterType> types;
+  for (Register i = 1; i <= width; ++i) {
+    types.push_back(InterfaceHierarchy::base_type + i);
+  }
+  func.registers = std::move(types);
+
+  func.block = arena.block(width + 1);
+  for (Register i = 0; i < width; ++i) {
+    func.block.push_back(arena.create<CallStatement>(
+      void_register(),
+      void_register(),
+      callee_name,
+      arena.args({i})));
+  }
+  func.block.push_back(arena.create<ReturnStatement>(void_register()));
+}
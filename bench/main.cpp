@@ -0,0 +1,291 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "program/parser.h"
+#include "program/traverse.h"
+#include "program/validator.h"
+#include "interpreter/interpreter.h"
+#include "interpreter/profile.h"
+#include "interpreter/superinstructions.h"
+#include "generators.h"
+
+using namespace zvm;
+
+// Benchmarks of the interpreter, validator and type checker over
+// generated programs. Prints one JSON object per benchmark:
+//
+//   {"name": "interpret_if_nesting", "size": 256, "iterations": 20000,
+//    "statements": 514, "ns_per_statement": 2.1,
+//    "allocations": 1, "allocated_bytes": 4096, "peak_rss_kb": 5120}
+//
+// `statements` is per iteration: executed statements for interpreter
+// benchmarks and the statements in the validated funcs otherwise.
+// Allocations and bytes are per iteration. Peak RSS is reset before
+// each benchmark where the kernel supports it, and is otherwise the
+// peak of the whole process.
+//
+// Usage: zvm_bench [scale], where scale multiplies the iterations
+
+namespace {
+
+  std::atomic<uint64_t> allocation_count {0};
+  std::atomic<uint64_t> allocated_bytes {0};
+
+  void* counted_allocate(std::size_t size, std::size_t alignment) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+
+    if (size == 0)
+      size = 1;
+
+    void* ptr = alignment <= alignof(std::max_align_t)
+      ? std::malloc(size)
+      : std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+    if (!ptr)
+      throw std::bad_alloc();
+    return ptr;
+  }
+
+}
+
+void* operator new(std::size_t size) {
+  return counted_allocate(size, alignof(std::max_align_t));
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  return counted_allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t alignment) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t alignment) noexcept {
+  std::free(ptr);
+}
+
+namespace {
+
+  void reset_peak_rss() {
+#if defined(__linux__)
+    std::ofstream clear_refs {"/proc/self/clear_refs"};
+    clear_refs << "5";
+#endif
+  }
+
+  long peak_rss_kb() {
+#if defined(__linux__)
+    std::ifstream status {"/proc/self/status"};
+    std::string line;
+    while (std::getline(status, line)) {
+      if (line.compare(0, 6, "VmHWM:") == 0)
+        return std::atol(line.c_str() + 6);
+    }
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#if defined(__APPLE__)
+      return usage.ru_maxrss / 1024;
+#else
+      return usage.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+  }
+
+  struct StatementCounter {
+    uint64_t count = 0;
+
+    template<typename S>
+    void enter_statement(const S& stmt) {
+      ++this->count;
+    }
+
+    template<typename S>
+    void leave_statement(const S& stmt) {}
+  };
+
+  uint64_t count_statements(const Func& func) {
+    StatementCounter counter;
+    traverse_block(func.block, counter);
+    return counter.count;
+  }
+
+  // Runs `func` once with ProfilingTraits and returns the number of
+  // statements executed
+  uint64_t count_executed(const Func& func) {
+    Interface global;
+    InterfaceTypeTable interface_types;
+    ExecutionProfile profile;
+    ProfilingTraits::current() = &profile;
+    {
+      Interpreter<ProfilingTraits> interpreter {global, interface_types};
+      InterpreterFrame<ProfilingTraits> frame {interpreter, func};
+      frame.execute();
+    }
+    ProfilingTraits::current() = nullptr;
+    return profile.funcs[&func].statements;
+  }
+
+  // Runs `iteration` `iterations` times and prints the result. Returns
+  // false if any iteration fails.
+  template<typename F>
+  bool measure(
+    const char* name,
+    unsigned size,
+    unsigned iterations,
+    uint64_t statements,
+    F iteration)
+  {
+    reset_peak_rss();
+    auto allocations_before = allocation_count.load();
+    auto bytes_before = allocated_bytes.load();
+
+    bool ok = true;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < iterations; ++i) {
+      ok &= iteration();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+    auto allocations = allocation_count.load() - allocations_before;
+    auto bytes = allocated_bytes.load() - bytes_before;
+
+    std::cout
+      << "{\"name\": \"" << name << "\""
+      << ", \"size\": " << size
+      << ", \"iterations\": " << iterations
+      << ", \"statements\": " << statements
+      << ", \"ns_per_statement\": " << elapsed.count() / (static_cast<double>(statements) * iterations)
+      << ", \"allocations\": " << static_cast<double>(allocations) / iterations
+      << ", \"allocated_bytes\": " << static_cast<double>(bytes) / iterations
+      << ", \"peak_rss_kb\": " << peak_rss_kb()
+      << ", \"ok\": " << (ok ? "true" : "false")
+      << "}\n";
+    return ok;
+  }
+
+  bool interpret(Interpreter<DefaultTraits>& interpreter, const Func& func, RegisterValue expected) {
+    InterpreterFrame<DefaultTraits> frame {interpreter, func};
+    return frame.execute() == ExitKind::Return && frame.return_value() == expected;
+  }
+
+}
+
+int main(int argc, char** argv) {
+  unsigned scale = argc > 1 ? static_cast<unsigned>(std::atoi(argv[1])) : 1;
+  if (scale == 0)
+    scale = 1;
+
+  bool ok = true;
+  ProgramArena arena;
+  Interface global;
+  InterfaceTypeTable interface_types;
+  Interpreter<DefaultTraits> interpreter {global, interface_types};
+
+  const unsigned depth = 256;
+  Func nested {arena.resource()};
+  generate_if_nesting(nested, arena, depth);
+
+  ok &= measure("interpret_if_nesting", depth, 20000 * scale, count_executed(nested), [&]() {
+    return interpret(interpreter, nested, 7);
+  });
+
+  ok &= measure("validate_if_nesting", depth, 2000 * scale, count_statements(nested), [&]() {
+    return validate_func(nested, global, interface_types);
+  });
+
+  const unsigned length = 4096;
+  Func loads {arena.resource()};
+  generate_load_run(loads, arena, length);
+  RegisterValue last_load = (length - 8) * 2654435761u;
+  auto load_statements = count_executed(loads);
+
+  ok &= measure("interpret_load_run", length, 5000 * scale, load_statements, [&]() {
+    return interpret(interpreter, loads, last_load);
+  });
+
+  // Counted by the statements before fusion, so that the two runs
+  // compare directly
+  Func fused_loads {arena.resource()};
+  generate_load_run(fused_loads, arena, length);
+  fuse_statements(fused_loads, arena, SuperinstructionSet::all());
+
+  ok &= measure("interpret_load_run_fused", length, 5000 * scale, load_statements, [&]() {
+    return interpret(interpreter, fused_loads, last_load);
+  });
+
+  ok &= measure("validate_load_run", length, 500 * scale, count_statements(loads), [&]() {
+    return validate_func(loads, global, interface_types);
+  });
+
+  // Every call passes an implementation where the base type is
+  // expected. Without a shared cache, each validation checks each
+  // implementation against the base again.
+  const unsigned width = 512;
+  InterfaceHierarchy hierarchy {width, 32};
+
+  Func take {arena.resource()};
+  take.arg_count = 1;
+  take.registers = {InterfaceHierarchy::base_type};
+  take.block = arena.block({arena.create<ReturnStatement>(void_register())});
+
+  Interface hierarchy_global;
+  hierarchy_global.func_map[0] = &take;
+
+  Func upcasts {arena.resource()};
+  generate_upcasts(upcasts, arena, hierarchy, 0);
+
+  ok &= measure("typecheck_wide_interfaces", width, 200 * scale, count_statements(upcasts), [&]() {
+    return validate_func(upcasts, hierarchy_global, hierarchy.interface_types);
+  });
+
+  SubtypeCache subtype_cache;
+  ok &= measure("typecheck_wide_interfaces_cached", width, 200 * scale, count_statements(upcasts), [&]() {
+    return validate_func(upcasts, hierarchy_global, hierarchy.interface_types, 0, &subtype_cache);
+  });
+
+  const unsigned func_count = 4000;
+  ParsedModule module;
+  auto text = generate_module(func_count);
+  ok &= parse_module(text.data(), text.size(), module);
+  auto funcs = module.func_list();
+
+  uint64_t module_statements = 0;
+  for (auto* func : funcs) {
+    module_statements += count_statements(*func);
+  }
+
+  ok &= measure("validate_module", func_count, 5 * scale, module_statements, [&]() {
+    bool valid = true;
+    for (auto* func : funcs) {
+      valid &= validate_func(*func, module.global(), module.interface_types);
+    }
+    return valid;
+  });
+
+  ok &= measure("validate_module_parallel", func_count, 5 * scale, module_statements, [&]() {
+    return validate_module(funcs, module.global(), module.interface_types).is_valid();
+  });
+
+  return ok ? 0 : 1;
+}
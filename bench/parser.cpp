@@ -0,0 +1,60 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "program/parser.h"
+#include "program/printer.h"
+#include "generators.h"
+
+using namespace zvm;
+
+template<typename F>
+double measure_mbps(std::size_t bytes, unsigned iterations, F parse) {
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < iterations; ++i) {
+    if (!parse()) {
+      std::cerr << "parse failed\n";
+      std::exit(1);
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return static_cast<double>(bytes) * iterations / elapsed.count() / (1024 * 1024);
+}
+
+int main(int argc, char** argv) {
+  unsigned func_count = argc > 1 ? std::atoi(argv[1]) : 8000;
+  unsigned iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+
+  auto text = generate_module(func_count);
+
+  auto memory_mbps = measure_mbps(text.size(), iterations, [&]() {
+    ParsedModule module;
+    return parse_module(text.data(), text.size(), module);
+  });
+
+  auto stream_mbps = measure_mbps(text.size(), iterations, [&]() {
+    ParsedModule module;
+    std::istringstream in {text};
+    return parse_module(in, module);
+  });
+
+  ParsedModule module;
+  parse_module(text.data(), text.size(), module);
+  std::ostringstream printed;
+  auto print_mbps = measure_mbps(text.size(), iterations, [&]() {
+    printed.str({});
+    print_module(printed, module.func_list(), module.global(), module.interface_types);
+    return true;
+  });
+
+  std::cout
+    << "bytes " << text.size()
+    << " parse_memory_mbps " << memory_mbps
+    << " parse_stream_mbps " << stream_mbps
+    << " print_mbps " << print_mbps
+    << " round_trip " << (printed.str() == text)
+    << "\n";
+  return 0;
+}
@@ -0,0 +1,27 @@
+# Builds a text module ahead of time into a shared library which
+# zvm::load_aot_module can open:
+#
+#   zvm_add_aot_module(<target> <module file>)
+#
+# The module is translated to C++ by zvm_aot at build time, then
+# compiled with optimization regardless of the build type. The library
+# must be loaded for the funcs of the same module, in the same order.
+function(zvm_add_aot_module target module)
+  get_filename_component(module_path "${module}" ABSOLUTE)
+  set(source "${CMAKE_CURRENT_BINARY_DIR}/${target}.cpp")
+
+  add_custom_command(
+    OUTPUT "${source}"
+    COMMAND zvm_aot "${module_path}" "${source}"
+    DEPENDS zvm_aot "${module_path}"
+    COMMENT "Emitting C++ for ${module}"
+    VERBATIM)
+
+  add_library(${target} MODULE "${source}")
+  set_target_properties(${target} PROPERTIES CXX_VISIBILITY_PRESET hidden)
+  if (MSVC)
+    target_compile_options(${target} PRIVATE /O2)
+  else()
+    target_compile_options(${target} PRIVATE -O2)
+  endif()
+endfunction()
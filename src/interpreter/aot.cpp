@@ -0,0 +1,574 @@
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "aot.h"
+#include "interpreter.h"
+#include "program/traverse.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define ZVM_AOT_LOADER 1
+#include <dlfcn.h>
+#else
+#define ZVM_AOT_LOADER 0
+#endif
+
+namespace zvm {
+
+  namespace {
+
+    // Call sites and statements of a set of funcs, numbered in
+    // traversal order. Fused funcs are left to the interpreter and not
+    // numbered. The emitter and the loader number them the same
+    // way, so a library can be checked against and bound to its funcs.
+    struct CallNumbering {
+      struct Site {
+        const CallStatement* stmt;
+        const Func* func;
+      };
+
+      std::unordered_map<const CallStatement*, uint32_t> indices;
+      std::vector<Site> sites;
+      uint32_t statement_count = 0;
+      const Func* func = nullptr;
+
+      explicit CallNumbering(const std::vector<Pointer<Func>>& funcs) {
+        for (auto* func : funcs) {
+          if (contains_fused_statements(func->block))
+            continue;
+
+          this->func = func;
+          traverse_block(func->block, *this);
+        }
+      }
+
+      template<typename S>
+      void enter_statement(const S& stmt) {
+        ++this->statement_count;
+      }
+
+      void enter_statement(const CallStatement& stmt) {
+        ++this->statement_count;
+        this->indices[&stmt] = static_cast<uint32_t>(this->sites.size());
+        this->sites.push_back({&stmt, this->func});
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    struct Yields {
+      bool yields = false;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {}
+
+      void enter_statement(const YieldStatement& stmt) {
+        this->yields = true;
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    // Callee registers of a direct call live in a local array, so
+    // funcs with larger frames are called through the runtime
+    constexpr uint32_t max_direct_frame_size = 4096;
+
+    // Machine stack charged for a direct call beyond the callee's
+    // registers, for the emitted function's own frame
+    constexpr uint32_t direct_call_overhead = 256;
+
+    const char* preamble = R"(// Generated by emit_aot_module. Do not edit.
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(_WIN32)
+#define ZVM_AOT_EXPORT __declspec(dllexport)
+#else
+#define ZVM_AOT_EXPORT __attribute__((visibility("default")))
+#endif
+
+namespace zvm_aot {
+
+  struct CallSite {
+    const void* stmt;
+    const void* slots;
+  };
+
+  struct Runtime {
+    uint64_t return_value;
+    uint64_t thrown_value;
+    int (*call)(Runtime& runtime, unsigned char* registers, const CallSite& call);
+    void* context;
+    uint32_t depth;
+    uint32_t stack_budget;
+  };
+
+  using Entry = int (*)(Runtime& runtime, unsigned char* registers);
+
+  struct Module {
+    uint32_t version;
+    uint32_t func_count;
+    uint32_t call_count;
+    uint32_t statement_count;
+    const Entry* funcs;
+    CallSite* calls;
+  };
+
+  template<typename T>
+  inline T get(const unsigned char* registers, uint32_t offset) {
+    T value;
+    std::memcpy(&value, registers + offset, sizeof(T));
+    return value;
+  }
+
+  template<typename T>
+  inline void set(unsigned char* registers, uint32_t offset, T value) {
+    std::memcpy(registers + offset, &value, sizeof(T));
+  }
+)";
+
+    const char* slot_type(const RegisterSlot& slot) {
+      switch (slot.width) {
+        case 1:
+          return slot.is_signed ? "int8_t" : "uint8_t";
+        case 2:
+          return slot.is_signed ? "int16_t" : "uint16_t";
+        case 4:
+          return slot.is_signed ? "int32_t" : "uint32_t";
+        default:
+          return "uint64_t";
+      }
+    }
+
+    struct AotEmitter {
+      enum class ScopeKind {
+        Repeat,
+        Try,
+        Finally,
+      };
+
+      // An enclosing statement which an exit may pass through
+      struct Scope {
+        ScopeKind kind;
+        const Statement* stmt;
+        // Label number of a Try's catch block
+        uint32_t label;
+      };
+
+      std::ostream& out;
+      const Interface& global;
+      const InterfaceTypeTable& interface_types;
+      const CallNumbering& numbering;
+      // Index of every func emitted as native code
+      std::unordered_map<const Func*, uint32_t> natives;
+      const Func* func = nullptr;
+      std::vector<Scope> scopes;
+      uint32_t next_label = 0;
+      uint32_t next_value = 0;
+      int depth = 0;
+
+      AotEmitter(
+        std::ostream& out,
+        const Interface& global,
+        const InterfaceTypeTable& interface_types,
+        const CallNumbering& numbering) :
+          out {out},
+          global {global},
+          interface_types {interface_types},
+          numbering {numbering} {}
+
+      std::ostream& line() {
+        for (int i = 0; i < this->depth; ++i) {
+          this->out << "  ";
+        }
+        return this->out;
+      }
+
+      void open(const char* text) {
+        this->line() << text << "\n";
+        ++this->depth;
+      }
+
+      void close(const char* text = "}") {
+        --this->depth;
+        this->line() << text << "\n";
+      }
+
+      std::string get(const Func& func, const char* window, Register reg) {
+        auto& slot = func.registers.slots[reg];
+        if (slot.width == 0)
+          return "uint64_t(0)";
+
+        return
+          std::string("uint64_t(get<") + slot_type(slot) + ">(" + window +
+          ", " + std::to_string(slot.offset) + "))";
+      }
+
+      void set(const Func& func, const char* window, Register reg, const std::string& value) {
+        auto& slot = func.registers.slots[reg];
+        if (slot.width == 0)
+          return;
+
+        auto type = slot_type(slot);
+        this->line()
+          << "set<" << type << ">(" << window << ", " << slot.offset
+          << ", " << type << "(" << value << "));\n";
+      }
+
+      void emit_func(const Func& func, uint32_t index) {
+        this->func = &func;
+        this->next_label = 0;
+        this->next_value = 0;
+
+        this->line() << "static int f" << index << "(Runtime& rt, unsigned char* r) {\n";
+        ++this->depth;
+        this->line() << "uint64_t thrown = 0;\n";
+        this->line() << "(void)thrown;\n";
+        this->emit_block(func.block);
+        this->line() << "rt.return_value = 0;\n";
+        this->line() << "return 2;\n";
+        this->close();
+        this->out << "\n";
+      }
+
+      void emit_block(const Block& block) {
+        for (auto& stmt : block) {
+          map_statement(*stmt, *this);
+        }
+      }
+
+      // Leaves enclosing statements for a Break, Return or Throw,
+      // inlining the finally blocks on the way out. A Return's value is
+      // read once they have run, as in the interpreter; a thrown value
+      // is taken before.
+      void emit_exit(ExitKind exit, const std::string& value) {
+        this->open("{");
+        std::string name = "value" + std::to_string(this->next_value++);
+        if (exit == ExitKind::Throw)
+          this->line() << "uint64_t " << name << " = " << value << ";\n";
+
+        for (auto i = this->scopes.size(); i-- > 0;) {
+          auto scope = this->scopes[i];
+
+          if (scope.kind == ScopeKind::Finally) {
+            // The finally block runs outside its own statement
+            auto saved = this->scopes;
+            this->scopes.resize(i);
+            this->emit_block(cast_statement<FinallyStatement>(*scope.stmt).finally_block);
+            this->scopes = std::move(saved);
+            continue;
+          }
+
+          if (scope.kind == ScopeKind::Repeat && exit == ExitKind::Break) {
+            this->line() << "break;\n";
+            this->close();
+            return;
+          }
+
+          if (scope.kind == ScopeKind::Try && exit == ExitKind::Throw) {
+            this->line() << "thrown = " << name << ";\n";
+            this->line() << "goto catch" << scope.label << ";\n";
+            this->close();
+            return;
+          }
+        }
+
+        if (exit == ExitKind::Throw) {
+          this->line() << "rt.thrown_value = " << name << ";\n";
+          this->line() << "return 3;\n";
+        } else {
+          this->line() << "rt.return_value = " << value << ";\n";
+          this->line() << "return 2;\n";
+        }
+        this->close();
+      }
+
+      void operator()(const LoadStatement& stmt) {
+        this->set(*this->func, "r", stmt.target, "UINT64_C(" + std::to_string(stmt.value) + ")");
+      }
+
+      bool is_direct(const Func* callee) const {
+        return
+          callee &&
+          this->natives.count(callee) &&
+          callee->registers.frame_size <= max_direct_frame_size;
+      }
+
+      // Sets `exit` to the callee's exit kind and stores its result.
+      // The depth bound alone would let callees with large windows
+      // overflow the machine stack, so each call is also charged
+      // against rt.stack_budget.
+      void emit_direct_call(const CallStatement& stmt, const Func& callee) {
+        auto size = std::max<uint32_t>(callee.registers.frame_size, RegisterList::frame_alignment);
+        auto charge = std::to_string(size + direct_call_overhead);
+
+        this->open(
+          "if (rt.depth >= " + std::to_string(JitRuntime::max_depth) +
+          " || rt.stack_budget < " + charge + ") {");
+        this->line() << "rt.thrown_value = 0;\n";
+        this->line() << "exit = 3;\n";
+        this->close("} else {");
+        ++this->depth;
+
+        this->line() << "alignas(8) unsigned char w[" << size << "] = {};\n";
+        for (Register i = 0; i < stmt.args.size(); ++i) {
+          this->set(callee, "w", i, this->get(*this->func, "r", stmt.args[i]));
+        }
+
+        this->line() << "++rt.depth;\n";
+        this->line() << "rt.stack_budget -= " << charge << ";\n";
+        this->line() << "exit = f" << this->natives.at(&callee) << "(rt, w);\n";
+        this->line() << "rt.stack_budget += " << charge << ";\n";
+        this->line() << "--rt.depth;\n";
+        if (stmt.target != void_register()) {
+          this->open("if (exit == 2) {");
+          this->set(*this->func, "r", stmt.target, "rt.return_value");
+          this->close();
+        }
+        this->close();
+      }
+
+      void emit_runtime_call(const CallStatement& stmt) {
+        this->line()
+          << "exit = rt.call(rt, r, call_sites["
+          << this->numbering.indices.at(&stmt) << "]);\n";
+      }
+
+      void operator()(const CallStatement& stmt) {
+        this->open("{");
+        this->line() << "int exit;\n";
+
+        if (stmt.interface == void_register()) {
+          const Func* callee = stmt.callee;
+          if (!callee) {
+            auto iter = this->global.func_map.find(stmt.func_name);
+            if (iter != this->global.func_map.end())
+              callee = iter->second;
+          }
+
+          if (this->is_direct(callee))
+            this->emit_direct_call(stmt, *callee);
+          else
+            this->emit_runtime_call(stmt);
+        } else {
+          std::vector<std::pair<RegisterType, const Func*>> cases;
+          for (auto& entry : this->interface_types) {
+            auto iter = entry.second->func_map.find(stmt.func_name);
+            if (iter != entry.second->func_map.end() && this->is_direct(iter->second))
+              cases.push_back({entry.first, iter->second});
+          }
+          std::sort(cases.begin(), cases.end());
+
+          this->open(
+            "switch (static_cast<uint32_t>(" +
+            this->get(*this->func, "r", stmt.interface) + ")) {");
+          for (auto& entry : cases) {
+            this->open(("case " + std::to_string(entry.first) + ": {").c_str());
+            this->emit_direct_call(stmt, *entry.second);
+            this->line() << "break;\n";
+            this->close();
+          }
+          this->open("default:");
+          this->emit_runtime_call(stmt);
+          this->line() << "break;\n";
+          --this->depth;
+          this->close();
+        }
+
+        this->open("if (exit != 2) {");
+        this->emit_exit(ExitKind::Throw, "rt.thrown_value");
+        this->close();
+        this->close();
+      }
+
+      void open(const std::string& text) {
+        this->open(text.c_str());
+      }
+
+      void operator()(const IfStatement& stmt) {
+        this->open("if (" + this->get(*this->func, "r", stmt.source) + " != 0) {");
+        this->emit_block(stmt.true_block);
+        if (!stmt.false_block.empty()) {
+          this->close("} else {");
+          ++this->depth;
+          this->emit_block(stmt.false_block);
+        }
+        this->close();
+      }
+
+      void operator()(const RepeatStatement& stmt) {
+        this->open("for (;;) {");
+        this->scopes.push_back({ScopeKind::Repeat, &stmt, 0});
+        this->emit_block(stmt.block);
+        this->scopes.pop_back();
+        this->close();
+      }
+
+      void operator()(const BreakStatement& stmt) {
+        this->emit_exit(ExitKind::Break, "");
+      }
+
+      void operator()(const TryStatement& stmt) {
+        auto label = this->next_label++;
+
+        this->open("{");
+        this->scopes.push_back({ScopeKind::Try, &stmt, label});
+        this->emit_block(stmt.try_block);
+        this->scopes.pop_back();
+        this->close();
+
+        this->line() << "goto end" << label << ";\n";
+        this->line() << "catch" << label << ":\n";
+        this->open("{");
+        if (stmt.target != void_register())
+          this->set(*this->func, "r", stmt.target, "thrown");
+        this->emit_block(stmt.catch_block);
+        this->close();
+        this->line() << "end" << label << ":;\n";
+      }
+
+      void operator()(const FinallyStatement& stmt) {
+        this->open("{");
+        this->scopes.push_back({ScopeKind::Finally, &stmt, 0});
+        this->emit_block(stmt.block);
+        this->scopes.pop_back();
+        this->close();
+        this->emit_block(stmt.finally_block);
+      }
+
+      void operator()(const ReturnStatement& stmt) {
+        this->emit_exit(
+          ExitKind::Return,
+          stmt.source == void_register()
+            ? std::string("0")
+            : this->get(*this->func, "r", stmt.source));
+      }
+
+      void operator()(const YieldStatement& stmt) {}
+
+      void operator()(const ThrowStatement& stmt) {
+        this->emit_exit(
+          ExitKind::Throw,
+          stmt.source == void_register()
+            ? std::string("0")
+            : this->get(*this->func, "r", stmt.source));
+      }
+    };
+
+  }
+
+  void emit_aot_module(
+    std::ostream& out,
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types)
+  {
+    CallNumbering numbering {funcs};
+    AotEmitter emitter {out, global, interface_types, numbering};
+
+    for (uint32_t i = 0; i < funcs.size(); ++i) {
+      if (contains_fused_statements(funcs[i]->block))
+        continue;
+
+      Yields yields;
+      traverse_block(funcs[i]->block, yields);
+      if (!yields.yields)
+        emitter.natives.emplace(funcs[i], i);
+    }
+
+    out << preamble << "\n";
+    emitter.depth = 1;
+
+    auto call_count = numbering.sites.size();
+    if (call_count)
+      emitter.line() << "CallSite call_sites[" << call_count << "];\n\n";
+
+    for (uint32_t i = 0; i < funcs.size(); ++i) {
+      if (emitter.natives.count(funcs[i]))
+        emitter.line() << "static int f" << i << "(Runtime& rt, unsigned char* r);\n";
+    }
+    out << "\n";
+
+    for (uint32_t i = 0; i < funcs.size(); ++i) {
+      if (emitter.natives.count(funcs[i]))
+        emitter.emit_func(*funcs[i], i);
+    }
+
+    if (!funcs.empty()) {
+      emitter.open("const Entry funcs[] = {");
+      for (uint32_t i = 0; i < funcs.size(); ++i) {
+        if (emitter.natives.count(funcs[i]))
+          emitter.line() << "f" << i << ",\n";
+        else
+          emitter.line() << "nullptr,\n";
+      }
+      emitter.close("};");
+    }
+
+    out
+      << "\n}\n\n"
+      << "extern \"C\" ZVM_AOT_EXPORT const zvm_aot::Module zvm_aot_module = {\n"
+      << "  " << AotModule::abi_version << ",\n"
+      << "  " << funcs.size() << ",\n"
+      << "  " << call_count << ",\n"
+      << "  " << numbering.statement_count << ",\n"
+      << "  " << (funcs.empty() ? "nullptr" : "zvm_aot::funcs") << ",\n"
+      << "  " << (call_count ? "zvm_aot::call_sites" : "nullptr") << ",\n"
+      << "};\n";
+  }
+
+  AotLibrary::~AotLibrary() {
+#if ZVM_AOT_LOADER
+    if (this->handle)
+      dlclose(this->handle);
+#endif
+  }
+
+  bool load_aot_module(
+    const char* path,
+    const std::vector<Pointer<Func>>& funcs,
+    AotLibrary& library,
+    Jit& natives)
+  {
+#if ZVM_AOT_LOADER
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle)
+      return false;
+
+    auto* module = static_cast<const AotModule*>(dlsym(handle, "zvm_aot_module"));
+    CallNumbering numbering {funcs};
+
+    if (
+      !module ||
+      module->version != AotModule::abi_version ||
+      module->func_count != funcs.size() ||
+      module->call_count != numbering.sites.size() ||
+      module->statement_count != numbering.statement_count)
+    {
+      dlclose(handle);
+      return false;
+    }
+
+    for (uint32_t i = 0; i < module->call_count; ++i) {
+      auto& site = numbering.sites[i];
+      module->calls[i] = {site.stmt, site.func->registers.slots.data()};
+    }
+
+    for (uint32_t i = 0; i < module->func_count; ++i) {
+      if (module->funcs[i])
+        natives.add(*funcs[i], module->funcs[i]);
+    }
+
+    if (library.handle)
+      dlclose(library.handle);
+    library.handle = handle;
+    return true;
+#else
+    return false;
+#endif
+  }
+
+}
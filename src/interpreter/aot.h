@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+#include <vector>
+#include "program/func.h"
+#include "jit.h"
+
+namespace zvm {
+
+  // The descriptor exported as `zvm_aot_module` by a library built
+  // from emit_aot_module output
+  struct AotModule {
+    static constexpr uint32_t abi_version = 2;
+
+    uint32_t version;
+    uint32_t func_count;
+    uint32_t call_count;
+    // Compared with the funcs the library is loaded for
+    uint32_t statement_count;
+    // Indexed like the emitted funcs. Null for funcs left to the
+    // interpreter.
+    const NativeCode* funcs;
+    // Call sites which go through the runtime's call handler, bound
+    // when the library is loaded
+    JitCall* calls;
+  };
+
+  // Emits a self-contained C++ translation unit with one native
+  // function per func, using the NativeCode calling convention. If,
+  // Repeat, Break and Try map directly onto C++ control flow, finally
+  // blocks are inlined on every exit from their protected block, and
+  // interface calls switch over the types in `interface_types` which
+  // implement the method. Calls to emitted funcs are direct and keep
+  // the callee's registers on the machine stack, charged against the
+  // runtime's stack_budget; any other call goes through the runtime's
+  // call handler. Funcs which yield or have been fused are left to the
+  // interpreter.
+  //
+  // Build the output with zvm_add_aot_module (cmake/ZvmAot.cmake) and
+  // open it with load_aot_module for the same funcs.
+  void emit_aot_module(
+    std::ostream& out,
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types);
+
+  // An opened AOT library. Closing it invalidates the entry points
+  // which were added from it.
+  struct AotLibrary {
+    void* handle = nullptr;
+
+    AotLibrary() {}
+    ~AotLibrary();
+
+    AotLibrary(const AotLibrary& other) = delete;
+    AotLibrary& operator=(const AotLibrary& other) = delete;
+  };
+
+  // Opens a library built from emit_aot_module output for `funcs`,
+  // binds its call sites and adds its entry points to `natives`.
+  // Returns false if the library cannot be opened or was emitted for
+  // different funcs.
+  bool load_aot_module(
+    const char* path,
+    const std::vector<Pointer<Func>>& funcs,
+    AotLibrary& library,
+    Jit& natives);
+
+}
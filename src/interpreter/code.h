@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include "program/func.h"
+
+namespace zvm {
+
+  // Lowered, linear form of a Func. Structured control flow is
+  // replaced with jumps whose offsets are relative to the jump
+  // instruction itself.
+
+  enum class Opcode : uint8_t {
+    Load,
+    Call,
+    Jump,
+    JumpIfFalse,
+    Return,
+    Yield,
+    Throw,
+    // Jump out of one or more finally-protected regions; the finally
+    // blocks run before the jump completes
+    Leave,
+    // Ends a finally block, continuing any pending exit
+    EndFinally,
+    End,
+  };
+
+  struct Instruction {
+    Opcode op;
+    // Target register for Load, source register for JumpIfFalse,
+    // Return, Yield and Throw
+    Register reg;
+    // Relative offset for jumps and Leave, call site index for Call,
+    // handler index for EndFinally
+    int32_t operand;
+    // Immediate value for Load
+    RegisterValue value;
+  };
+
+  static_assert(sizeof(Instruction) == 16, "Instruction should be 16 bytes");
+
+  struct CallSite {
+    Register target;
+    Register interface;
+    FuncName func_name;
+    uint32_t args_begin;
+    uint32_t arg_count;
+    // Copied from the linked CallStatement
+    MethodSlot slot;
+    // Index of the callee within a module image, if any
+    uint32_t callee_index;
+    const Func* callee;
+  };
+
+  static_assert(sizeof(CallSite) == 32, "CallSite should be 32 bytes");
+
+  constexpr uint32_t no_callee_index() { return ~0u; }
+
+  enum class HandlerKind : uint8_t {
+    Catch,
+    Finally,
+  };
+
+  // Exception side table entry. Nothing is executed on entry to a
+  // protected range; a Throw, Return or Leave looks up the handlers
+  // covering its position instead. Inner ranges come before the
+  // ranges enclosing them.
+  struct Handler {
+    // Protected instructions, [begin, end)
+    uint32_t begin;
+    uint32_t end;
+    // The catch or finally block, [target, target_end)
+    uint32_t target;
+    uint32_t target_end;
+    HandlerKind kind;
+    // Receives the thrown value in a catch block
+    Register reg;
+  };
+
+  static_assert(sizeof(Handler) == 20, "Handler should be 20 bytes");
+
+  // Non-owning view of lowered code. The arrays may belong to a Code
+  // object or to a mapped module image.
+  struct CodeView {
+    const Instruction* instructions = nullptr;
+    uint32_t instruction_count = 0;
+    const CallSite* calls = nullptr;
+    uint32_t call_count = 0;
+    const Register* args = nullptr;
+    uint32_t arg_count = 0;
+    const Handler* handlers = nullptr;
+    uint32_t handler_count = 0;
+    Register register_count = 0;
+
+    const Register* call_args(const CallSite& site) const {
+      return this->args + site.args_begin;
+    }
+  };
+
+  // Finds the targets of calls made by lowered code. Implemented by
+  // LoweredModule for lowered funcs and by ModuleImage for mapped
+  // modules.
+  struct CodeResolver {
+    // `receiver_type` is the interface type of the receiver, or zero
+    // for a global call. Returns the callee and its code, or nullptr
+    // if the call cannot be resolved.
+    virtual const Func* resolve(
+      const CallSite& site,
+      RegisterType receiver_type,
+      CodeView& code) const = 0;
+
+  protected:
+    ~CodeResolver() {}
+  };
+
+  struct Code {
+    const Func* func = nullptr;
+    std::vector<Instruction> instructions;
+    std::vector<CallSite> calls;
+    std::vector<Register> args;
+    std::vector<Handler> handlers;
+
+    const Register* call_args(const CallSite& site) const {
+      return this->args.data() + site.args_begin;
+    }
+
+    CodeView view() const {
+      return {
+        this->instructions.data(),
+        static_cast<uint32_t>(this->instructions.size()),
+        this->calls.data(),
+        static_cast<uint32_t>(this->calls.size()),
+        this->args.data(),
+        static_cast<uint32_t>(this->args.size()),
+        this->handlers.data(),
+        static_cast<uint32_t>(this->handlers.size()),
+        static_cast<Register>(this->func->registers.size()),
+      };
+    }
+  };
+
+}
@@ -0,0 +1,522 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "interpreter.h"
+#include "code.h"
+#include "traits.h"
+
+namespace zvm {
+
+  // Executes lowered code. Behaves like InterpreterFrame, but walks
+  // a single instruction array instead of the block tree. Calls push
+  // a callee frame running the code supplied by the resolver.
+  template<typename Traits>
+  struct CodeFrame {
+    // Calls nest in lowered code as they do on the native stack, so
+    // their depth is bounded
+    static constexpr std::size_t max_depth = 10000;
+
+    // A Return, Leave or Throw waiting for a finally block to complete
+    struct PendingExit {
+      ExitKind exit;
+      uint32_t handler;
+      // Jump target of a Leave
+      uint32_t target;
+      Register return_register;
+      RegisterValue thrown_value;
+    };
+
+    CodeView code;
+    const Instruction* pc;
+    std::vector<RegisterValue> registers;
+    Register return_register = void_register();
+    Register yield_register = void_register();
+    RegisterValue thrown_value = 0;
+    // Only used once an exit passes through a finally block
+    std::vector<PendingExit> pending;
+    // Finds the targets of calls. Without one, every call throws 0.
+    const CodeResolver* resolver;
+    // The outermost frame of the call chain, which owns the callee
+    // frames
+    CodeFrame* root = this;
+    CodeFrame* caller = nullptr;
+    // Register in the caller which receives the return value
+    Register call_target = void_register();
+    // Set on the outermost frame while it is suspended: the frame,
+    // possibly a callee, which yielded and continues on resume
+    CodeFrame* active = nullptr;
+    // Owned by the outermost frame: callee frames, reused across
+    // calls, and the number in use. Calls return in the reverse order
+    // they were made, so the frames in use are always a prefix.
+    std::vector<std::unique_ptr<CodeFrame>> callees;
+    std::size_t depth = 0;
+
+    explicit CodeFrame(
+      const CodeView& code,
+      const CodeResolver* resolver = nullptr) :
+        code {code},
+        pc {code.instructions},
+        resolver {resolver}
+    {
+      this->registers.resize(code.register_count);
+    }
+
+    explicit CodeFrame(
+      const Code& code,
+      const CodeResolver* resolver = nullptr) :
+        CodeFrame {code.view(), resolver} {}
+
+    CodeFrame(const CodeFrame& other) = delete;
+    CodeFrame& operator=(const CodeFrame& other) = delete;
+
+    void enter(const CodeView& code, CodeFrame* caller, Register call_target) {
+      this->code = code;
+      this->pc = code.instructions;
+      this->registers.assign(code.register_count, 0);
+      this->return_register = void_register();
+      this->yield_register = void_register();
+      this->thrown_value = 0;
+      this->pending.clear();
+      this->root = caller->root;
+      this->caller = caller;
+      this->call_target = call_target;
+    }
+
+    void check_reg(Register reg) {
+      if constexpr (Traits::check) {
+        if (reg >= this->registers.size())
+          Traits::check_failed("register out of range");
+      }
+    }
+
+    void set_reg(Register target, RegisterValue value) {
+      this->check_reg(target);
+      this->registers[target] = value;
+    }
+
+    RegisterValue get_reg(Register source) {
+      this->check_reg(source);
+      return this->registers[source];
+    }
+
+    RegisterValue return_value() {
+      return this->return_register == void_register()
+        ? 0
+        : this->get_reg(this->return_register);
+    }
+
+    bool is_suspended() const {
+      return this->active != nullptr;
+    }
+
+    // The value passed to the last yield, which may have been made by
+    // a callee of this frame
+    RegisterValue yielded_value() {
+      CodeFrame* frame = this->active ? this->active : this;
+      return frame->yield_register == void_register()
+        ? 0
+        : frame->get_reg(frame->yield_register);
+    }
+
+    const Instruction& next_instruction() {
+      if constexpr (Traits::check) {
+        auto* instructions = this->code.instructions;
+        if (
+          this->pc < instructions ||
+          this->pc >= instructions + this->code.instruction_count)
+        {
+          Traits::check_failed("instruction out of range");
+        }
+      }
+
+      auto& inst = *this->pc;
+      if constexpr (Traits::trace)
+        Traits::trace_instruction(inst);
+      return inst;
+    }
+
+    uint32_t position(const Instruction& inst) const {
+      return static_cast<uint32_t>(&inst - this->code.instructions);
+    }
+
+    static bool contains(uint32_t begin, uint32_t end, uint32_t position) {
+      return position >= begin && position < end;
+    }
+
+    // Drops pending exits whose finally blocks have been left
+    void drop_pending() {
+      auto position = this->position(*this->pc);
+      while (!this->pending.empty()) {
+        auto& handler = this->code.handlers[this->pending.back().handler];
+        if (contains(handler.target, handler.target_end, position))
+          return;
+        this->pending.pop_back();
+      }
+    }
+
+    // Continues a Return, Throw or Leave (as ExitKind::Break) made at
+    // `from`, using the handler table. Returns ExitKind::Normal if
+    // execution continues in this frame.
+    ExitKind complete(ExitKind exit, uint32_t from, uint32_t target = 0) {
+      for (uint32_t i = 0; i < this->code.handler_count; ++i) {
+        auto& handler = this->code.handlers[i];
+        if (!contains(handler.begin, handler.end, from))
+          continue;
+
+        if (handler.kind == HandlerKind::Finally) {
+          // A jump within the protected range does not leave it
+          if (exit == ExitKind::Break && contains(handler.begin, handler.end, target))
+            continue;
+
+          this->pc = this->code.instructions + handler.target;
+          this->drop_pending();
+          this->pending.push_back({
+            exit,
+            i,
+            target,
+            this->return_register,
+            this->thrown_value,
+          });
+          return ExitKind::Normal;
+        }
+
+        if (exit == ExitKind::Throw) {
+          if (handler.reg != void_register())
+            this->set_reg(handler.reg, this->thrown_value);
+          this->pc = this->code.instructions + handler.target;
+          this->drop_pending();
+          return ExitKind::Normal;
+        }
+      }
+
+      if (exit == ExitKind::Break) {
+        this->pc = this->code.instructions + target;
+        this->drop_pending();
+        return ExitKind::Normal;
+      }
+
+      this->pending.clear();
+      return exit;
+    }
+
+    CodeFrame* acquire_frame(const CodeView& code, Register target) {
+      auto& root = *this->root;
+      if (root.depth >= max_depth)
+        return nullptr;
+
+      if (root.depth == root.callees.size())
+        root.callees.push_back(std::make_unique<CodeFrame>(code, this->resolver));
+
+      CodeFrame* frame = root.callees[root.depth++].get();
+      frame->enter(code, this, target);
+      return frame;
+    }
+
+    // Releases the most recently acquired callee frame
+    void release_frame() {
+      --this->root->depth;
+    }
+
+    ExitKind execute_load(const Instruction& inst) {
+      this->set_reg(inst.reg, inst.value);
+      ++this->pc;
+      return ExitKind::Normal;
+    }
+
+    // Returns the callee frame, or nullptr if the call threw, with the
+    // value in thrown_value
+    CodeFrame* enter_call(const Instruction& inst) {
+      ++this->pc;
+      this->thrown_value = 0;
+      if (!this->resolver)
+        return nullptr;
+
+      auto& site = this->code.calls[inst.operand];
+      RegisterType receiver_type = site.interface == void_register()
+        ? 0
+        : interface_value_type(this->get_reg(site.interface));
+
+      CodeView callee_code;
+      const Func* target = this->resolver->resolve(site, receiver_type, callee_code);
+      if (!target)
+        return nullptr;
+
+      if constexpr (Traits::check) {
+        if (site.arg_count != target->arg_count)
+          Traits::check_failed("wrong number of arguments");
+      }
+
+      CodeFrame* callee = this->acquire_frame(callee_code, site.target);
+      if (!callee)
+        return nullptr;
+
+      auto* args = this->code.call_args(site);
+      for (Register i = 0; i < site.arg_count; ++i) {
+        callee->set_reg(i, this->get_reg(args[i]));
+      }
+
+      return callee;
+    }
+
+    // Completes a call, passing the return value to the caller.
+    // Returns the caller frame.
+    CodeFrame* leave_call() {
+      CodeFrame* caller = this->caller;
+      if (this->call_target != void_register())
+        caller->set_reg(this->call_target, this->return_value());
+
+      this->release_frame();
+      return caller;
+    }
+
+    // Passes the thrown value to the caller. Returns the caller frame.
+    CodeFrame* leave_throw() {
+      CodeFrame* caller = this->caller;
+      caller->thrown_value = this->thrown_value;
+      this->release_frame();
+      return caller;
+    }
+
+    // Releases every frame above this one, starting with `frame`
+    void unwind(CodeFrame* frame) {
+      while (frame != this) {
+        CodeFrame* caller = frame->caller;
+        this->release_frame();
+        frame = caller;
+      }
+    }
+
+    // Throws the value left in thrown_value by enter_call, from the
+    // call instruction. A call which cannot be made throws 0.
+    ExitKind fail_call() {
+      return this->complete(ExitKind::Throw, this->position(*(this->pc - 1)));
+    }
+
+    ExitKind execute_jump(const Instruction& inst) {
+      this->pc += inst.operand;
+      return ExitKind::Normal;
+    }
+
+    ExitKind execute_jump_if_false(const Instruction& inst) {
+      this->pc += this->get_reg(inst.reg) == 0 ? inst.operand : 1;
+      return ExitKind::Normal;
+    }
+
+    ExitKind execute_return(const Instruction& inst) {
+      ++this->pc;
+      this->return_register = inst.reg;
+      if (!this->code.handler_count)
+        return ExitKind::Return;
+      return this->complete(ExitKind::Return, this->position(inst));
+    }
+
+    ExitKind execute_yield(const Instruction& inst) {
+      ++this->pc;
+      this->yield_register = inst.reg;
+      return ExitKind::Yield;
+    }
+
+    ExitKind execute_throw(const Instruction& inst) {
+      ++this->pc;
+      this->thrown_value = inst.reg == void_register()
+        ? 0
+        : this->get_reg(inst.reg);
+      return this->complete(ExitKind::Throw, this->position(inst));
+    }
+
+    ExitKind execute_leave(const Instruction& inst) {
+      auto from = this->position(inst);
+      return this->complete(ExitKind::Break, from, from + inst.operand);
+    }
+
+    ExitKind execute_end_finally(const Instruction& inst) {
+      auto handler = static_cast<uint32_t>(inst.operand);
+      if (this->pending.empty() || this->pending.back().handler != handler) {
+        ++this->pc;
+        return ExitKind::Normal;
+      }
+
+      auto pending = this->pending.back();
+      this->pending.pop_back();
+      this->return_register = pending.return_register;
+      this->thrown_value = pending.thrown_value;
+      return this->complete(pending.exit, this->position(inst), pending.target);
+    }
+
+    ExitKind execute_end(const Instruction& inst) {
+      return ExitKind::Return;
+    }
+
+    // Runs this frame, and any frames it calls, until this frame
+    // exits or a yield suspends it
+    ExitKind execute() {
+      if (this->active)
+        return ExitKind::Throw;
+
+      return this->run(this);
+    }
+
+    // Continues a suspended frame. After a yield, pc already points
+    // past the Yield instruction, so resuming is just running again.
+    ExitKind resume() {
+      CodeFrame* frame = this->active;
+      if (!frame)
+        return ExitKind::Throw;
+
+      this->active = nullptr;
+      return this->run(frame);
+    }
+
+    // Continues the driver loop after `frame` exits with `exit`.
+    // Returns the frame to continue in, or nullptr if execution stops.
+    CodeFrame* after_exit(CodeFrame* frame, ExitKind& exit) {
+      if (exit == ExitKind::Yield) {
+        this->active = frame;
+        return nullptr;
+      }
+
+      while (exit == ExitKind::Throw && frame != this) {
+        frame = frame->leave_throw();
+        exit = frame->fail_call();
+      }
+
+      if (exit == ExitKind::Normal)
+        return frame;
+
+      if (frame == this)
+        return nullptr;
+
+      if (exit == ExitKind::Return)
+        return frame->leave_call();
+
+      this->unwind(frame);
+      return nullptr;
+    }
+
+    ExitKind run(CodeFrame* frame) {
+      if constexpr (use_threaded_dispatch<Traits>())
+        return this->execute_threaded(frame);
+      else
+        return this->execute_switch(frame);
+    }
+
+    ExitKind execute_switch(CodeFrame* frame) {
+      ExitKind exit = ExitKind::Normal;
+
+      while (true) {
+        auto& inst = frame->next_instruction();
+
+        switch (inst.op) {
+          case Opcode::Load:
+            exit = frame->execute_load(inst);
+            break;
+          case Opcode::Call:
+            if (auto* callee = frame->enter_call(inst)) {
+              frame = callee;
+              continue;
+            }
+            exit = frame->fail_call();
+            break;
+          case Opcode::Jump:
+            exit = frame->execute_jump(inst);
+            break;
+          case Opcode::JumpIfFalse:
+            exit = frame->execute_jump_if_false(inst);
+            break;
+          case Opcode::Return:
+            exit = frame->execute_return(inst);
+            break;
+          case Opcode::Yield:
+            exit = frame->execute_yield(inst);
+            break;
+          case Opcode::Throw:
+            exit = frame->execute_throw(inst);
+            break;
+          case Opcode::Leave:
+            exit = frame->execute_leave(inst);
+            break;
+          case Opcode::EndFinally:
+            exit = frame->execute_end_finally(inst);
+            break;
+          case Opcode::End:
+            exit = frame->execute_end(inst);
+            break;
+        }
+
+        if (exit == ExitKind::Normal)
+          continue;
+
+        frame = this->after_exit(frame, exit);
+        if (!frame)
+          return exit;
+      }
+    }
+
+#if ZVM_COMPUTED_GOTO
+    ExitKind execute_threaded(CodeFrame* frame) {
+      // Must be kept in Opcode order
+      static void* const dispatch_table[] = {
+        &&Load,
+        &&Call,
+        &&Jump,
+        &&JumpIfFalse,
+        &&Return,
+        &&Yield,
+        &&Throw,
+        &&Leave,
+        &&EndFinally,
+        &&End,
+      };
+
+      const Instruction* inst;
+      ExitKind exit = ExitKind::Normal;
+
+#define ZVM_EXECUTE(handler) \
+      exit = frame->handler(*inst); \
+      if (exit != ExitKind::Normal) \
+        goto exit_frame; \
+      goto dispatch;
+
+    dispatch:
+      inst = &frame->next_instruction();
+      goto *dispatch_table[static_cast<int>(inst->op)];
+
+    exit_frame:
+      frame = this->after_exit(frame, exit);
+      if (!frame)
+        return exit;
+      goto dispatch;
+
+    Call:
+      if (auto* callee = frame->enter_call(*inst)) {
+        frame = callee;
+        goto dispatch;
+      }
+      exit = frame->fail_call();
+      if (exit == ExitKind::Normal)
+        goto dispatch;
+      goto exit_frame;
+
+    Load: ZVM_EXECUTE(execute_load)
+    Jump: ZVM_EXECUTE(execute_jump)
+    JumpIfFalse: ZVM_EXECUTE(execute_jump_if_false)
+    Return: ZVM_EXECUTE(execute_return)
+    Yield: ZVM_EXECUTE(execute_yield)
+    Throw: ZVM_EXECUTE(execute_throw)
+    Leave: ZVM_EXECUTE(execute_leave)
+    EndFinally: ZVM_EXECUTE(execute_end_finally)
+    End: ZVM_EXECUTE(execute_end)
+
+#undef ZVM_EXECUTE
+    }
+#else
+    ExitKind execute_threaded(CodeFrame* frame) {
+      return this->execute_switch(frame);
+    }
+#endif
+
+  };
+
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "generator.h"
+
+namespace zvm {
+
+  // Runs batches of independent invocations across worker threads.
+  // Each task owns its registers and frames, so a task which yields can
+  // be resumed by any worker. The Func and Interface graph is only
+  // read; interface calls go through the linkage or the lock-free
+  // inline caches.
+  template<typename Traits>
+  struct Executor {
+    struct Task {
+      Generator<Traits> generator;
+      // The return value once the task has exited
+      RegisterValue result = 0;
+      RegisterValue last_yielded = 0;
+      uint32_t yield_count = 0;
+
+      Task(
+        const Func& func,
+        const Interface& global,
+        const InterfaceTypeTable& interface_types,
+        const Linkage* linkage,
+        std::size_t register_capacity) :
+          generator {func, global, interface_types, linkage, register_capacity} {}
+
+      ExitKind exit() const {
+        return this->generator.exit;
+      }
+    };
+
+    // Per-worker deque. The owner takes tasks from the back and parks
+    // yielded tasks at the front, which is also where thieves take
+    // from, so a parked task is the first to move to an idle worker.
+    struct TaskQueue {
+      std::mutex mutex;
+      std::deque<Task*> tasks;
+
+      void push_back(Task* task) {
+        std::lock_guard<std::mutex> lock {this->mutex};
+        this->tasks.push_back(task);
+      }
+
+      void push_front(Task* task) {
+        std::lock_guard<std::mutex> lock {this->mutex};
+        this->tasks.push_front(task);
+      }
+
+      bool pop_back(Task*& task) {
+        std::lock_guard<std::mutex> lock {this->mutex};
+        if (this->tasks.empty())
+          return false;
+
+        task = this->tasks.back();
+        this->tasks.pop_back();
+        return true;
+      }
+
+      bool steal(Task*& task) {
+        std::lock_guard<std::mutex> lock {this->mutex};
+        if (this->tasks.empty())
+          return false;
+
+        task = this->tasks.front();
+        this->tasks.pop_front();
+        return true;
+      }
+    };
+
+    const Interface& global;
+    const InterfaceTypeTable& interface_types;
+    const Linkage* linkage;
+    std::size_t register_capacity;
+    std::vector<std::unique_ptr<Task>> tasks;
+
+    Executor(
+      const Interface& global,
+      const InterfaceTypeTable& interface_types,
+      const Linkage* linkage = nullptr,
+      std::size_t register_capacity = Generator<Traits>::default_register_capacity) :
+        global {global},
+        interface_types {interface_types},
+        linkage {linkage},
+        register_capacity {register_capacity} {}
+
+    Executor(const Executor& other) = delete;
+    Executor& operator=(const Executor& other) = delete;
+
+    // Adds an invocation of `func`. The arguments are copied into its
+    // first registers. Returns nullptr, adding nothing, if there are
+    // more arguments than the func takes.
+    Task* submit(const Func& func, std::initializer_list<RegisterValue> args = {}) {
+      auto arg_limit = std::min<std::size_t>(func.arg_count, func.registers.size());
+      if (args.size() > arg_limit)
+        return nullptr;
+
+      this->tasks.push_back(std::make_unique<Task>(
+        func,
+        this->global,
+        this->interface_types,
+        this->linkage,
+        this->register_capacity));
+
+      auto& task = *this->tasks.back();
+      Register i = 0;
+      for (auto arg : args) {
+        task.generator.frame.set_reg(i++, arg);
+      }
+
+      return &task;
+    }
+
+    // Runs every submitted task until it exits, on `thread_count`
+    // threads or one per core if zero. Workers with nothing to take
+    // sleep until a task is queued or every task has exited.
+    void run(unsigned thread_count = 0) {
+      std::vector<Task*> pending;
+      for (auto& task : this->tasks) {
+        auto& generator = task->generator;
+        if (!generator.is_started || generator.frame.is_suspended())
+          pending.push_back(task.get());
+      }
+
+      if (pending.empty())
+        return;
+
+      if (thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+      thread_count = static_cast<unsigned>(std::min<std::size_t>(
+        thread_count,
+        pending.size()));
+
+      std::vector<TaskQueue> queues(thread_count);
+      for (std::size_t i = 0; i < pending.size(); ++i) {
+        queues[i % thread_count].tasks.push_back(pending[i]);
+      }
+
+      // Tasks in the queues, and tasks which have not exited
+      std::atomic<std::size_t> queued {pending.size()};
+      std::atomic<std::size_t> remaining {pending.size()};
+      std::mutex idle_mutex;
+      std::condition_variable idle;
+
+      // Taking the lock orders the change to `queued` or `remaining`
+      // before the check of any worker about to sleep
+      auto wake = [&](bool all) {
+        { std::lock_guard<std::mutex> lock {idle_mutex}; }
+        if (all)
+          idle.notify_all();
+        else
+          idle.notify_one();
+      };
+
+      auto work = [&](unsigned worker) {
+        auto& queue = queues[worker];
+        Task* task;
+
+        while (remaining.load(std::memory_order_acquire) > 0) {
+          bool found = queue.pop_back(task);
+          for (unsigned i = 1; i < thread_count && !found; ++i) {
+            found = queues[(worker + i) % thread_count].steal(task);
+          }
+
+          if (!found) {
+            std::unique_lock<std::mutex> lock {idle_mutex};
+            idle.wait(lock, [&]() {
+              return queued.load(std::memory_order_acquire) > 0
+                || remaining.load(std::memory_order_acquire) == 0;
+            });
+            continue;
+          }
+
+          queued.fetch_sub(1, std::memory_order_relaxed);
+
+          RegisterValue value;
+          if (task->generator.next(value)) {
+            task->last_yielded = value;
+            ++task->yield_count;
+            queue.push_front(task);
+            queued.fetch_add(1, std::memory_order_release);
+            wake(false);
+            continue;
+          }
+
+          task->result = task->generator.frame.return_value();
+          if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            wake(true);
+        }
+      };
+
+      std::vector<std::thread> threads;
+      threads.reserve(thread_count - 1);
+      for (unsigned i = 1; i < thread_count; ++i) {
+        threads.emplace_back(work, i);
+      }
+
+      work(0);
+
+      for (auto& thread : threads) {
+        thread.join();
+      }
+    }
+  };
+
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include "interpreter.h"
+
+namespace zvm {
+
+  // Runs a func as a generator: each call to next() continues to the
+  // following yield. A yield in any callee suspends the whole call
+  // chain. Every generator has its own small register stack and frame
+  // pool, so any number of them can be suspended at once; after
+  // construction, stepping a generator does not allocate.
+  template<typename Traits>
+  struct Generator {
+    // In bytes
+    static constexpr std::size_t default_register_capacity = 2048;
+
+    Interpreter<Traits> interpreter;
+    InterpreterFrame<Traits> frame;
+    bool is_started = false;
+    ExitKind exit = ExitKind::Normal;
+
+    Generator(
+      const Func& func,
+      const Interface& global,
+      const InterfaceTypeTable& interface_types,
+      const Linkage* linkage = nullptr,
+      std::size_t register_capacity = default_register_capacity) :
+        interpreter {global, interface_types, linkage, register_capacity},
+        frame {interpreter, func} {}
+
+    Generator(const Generator& other) = delete;
+    Generator& operator=(const Generator& other) = delete;
+
+    // Returns true and the yielded value, or false once the generator
+    // has exited, with its exit kind in `exit`.
+    bool next(RegisterValue& value) {
+      if (this->is_started && !this->frame.is_suspended())
+        return false;
+
+      this->exit = this->is_started
+        ? this->frame.resume()
+        : this->frame.execute();
+      this->is_started = true;
+
+      if (this->exit != ExitKind::Yield)
+        return false;
+
+      value = this->frame.yielded_value();
+      return true;
+    }
+  };
+
+}
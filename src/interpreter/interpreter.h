@@ -1,7 +1,18 @@
 #pragma once
 
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <type_traits>
 #include <utility>
+#include <vector>
 #include "program/func.h"
+#include "program/linker.h"
+#include "jit.h"
+#include "register_stack.h"
+#include "superinstructions.h"
+#include "tiering.h"
+#include "traits.h"
 
 namespace zvm {
 
@@ -13,36 +24,420 @@ namespace zvm {
     Yield,
   };
 
+  // Interface values carry their dynamic interface type in the low
+  // 32 bits. The upper 32 bits are available to the host.
+  inline RegisterType interface_value_type(RegisterValue value) {
+    return static_cast<RegisterType>(value);
+  }
+
+  inline RegisterValue make_interface_value(
+    RegisterType type,
+    uint32_t data = 0)
+  {
+    return (static_cast<RegisterValue>(data) << 32) | type;
+  }
+
+  template<typename Traits>
+  struct InterpreterFrame;
+
+  // Per-thread execution state: the register stack shared by all
+  // frames on the thread and a pool of frames reused across calls.
+  // An Interpreter must only be used by one thread at a time.
+  // `register_capacity` is the size of the register stack in bytes.
+  template<typename Traits>
+  struct Interpreter {
+    using Frame = InterpreterFrame<Traits>;
+
+    const Interface& global;
+    const InterfaceTypeTable& interface_types;
+    // Dispatch tables for linked interface calls, if any
+    const Linkage* linkage;
+    RegisterStack registers;
+    std::vector<std::unique_ptr<Frame>> frames;
+    std::vector<Frame*> free_frames;
+    // Native code for compiled funcs, if any. Native and interpreted
+    // funcs take their registers from the same register stack, so
+    // either can call the other.
+    const Jit* jit = nullptr;
+    JitRuntime jit_runtime;
+    // Compiles hot funcs when Traits::tiering is enabled. Set through
+    // enable_tiering.
+    Tiering* tiering = nullptr;
+
+    Interpreter(
+      const Interface& global,
+      const InterfaceTypeTable& interface_types,
+      const Linkage* linkage = nullptr,
+      std::size_t register_capacity = RegisterStack::default_capacity) :
+        global {global},
+        interface_types {interface_types},
+        linkage {linkage},
+        registers {register_capacity}
+    {
+      this->jit_runtime.call = &Interpreter::call_from_native;
+      this->jit_runtime.context = this;
+    }
+
+    Interpreter(const Interpreter& other) = delete;
+    Interpreter& operator=(const Interpreter& other) = delete;
+
+    // Runs funcs compiled by `tiering` natively, in place of any other
+    // Jit
+    void enable_tiering(Tiering& tiering) {
+      this->tiering = &tiering;
+      this->jit = &tiering.jit;
+    }
+
+    // `receiver` is the value of the interface register, if any
+    const Func* resolve_call(
+      const CallStatement& stmt,
+      RegisterValue receiver) const
+    {
+      if (stmt.interface == void_register()) {
+        if (stmt.callee)
+          return stmt.callee;
+
+        return this->lookup_func(this->global, stmt.func_name);
+      }
+
+      auto type = interface_value_type(receiver);
+
+      if (this->linkage && stmt.slot != no_method_slot())
+        return this->linkage->method(type, stmt.slot);
+
+      auto* cache = stmt.cache;
+      auto generation = this->interface_types.generation;
+
+      if (cache) {
+        if (const Func* target = cache->lookup(generation, type)) {
+          if constexpr (Traits::count_inline_caches)
+            cache->count_hit();
+          return target;
+        }
+
+        if constexpr (Traits::count_inline_caches)
+          cache->count_miss();
+      }
+
+      auto iter = this->interface_types.find(type);
+      if (iter == this->interface_types.end())
+        return nullptr;
+
+      const Func* target = this->lookup_func(*iter->second, stmt.func_name);
+      if (target && cache)
+        cache->insert(generation, type, target);
+
+      return target;
+    }
+
+    const Func* lookup_func(const Interface& interface, FuncName name) const {
+      auto iter = interface.func_map.find(name);
+      if (iter == interface.func_map.end())
+        return nullptr;
+
+      return iter->second;
+    }
+
+    Frame* acquire_frame(const Func& func, Frame* caller, Register target) {
+      unsigned char* window = this->registers.push(func.registers.frame_size);
+      if (!window)
+        return nullptr;
+
+      Frame* frame;
+      if (this->free_frames.empty()) {
+        this->frames.push_back(std::make_unique<Frame>(*this));
+        frame = this->frames.back().get();
+      } else {
+        frame = this->free_frames.back();
+        this->free_frames.pop_back();
+      }
+
+      frame->enter(func, window, caller, target);
+      return frame;
+    }
+
+    void release_frame(Frame* frame) {
+      frame->leave();
+      this->free_frames.push_back(frame);
+    }
+
+    // Runs native code for a call, copying the arguments from and the
+    // result to the caller's registers. Returns ExitKind::Return, or
+    // ExitKind::Throw with the value in jit_runtime.thrown_value.
+    ExitKind call_native(
+      NativeCode entry,
+      const Func& target,
+      const CallStatement& stmt,
+      unsigned char* caller,
+      const RegisterSlot* caller_slots)
+    {
+      auto& runtime = this->jit_runtime;
+      if (runtime.depth >= JitRuntime::max_depth)
+        return this->fail_native_call();
+
+      unsigned char* window = this->registers.push(target.registers.frame_size);
+      if (!window)
+        return this->fail_native_call();
+
+      auto* slots = target.registers.slots.data();
+      for (Register i = 0; i < stmt.args.size(); ++i) {
+        store_register(window, slots[i], load_register(caller, caller_slots[stmt.args[i]]));
+      }
+
+      ++runtime.depth;
+      ExitKind exit = entry(runtime, window);
+      --runtime.depth;
+      this->registers.pop(window);
+
+      if (exit == ExitKind::Return && stmt.target != void_register())
+        store_register(caller, caller_slots[stmt.target], runtime.return_value);
+
+      return exit;
+    }
+
+    // Runs an interpreted callee of native code to completion. Native
+    // frames cannot be suspended, so a yield throws 0 instead.
+    ExitKind call_interpreted(
+      const Func& target,
+      const CallStatement& stmt,
+      unsigned char* caller,
+      const RegisterSlot* caller_slots)
+    {
+      Frame* frame = this->acquire_frame(target, nullptr, void_register());
+      if (!frame)
+        return this->fail_native_call();
+
+      for (Register i = 0; i < stmt.args.size(); ++i) {
+        frame->set_reg(i, load_register(caller, caller_slots[stmt.args[i]]));
+      }
+
+      ExitKind exit = frame->execute();
+      if (exit == ExitKind::Return) {
+        if (stmt.target != void_register())
+          store_register(caller, caller_slots[stmt.target], frame->return_value());
+      } else {
+        this->jit_runtime.thrown_value = exit == ExitKind::Throw
+          ? frame->thrown_value
+          : 0;
+        exit = ExitKind::Throw;
+      }
+
+      this->release_frame(frame);
+      return exit;
+    }
+
+    ExitKind fail_native_call() {
+      this->jit_runtime.thrown_value = 0;
+      return ExitKind::Throw;
+    }
+
+    static ExitKind call_from_native(
+      JitRuntime& runtime,
+      unsigned char* registers,
+      const JitCall& call)
+    {
+      auto& self = *static_cast<Interpreter*>(runtime.context);
+      auto& stmt = *call.stmt;
+      const Func* target = self.resolve_call(
+        stmt,
+        stmt.interface == void_register()
+          ? 0
+          : load_register(registers, call.slots[stmt.interface]));
+      if (!target)
+        return self.fail_native_call();
+
+      NativeCode entry = self.jit->entry(*target);
+      if constexpr (Traits::tiering) {
+        if (!entry && self.tiering)
+          entry = self.tiering->count_call(*target);
+      }
+
+      if (entry)
+        return self.call_native(entry, *target, stmt, registers, call.slots);
+
+      return self.call_interpreted(*target, stmt, registers, call.slots);
+    }
+  };
+
   template<typename Traits>
   struct InterpreterFrame {
-    const Func& func;
-    const Block* current_block;
+    // Each entry points just past the statement which pushed the
+    // block above it, except for the protected block of a Finally,
+    // whose entry points at the start of the finally block.
+    struct StackEntry {
+      const Block* block;
+      Block::const_iterator statement;
+      // True if the block pushed above this entry is a repeat body
+      bool repeat;
+    };
+
+    // A Return, Break or Throw waiting for a finally block to complete
+    struct PendingExit {
+      ExitKind exit;
+      Register return_register;
+      RegisterValue thrown_value;
+      // Stack size while the finally block runs
+      std::size_t depth;
+    };
+
+    Interpreter<Traits>& interpreter;
+    const Func* func = nullptr;
+    // Window into the interpreter's register stack, laid out by
+    // func->registers
+    unsigned char* registers = nullptr;
+    const RegisterSlot* slots = nullptr;
+    InterpreterFrame* caller = nullptr;
+    // Register in the caller which receives the return value
+    Register call_target = void_register();
+    const Block* current_block = nullptr;
     Block::const_iterator current_statement;
-    std::vector<std::pair<const Block*, Block::const_iterator>> stack;
-    std::vector<RegisterValue> registers;
-    Register return_register = 0;
-    // TODO: Error slot
-
-    InterpreterFrame(const Func& func) :
-      func {func},
-      current_block {&func.block},
-      current_statement {func.block.begin()}
+    std::vector<StackEntry> stack;
+    Register return_register = void_register();
+    // Register of the last yielded value
+    Register yield_register = void_register();
+    // Set on the outermost frame while it is suspended: the frame,
+    // possibly a callee, which yielded and continues on resume
+    InterpreterFrame* active = nullptr;
+    RegisterValue thrown_value = 0;
+    // Only used once an exit passes through a finally block
+    std::vector<PendingExit> pending;
+    // Set once the frame has finished in native code, from the head
+    // of a loop, until it is entered again
+    ExitKind native_exit = ExitKind::Normal;
+    RegisterValue native_return_value = 0;
+    Tiering::Counters* tiering_counters = nullptr;
+
+    explicit InterpreterFrame(Interpreter<Traits>& interpreter) :
+      interpreter {interpreter} {}
+
+    InterpreterFrame(Interpreter<Traits>& interpreter, const Func& func) :
+      interpreter {interpreter}
+    {
+      this->enter(
+        func,
+        interpreter.registers.push(func.registers.frame_size),
+        nullptr,
+        void_register());
+    }
+
+    ~InterpreterFrame() {
+      this->leave();
+    }
+
+    InterpreterFrame(const InterpreterFrame& other) = delete;
+    InterpreterFrame& operator=(const InterpreterFrame& other) = delete;
+
+    void enter(
+      const Func& func,
+      unsigned char* registers,
+      InterpreterFrame* caller,
+      Register call_target)
     {
-      this->registers.resize(func.registers.size());
+      this->func = &func;
+      this->registers = registers;
+      this->slots = func.registers.slots.data();
+      this->caller = caller;
+      this->call_target = call_target;
+      this->current_block = &func.block;
+      this->current_statement = func.block.begin();
+      this->return_register = void_register();
+      this->yield_register = void_register();
+      this->thrown_value = 0;
+      this->native_exit = ExitKind::Normal;
+      this->tiering_counters = nullptr;
+
+      if constexpr (Traits::profile)
+        Traits::profile_func(func);
     }
 
+    void leave() {
+      if (this->active) {
+        this->unwind(this->active);
+        this->active = nullptr;
+      }
+
+      if (this->registers) {
+        this->interpreter.registers.pop(this->registers);
+        this->registers = nullptr;
+      }
+      this->stack.clear();
+      this->pending.clear();
+    }
+
+    void check_reg(Register reg) {
+      if constexpr (Traits::check) {
+        if (reg >= this->func->registers.size())
+          Traits::check_failed("register out of range");
+      }
+    }
+
+    template<typename T>
+    void check_width(Register reg) {
+      if constexpr (Traits::check) {
+        if (this->slots[reg].width != sizeof(T))
+          Traits::check_failed("register width mismatch");
+      }
+    }
+
+    // Typed access, for callers which know the register's type. T must
+    // have the register's width.
+    template<typename T>
+    T get(Register source) {
+      this->check_reg(source);
+      this->check_width<T>(source);
+      T value;
+      std::memcpy(&value, this->registers + this->slots[source].offset, sizeof(T));
+      return value;
+    }
+
+    template<typename T>
+    void set(Register target, T value) {
+      this->check_reg(target);
+      this->check_width<T>(target);
+      std::memcpy(this->registers + this->slots[target].offset, &value, sizeof(T));
+    }
+
+    // Untyped access, widening to or narrowing from a RegisterValue.
+    // See load_register.
     void set_reg(Register target, RegisterValue value) {
-      this->registers[target] = value;
+      this->check_reg(target);
+      store_register(this->registers, this->slots[target], value);
     }
 
     RegisterValue get_reg(Register source) {
-      return this->registers[source];
+      this->check_reg(source);
+      return load_register(this->registers, this->slots[source]);
+    }
+
+    RegisterValue return_value() {
+      if constexpr (Traits::tiering) {
+        if (this->native_exit == ExitKind::Return)
+          return this->native_return_value;
+      }
+
+      return this->return_register == void_register()
+        ? 0
+        : this->get_reg(this->return_register);
+    }
+
+    bool is_suspended() const {
+      return this->active != nullptr;
     }
 
-    void push_block(const Block& block) {
+    // The value passed to the last yield, which may have been made by
+    // a callee of this frame
+    RegisterValue yielded_value() {
+      InterpreterFrame* frame = this->active ? this->active : this;
+      return frame->yield_register == void_register()
+        ? 0
+        : frame->get_reg(frame->yield_register);
+    }
+
+    void push_block(const Block& block, bool repeat = false) {
       this->stack.push_back({
         this->current_block,
         this->current_statement,
+        repeat,
       });
 
       this->current_block = &block;
@@ -55,27 +450,241 @@ namespace zvm {
           return false;
 
         auto& top = this->stack.back();
-        this->current_block = top.first;
-        this->current_statement = top.second;
-        this->stack.pop_back();
+        if (top.repeat) {
+          if constexpr (Traits::tiering) {
+            if (this->back_edge(top))
+              return false;
+          }
+
+          this->current_statement = this->current_block->begin();
+          continue;
+        }
+
+        this->pop_block();
+
+        // A finally block entered for a pending exit has completed
+        if (!this->pending.empty() && this->stack.size() < this->pending.back().depth)
+          return false;
       }
 
       return true;
     }
 
+    // Counts a back edge of the repeat which pushed the block above
+    // `top`. Once the func has native code, runs the rest of the func
+    // natively from the head of the loop. Returns true if the frame
+    // finished there, leaving the exit for finish_block.
+    bool back_edge(const StackEntry& top) {
+      auto& interpreter = this->interpreter;
+      if (!interpreter.tiering)
+        return false;
+
+      auto& loop = cast_statement<RepeatStatement>(**(top.statement - 1));
+      NativeCode entry = interpreter.tiering->count_back_edge(
+        *this->func,
+        loop,
+        this->tiering_counters);
+      auto& runtime = interpreter.jit_runtime;
+      if (!entry || runtime.depth >= JitRuntime::max_depth)
+        return false;
+
+      // Catches and breaks around the loop are compiled into the
+      // native code, and compiled funcs have no finally blocks, so
+      // nothing on the block stack is left to run
+      ++runtime.depth;
+      ExitKind exit = entry(runtime, this->registers);
+      --runtime.depth;
+
+      this->stack.clear();
+      this->current_block = &this->func->block;
+      this->current_statement = this->current_block->end();
+      this->native_exit = exit;
+      if (exit == ExitKind::Return)
+        this->native_return_value = runtime.return_value;
+      else
+        this->thrown_value = runtime.thrown_value;
+      return true;
+    }
+
+    void pop_block() {
+      auto& top = this->stack.back();
+      this->current_block = top.block;
+      this->current_statement = top.statement;
+      this->stack.pop_back();
+    }
+
+    // Drops pending exits whose finally blocks have been left
+    void drop_pending() {
+      while (!this->pending.empty() && this->stack.size() < this->pending.back().depth) {
+        this->pending.pop_back();
+      }
+    }
+
+    // Unwinds enclosing blocks for a Break, Return or Throw. Enclosing
+    // Try and Finally statements are found from the block stack, so
+    // entering them records nothing beyond the block push that every
+    // nested block needs. Returns ExitKind::Normal if execution
+    // continues in this frame, in a catch or finally block or after a
+    // repeat.
+    ExitKind complete(ExitKind exit) {
+      while (!this->stack.empty()) {
+        auto& top = this->stack.back();
+
+        if (exit == ExitKind::Break && top.repeat) {
+          this->pop_block();
+          this->drop_pending();
+          return ExitKind::Normal;
+        }
+
+        if (top.statement == top.block->begin()) {
+          // Leaving the protected block of a Finally: run the finally
+          // block first, then continue the exit
+          this->pop_block();
+          this->drop_pending();
+          this->pending.push_back({
+            exit,
+            this->return_register,
+            this->thrown_value,
+            this->stack.size(),
+          });
+          return ExitKind::Normal;
+        }
+
+        if (exit == ExitKind::Throw) {
+          auto& owner = **(top.statement - 1);
+          if (owner.kind == StatementKind::Try) {
+            auto& stmt = cast_statement<TryStatement>(owner);
+            if (this->current_block == &stmt.try_block) {
+              this->pop_block();
+              this->drop_pending();
+              if (stmt.target != void_register())
+                this->set_reg(stmt.target, this->thrown_value);
+              this->push_block(stmt.catch_block);
+              return ExitKind::Normal;
+            }
+          }
+        }
+
+        this->pop_block();
+      }
+
+      this->pending.clear();
+      return exit;
+    }
+
+    // Called when ensure_next_statement stops. Either the func has
+    // ended, or a finally block has completed and its pending exit
+    // continues.
+    ExitKind finish_block() {
+      if constexpr (Traits::tiering) {
+        if (this->native_exit != ExitKind::Normal)
+          return this->native_exit;
+      }
+
+      if (this->pending.empty() || this->stack.size() >= this->pending.back().depth)
+        return ExitKind::Return;
+
+      auto pending = this->pending.back();
+      this->pending.pop_back();
+      this->return_register = pending.return_register;
+      this->thrown_value = pending.thrown_value;
+      return this->complete(pending.exit);
+    }
+
     ExitKind execute_statement(const LoadStatement& stmt) {
-      std::cout << "Load\n";
       this->set_reg(stmt.target, stmt.value);
       return ExitKind::Normal;
     }
 
-    ExitKind execute_statement(const CallStatement& stmt) {
-      std::cout << "Call\n";
-      return ExitKind::Normal;
+    // Returns the callee frame, this frame if the callee ran as native
+    // code, or nullptr if the call threw, with the value in
+    // thrown_value
+    InterpreterFrame* enter_call(const CallStatement& stmt) {
+      this->thrown_value = 0;
+      auto& interpreter = this->interpreter;
+      // The validator only accepts interface registers as receivers
+      RegisterValue receiver = stmt.interface == void_register()
+        ? 0
+        : this->template get<RegisterValue>(stmt.interface);
+      const Func* target = interpreter.resolve_call(stmt, receiver);
+      if (!target)
+        return nullptr;
+
+      if constexpr (Traits::profile) {
+        if (stmt.interface != void_register())
+          Traits::profile_method(interface_value_type(receiver), stmt.func_name);
+      }
+
+      if constexpr (Traits::check) {
+        if (stmt.args.size() != target->arg_count)
+          Traits::check_failed("wrong number of arguments");
+      }
+
+      NativeCode entry = interpreter.jit ? interpreter.jit->entry(*target) : nullptr;
+      if constexpr (Traits::tiering) {
+        if (!entry && interpreter.tiering)
+          entry = interpreter.tiering->count_call(*target);
+      }
+
+      if (entry) {
+        if constexpr (Traits::profile)
+          Traits::profile_func(*target);
+
+        auto exit = interpreter.call_native(
+          entry,
+          *target,
+          stmt,
+          this->registers,
+          this->slots);
+        if (exit == ExitKind::Return)
+          return this;
+
+        this->thrown_value = interpreter.jit_runtime.thrown_value;
+        return nullptr;
+      }
+
+      InterpreterFrame* callee =
+        interpreter.acquire_frame(*target, this, stmt.target);
+
+      if (!callee)
+        return nullptr;
+
+      for (Register i = 0; i < stmt.args.size(); ++i) {
+        callee->set_reg(i, this->get_reg(stmt.args[i]));
+      }
+
+      return callee;
+    }
+
+    // Completes a call, passing the return value to the caller.
+    // Returns the caller frame.
+    InterpreterFrame* leave_call() {
+      InterpreterFrame* caller = this->caller;
+      if (this->call_target != void_register())
+        caller->set_reg(this->call_target, this->return_value());
+
+      this->interpreter.release_frame(this);
+      return caller;
+    }
+
+    // Passes the thrown value to the caller. Returns the caller frame.
+    InterpreterFrame* leave_throw() {
+      InterpreterFrame* caller = this->caller;
+      caller->thrown_value = this->thrown_value;
+      this->interpreter.release_frame(this);
+      return caller;
+    }
+
+    // Releases every frame above this one, starting with `frame`
+    void unwind(InterpreterFrame* frame) {
+      while (frame != this) {
+        InterpreterFrame* caller = frame->caller;
+        this->interpreter.release_frame(frame);
+        frame = caller;
+      }
     }
 
     ExitKind execute_statement(const IfStatement& stmt) {
-      std::cout << "If\n";
       this->push_block(this->get_reg(stmt.source) == 0
         ? stmt.false_block
         : stmt.true_block);
@@ -83,93 +692,284 @@ namespace zvm {
     }
 
     ExitKind execute_statement(const RepeatStatement& stmt) {
-      std::cout << "Repeat\n";
+      this->push_block(stmt.block, true);
       return ExitKind::Normal;
     }
 
     ExitKind execute_statement(const BreakStatement& stmt) {
-      std::cout << "Break\n";
-      return ExitKind::Normal;
+      return this->complete(ExitKind::Break);
     }
 
     ExitKind execute_statement(const TryStatement& stmt) {
-      std::cout << "Try\n";
+      this->push_block(stmt.try_block);
       return ExitKind::Normal;
     }
 
     ExitKind execute_statement(const FinallyStatement& stmt) {
-      std::cout << "Finally\n";
+      // The finally block is pushed first so that it resumes when
+      // the protected block completes
+      this->push_block(stmt.finally_block);
+      this->push_block(stmt.block);
       return ExitKind::Normal;
     }
 
     ExitKind execute_statement(const ReturnStatement& stmt) {
-      std::cout << "Return\n";
       this->return_register = stmt.source;
-      return ExitKind::Return;
+      return this->complete(ExitKind::Return);
     }
 
     ExitKind execute_statement(const YieldStatement& stmt) {
-      std::cout << "Yield\n";
-      return ExitKind::Normal;
+      this->yield_register = stmt.source;
+      return ExitKind::Yield;
     }
 
     ExitKind execute_statement(const ThrowStatement& stmt) {
-      std::cout << "Throw\n";
-      return ExitKind::Normal;
+      this->thrown_value = stmt.source == void_register()
+        ? 0
+        : this->get_reg(stmt.source);
+      return this->complete(ExitKind::Throw);
+    }
+
+    template<FusedKind kind, std::size_t load_count, typename Tail>
+    ExitKind execute_statement(const FusedStatement<kind, load_count, Tail>& stmt) {
+      for (std::size_t i = 0; i < load_count; ++i) {
+        this->set_reg(stmt.targets[i], stmt.values[i]);
+      }
+
+      if constexpr (std::is_void_v<Tail>)
+        return ExitKind::Normal;
+      else
+        return this->execute_statement(*stmt.tail);
     }
 
+    // Dispatches a superinstruction, for execute_switch
+    ExitKind execute_fused(const Statement& stmt) {
+      auto fn = [&](auto& typed) {
+        return this->execute_statement(typed);
+      };
+      return map_fused_statement(stmt, fn);
+    }
+
+    // Throws the value left in thrown_value by enter_call. A call
+    // which cannot be made throws 0.
+    ExitKind fail_call() {
+      return this->complete(ExitKind::Throw);
+    }
+
+    const Statement& next_statement() {
+      auto& stmt = **(this->current_statement++);
+      if constexpr (Traits::trace)
+        Traits::trace_statement(stmt);
+      if constexpr (Traits::profile)
+        Traits::profile_statement(*this->func, stmt);
+      return stmt;
+    }
+
+    // Runs this frame, and any frames it calls, until this frame
+    // exits or a yield suspends it. An uncaught throw exits with
+    // ExitKind::Throw and the value in thrown_value.
     ExitKind execute() {
+      if (!this->registers || this->active)
+        return ExitKind::Throw;
+
+      return this->run(this);
+    }
+
+    // Continues a suspended frame from the statement after the yield.
+    // Suspended frames keep their registers and block stacks in place,
+    // so neither suspending nor resuming copies or allocates.
+    ExitKind resume() {
+      InterpreterFrame* frame = this->active;
+      if (!frame)
+        return ExitKind::Throw;
+
+      this->active = nullptr;
+      return this->run(frame);
+    }
+
+    // Continues the driver loop after `frame` exits with `exit`.
+    // Returns the frame to continue in, or nullptr if execution stops.
+    InterpreterFrame* after_exit(InterpreterFrame* frame, ExitKind& exit) {
+      if (exit == ExitKind::Yield) {
+        this->active = frame;
+        return nullptr;
+      }
+
+      while (exit == ExitKind::Throw && frame != this) {
+        frame = frame->leave_throw();
+        exit = frame->complete(ExitKind::Throw);
+      }
+
+      if (exit == ExitKind::Normal)
+        return frame;
+
+      if (frame == this)
+        return nullptr;
+
+      if (exit == ExitKind::Return)
+        return frame->leave_call();
+
+      this->unwind(frame);
+      return nullptr;
+    }
+
+    ExitKind run(InterpreterFrame* frame) {
+      if constexpr (use_threaded_dispatch<Traits>())
+        return this->execute_threaded(frame);
+      else
+        return this->execute_switch(frame);
+    }
+
+    ExitKind execute_switch(InterpreterFrame* frame) {
       ExitKind exit = ExitKind::Normal;
 
       while (true) {
-        auto& stmt = **(this->current_statement++);
-
-        using Kind = StatementKind;
-        switch (stmt.kind) {
-          case Kind::Load:
-            exit = this->execute_statement(cast_statement<LoadStatement>(stmt));
-            break;
-          case Kind::Call:
-            exit = this->execute_statement(cast_statement<CallStatement>(stmt));
-            break;
-          case Kind::If:
-            exit = this->execute_statement(cast_statement<IfStatement>(stmt));
-            break;
-          case Kind::Repeat:
-            exit = this->execute_statement(cast_statement<RepeatStatement>(stmt));
-            break;
-          case Kind::Break:
-            exit = this->execute_statement(cast_statement<BreakStatement>(stmt));
-            break;
-          case Kind::Try:
-            exit = this->execute_statement(cast_statement<TryStatement>(stmt));
-            break;
-          case Kind::Finally:
-            exit = this->execute_statement(cast_statement<FinallyStatement>(stmt));
-            break;
-          case Kind::Return:
-            exit = this->execute_statement(cast_statement<ReturnStatement>(stmt));
-            break;
-          case Kind::Yield:
-            exit = this->execute_statement(cast_statement<YieldStatement>(stmt));
-            break;
-          case Kind::Throw:
-            exit = this->execute_statement(cast_statement<ThrowStatement>(stmt));
-            break;
-          default:
-            // TODO
-            break;
+        if (!frame->ensure_next_statement()) {
+          exit = frame->finish_block();
+          if (exit == ExitKind::Normal)
+            continue;
+        } else {
+          auto& stmt = frame->next_statement();
+
+          // This switch and the one in map_fused_statement list every
+          // kind, so -Wswitch catches a kind without a case
+          using Kind = StatementKind;
+          if (is_fused_statement(stmt)) {
+            exit = frame->execute_fused(stmt);
+          } else {
+            switch (stmt.kind) {
+              case Kind::Load:
+                exit = frame->execute_statement(cast_statement<LoadStatement>(stmt));
+                break;
+              case Kind::Call:
+                if (auto* callee = frame->enter_call(cast_statement<CallStatement>(stmt))) {
+                  frame = callee;
+                  continue;
+                }
+                exit = frame->fail_call();
+                break;
+              case Kind::If:
+                exit = frame->execute_statement(cast_statement<IfStatement>(stmt));
+                break;
+              case Kind::Repeat:
+                exit = frame->execute_statement(cast_statement<RepeatStatement>(stmt));
+                break;
+              case Kind::Break:
+                exit = frame->execute_statement(cast_statement<BreakStatement>(stmt));
+                break;
+              case Kind::Try:
+                exit = frame->execute_statement(cast_statement<TryStatement>(stmt));
+                break;
+              case Kind::Finally:
+                exit = frame->execute_statement(cast_statement<FinallyStatement>(stmt));
+                break;
+              case Kind::Return:
+                exit = frame->execute_statement(cast_statement<ReturnStatement>(stmt));
+                break;
+              case Kind::Yield:
+                exit = frame->execute_statement(cast_statement<YieldStatement>(stmt));
+                break;
+              case Kind::Throw:
+                exit = frame->execute_statement(cast_statement<ThrowStatement>(stmt));
+                break;
+            }
+          }
+
+          if (exit == ExitKind::Normal)
+            continue;
         }
 
-        if (exit != ExitKind::Normal)
+        frame = this->after_exit(frame, exit);
+        if (!frame)
           return exit;
+      }
+    }
+
+#if ZVM_COMPUTED_GOTO
+    ExitKind execute_threaded(InterpreterFrame* frame) {
+      // Must be kept in StatementKind order, followed by the
+      // superinstructions in FusedKind order
+      static void* const dispatch_table[] = {
+        &&Load,
+        &&Call,
+        &&If,
+        &&Repeat,
+        &&Break,
+        &&Try,
+        &&Finally,
+        &&Return,
+        &&Yield,
+        &&Throw,
+        &&LoadLoad,
+        &&LoadLoadLoad,
+        &&LoadIf,
+        &&LoadLoadIf,
+        &&LoadReturn,
+        &&LoadLoadReturn,
+      };
+      static_assert(
+        sizeof(dispatch_table) / sizeof(dispatch_table[0])
+          == static_cast<std::size_t>(StatementKind::Throw) + 1 + fused_kind_count,
+        "dispatch table must cover every statement kind");
+
+      const Statement* stmt;
+      ExitKind exit = ExitKind::Normal;
 
-        if (!this->ensure_next_statement())
-          break;
+#define ZVM_EXECUTE(T) \
+      exit = frame->execute_statement(cast_statement<T>(*stmt)); \
+      if (exit != ExitKind::Normal) \
+        goto exit_frame; \
+      goto dispatch;
+
+    dispatch:
+      if (!frame->ensure_next_statement()) {
+        exit = frame->finish_block();
+        if (exit == ExitKind::Normal)
+          goto dispatch;
+        goto exit_frame;
+      }
+      stmt = &frame->next_statement();
+      goto *dispatch_table[static_cast<int>(stmt->kind)];
+
+    exit_frame:
+      frame = this->after_exit(frame, exit);
+      if (!frame)
+        return exit;
+      goto dispatch;
+
+    Call:
+      if (auto* callee = frame->enter_call(cast_statement<CallStatement>(*stmt))) {
+        frame = callee;
+        goto dispatch;
       }
+      exit = frame->fail_call();
+      if (exit == ExitKind::Normal)
+        goto dispatch;
+      goto exit_frame;
+
+    Load: ZVM_EXECUTE(LoadStatement)
+    If: ZVM_EXECUTE(IfStatement)
+    Repeat: ZVM_EXECUTE(RepeatStatement)
+    Break: ZVM_EXECUTE(BreakStatement)
+    Try: ZVM_EXECUTE(TryStatement)
+    Finally: ZVM_EXECUTE(FinallyStatement)
+    Return: ZVM_EXECUTE(ReturnStatement)
+    Yield: ZVM_EXECUTE(YieldStatement)
+    Throw: ZVM_EXECUTE(ThrowStatement)
+    LoadLoad: ZVM_EXECUTE(LoadLoadStatement)
+    LoadLoadLoad: ZVM_EXECUTE(LoadLoadLoadStatement)
+    LoadIf: ZVM_EXECUTE(LoadIfStatement)
+    LoadLoadIf: ZVM_EXECUTE(LoadLoadIfStatement)
+    LoadReturn: ZVM_EXECUTE(LoadReturnStatement)
+    LoadLoadReturn: ZVM_EXECUTE(LoadLoadReturnStatement)
 
-      return ExitKind::Return;
+#undef ZVM_EXECUTE
+    }
+#else
+    ExitKind execute_threaded(InterpreterFrame* frame) {
+      return this->execute_switch(frame);
     }
+#endif
 
   };
 
@@ -0,0 +1,457 @@
+#include <cstddef>
+#include <cstring>
+#include <initializer_list>
+#include <utility>
+#include "jit.h"
+#include "interpreter.h"
+#include "program/traverse.h"
+
+#if ZVM_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace zvm {
+
+  namespace {
+
+    // Encodes the handful of x86-64 instructions the compiler uses.
+    // rbx holds the register window and r12 the JitRuntime.
+    struct Assembler {
+      std::vector<uint8_t> code;
+
+      std::size_t position() const {
+        return this->code.size();
+      }
+
+      void emit(std::initializer_list<uint8_t> bytes) {
+        this->code.insert(this->code.end(), bytes);
+      }
+
+      void emit32(uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+          this->code.push_back(static_cast<uint8_t>(value >> (i * 8)));
+        }
+      }
+
+      void emit64(uint64_t value) {
+        this->emit32(static_cast<uint32_t>(value));
+        this->emit32(static_cast<uint32_t>(value >> 32));
+      }
+
+      // Emits a jump with a rel32 operand to be patched. Returns the
+      // position of the operand.
+      std::size_t jump(std::initializer_list<uint8_t> opcode) {
+        this->emit(opcode);
+        this->emit32(0);
+        return this->position() - 4;
+      }
+
+      std::size_t jmp() {
+        return this->jump({0xE9});
+      }
+
+      std::size_t jz() {
+        return this->jump({0x0F, 0x84});
+      }
+
+      std::size_t je() {
+        return this->jz();
+      }
+
+      void patch(std::size_t operand, std::size_t target) {
+        auto offset = static_cast<uint32_t>(
+          static_cast<int64_t>(target) - static_cast<int64_t>(operand + 4));
+        std::memcpy(&this->code[operand], &offset, 4);
+      }
+
+      void jmp_to(std::size_t target) {
+        this->patch(this->jmp(), target);
+      }
+
+      // push rbx; push r12; sub rsp, 8; mov r12, rdi; mov rbx, rsi
+      void prologue() {
+        this->emit({0x53, 0x41, 0x54, 0x48, 0x83, 0xEC, 0x08});
+        this->emit({0x49, 0x89, 0xFC, 0x48, 0x89, 0xF3});
+      }
+
+      // add rsp, 8; pop r12; pop rbx; ret
+      void epilogue() {
+        this->emit({0x48, 0x83, 0xC4, 0x08, 0x41, 0x5C, 0x5B, 0xC3});
+      }
+
+      // mov rax, imm64
+      void mov_rax(uint64_t value) {
+        this->emit({0x48, 0xB8});
+        this->emit64(value);
+      }
+
+      // mov eax, imm32
+      void mov_eax(uint32_t value) {
+        this->emit({0xB8});
+        this->emit32(value);
+      }
+
+      // test rax, rax
+      void test_rax() {
+        this->emit({0x48, 0x85, 0xC0});
+      }
+
+      // cmp eax, imm8
+      void cmp_eax(uint8_t value) {
+        this->emit({0x83, 0xF8, value});
+      }
+
+      // Loads a register slot into rax, zero- or sign-extending it
+      void load_slot(const RegisterSlot& slot, bool sign) {
+        switch (slot.width) {
+          case 1:
+            this->emit(sign ? std::initializer_list<uint8_t> {0x48, 0x0F, 0xBE, 0x83} : std::initializer_list<uint8_t> {0x0F, 0xB6, 0x83});
+            break;
+          case 2:
+            this->emit(sign ? std::initializer_list<uint8_t> {0x48, 0x0F, 0xBF, 0x83} : std::initializer_list<uint8_t> {0x0F, 0xB7, 0x83});
+            break;
+          case 4:
+            this->emit(sign ? std::initializer_list<uint8_t> {0x48, 0x63, 0x83} : std::initializer_list<uint8_t> {0x8B, 0x83});
+            break;
+          default:
+            this->emit({0x48, 0x8B, 0x83});
+            break;
+        }
+        this->emit32(slot.offset);
+      }
+
+      // Stores the low bytes of rax to a register slot
+      void store_slot(const RegisterSlot& slot) {
+        switch (slot.width) {
+          case 1:
+            this->emit({0x88, 0x83});
+            break;
+          case 2:
+            this->emit({0x66, 0x89, 0x83});
+            break;
+          case 4:
+            this->emit({0x89, 0x83});
+            break;
+          default:
+            this->emit({0x48, 0x89, 0x83});
+            break;
+        }
+        this->emit32(slot.offset);
+      }
+
+      // mov rax, [r12 + offset]
+      void load_runtime(std::size_t offset) {
+        this->emit({0x49, 0x8B, 0x84, 0x24});
+        this->emit32(static_cast<uint32_t>(offset));
+      }
+
+      // mov [r12 + offset], rax
+      void store_runtime(std::size_t offset) {
+        this->emit({0x49, 0x89, 0x84, 0x24});
+        this->emit32(static_cast<uint32_t>(offset));
+      }
+
+      // mov rdi, r12; mov rsi, rbx; mov rdx, imm64; call [r12 + offset]
+      void call_runtime(std::size_t offset, const void* argument) {
+        this->emit({0x4C, 0x89, 0xE7, 0x48, 0x89, 0xDE, 0x48, 0xBA});
+        this->emit64(reinterpret_cast<uint64_t>(argument));
+        this->emit({0x41, 0xFF, 0x94, 0x24});
+        this->emit32(static_cast<uint32_t>(offset));
+      }
+    };
+
+    constexpr uint8_t exit_code(ExitKind exit) {
+      return static_cast<uint8_t>(exit);
+    }
+
+    struct Supported {
+      bool supported = true;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {}
+
+      void enter_statement(const YieldStatement& stmt) {
+        this->supported = false;
+      }
+
+      void enter_statement(const FinallyStatement& stmt) {
+        this->supported = false;
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    struct CallCounter {
+      std::size_t count = 0;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {}
+
+      void enter_statement(const CallStatement& stmt) {
+        ++this->count;
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    struct NativeCompiler {
+      // Throws waiting for the start of a catch block
+      struct Catch {
+        Register target;
+        std::vector<std::size_t> jumps;
+      };
+
+      const Func& func;
+      Assembler& assembler;
+      std::vector<JitCall>& calls;
+      // Break jumps waiting for the end of the innermost repeat
+      std::vector<std::size_t> breaks;
+      // Jumps waiting for the epilogue
+      std::vector<std::size_t> exits;
+      std::vector<Catch> catches;
+      // The position of each repeat's head, then of its entry stub
+      std::vector<std::pair<const RepeatStatement*, std::size_t>> loops;
+
+      NativeCompiler(
+        const Func& func,
+        Assembler& assembler,
+        std::vector<JitCall>& calls) :
+          func {func},
+          assembler {assembler},
+          calls {calls} {}
+
+      const RegisterSlot& slot(Register reg) const {
+        return this->func.registers.slots[reg];
+      }
+
+      void compile() {
+        auto& a = this->assembler;
+        a.prologue();
+        this->compile_block(this->func.block);
+
+        // Falling off the end returns nothing
+        a.mov_rax(0);
+        this->return_rax();
+
+        for (auto jump : this->exits) {
+          a.patch(jump, a.position());
+        }
+        a.epilogue();
+
+        // Loop entries set up the same machine frame as the func's
+        // entry, so they share its epilogue
+        for (auto& loop : this->loops) {
+          auto stub = a.position();
+          a.prologue();
+          a.jmp_to(loop.second);
+          loop.second = stub;
+        }
+      }
+
+      void compile_block(const Block& block) {
+        for (auto& stmt : block) {
+          map_statement(*stmt, *this);
+        }
+      }
+
+      void return_rax() {
+        auto& a = this->assembler;
+        a.store_runtime(offsetof(JitRuntime, return_value));
+        a.mov_eax(exit_code(ExitKind::Return));
+        this->exits.push_back(a.jmp());
+      }
+
+      // Throws the value in rax to the innermost catch, or out of the
+      // func
+      void throw_rax() {
+        auto& a = this->assembler;
+        if (this->catches.empty()) {
+          a.store_runtime(offsetof(JitRuntime, thrown_value));
+          a.mov_eax(exit_code(ExitKind::Throw));
+          this->exits.push_back(a.jmp());
+          return;
+        }
+
+        auto& handler = this->catches.back();
+        if (handler.target != void_register())
+          a.store_slot(this->slot(handler.target));
+        handler.jumps.push_back(a.jmp());
+      }
+
+      void operator()(const LoadStatement& stmt) {
+        auto& a = this->assembler;
+        a.mov_rax(stmt.value);
+        a.store_slot(this->slot(stmt.target));
+      }
+
+      void operator()(const CallStatement& stmt) {
+        auto& a = this->assembler;
+        this->calls.push_back({&stmt, this->func.registers.slots.data()});
+        a.call_runtime(offsetof(JitRuntime, call), &this->calls.back());
+
+        a.cmp_eax(exit_code(ExitKind::Return));
+        auto done = a.je();
+        a.load_runtime(offsetof(JitRuntime, thrown_value));
+        this->throw_rax();
+        a.patch(done, a.position());
+      }
+
+      void operator()(const IfStatement& stmt) {
+        auto& a = this->assembler;
+        a.load_slot(this->slot(stmt.source), false);
+        a.test_rax();
+        auto to_false = a.jz();
+        this->compile_block(stmt.true_block);
+
+        if (stmt.false_block.empty()) {
+          a.patch(to_false, a.position());
+          return;
+        }
+
+        auto to_end = a.jmp();
+        a.patch(to_false, a.position());
+        this->compile_block(stmt.false_block);
+        a.patch(to_end, a.position());
+      }
+
+      void operator()(const RepeatStatement& stmt) {
+        auto& a = this->assembler;
+        std::vector<std::size_t> outer_breaks;
+        std::swap(outer_breaks, this->breaks);
+
+        auto head = a.position();
+        this->loops.emplace_back(&stmt, head);
+        this->compile_block(stmt.block);
+        a.jmp_to(head);
+
+        for (auto jump : this->breaks) {
+          a.patch(jump, a.position());
+        }
+        this->breaks = std::move(outer_breaks);
+      }
+
+      void operator()(const BreakStatement& stmt) {
+        this->breaks.push_back(this->assembler.jmp());
+      }
+
+      void operator()(const TryStatement& stmt) {
+        auto& a = this->assembler;
+        this->catches.push_back({stmt.target, {}});
+        this->compile_block(stmt.try_block);
+        auto handler = std::move(this->catches.back());
+        this->catches.pop_back();
+
+        auto to_end = a.jmp();
+        for (auto jump : handler.jumps) {
+          a.patch(jump, a.position());
+        }
+        this->compile_block(stmt.catch_block);
+        a.patch(to_end, a.position());
+      }
+
+      void operator()(const FinallyStatement& stmt) {}
+
+      void operator()(const ReturnStatement& stmt) {
+        auto& a = this->assembler;
+        if (stmt.source == void_register()) {
+          a.mov_rax(0);
+        } else {
+          auto& slot = this->slot(stmt.source);
+          a.load_slot(slot, slot.is_signed);
+        }
+        this->return_rax();
+      }
+
+      void operator()(const YieldStatement& stmt) {}
+
+      void operator()(const ThrowStatement& stmt) {
+        auto& a = this->assembler;
+        if (stmt.source == void_register()) {
+          a.mov_rax(0);
+        } else {
+          auto& slot = this->slot(stmt.source);
+          a.load_slot(slot, slot.is_signed);
+        }
+        this->throw_rax();
+      }
+    };
+
+  }
+
+  Jit::~Jit() {
+    for (auto& entry : this->funcs) {
+      const void* attached = &entry.second;
+      entry.first->native_code.compare_exchange_strong(
+        attached,
+        nullptr,
+        std::memory_order_release,
+        std::memory_order_relaxed);
+#if ZVM_JIT
+      if (entry.second.memory)
+        munmap(entry.second.memory, entry.second.size);
+#endif
+    }
+  }
+
+  bool Jit::compile(const Func& func) {
+#if ZVM_JIT
+    if (this->funcs.count(&func))
+      return true;
+
+    if (contains_fused_statements(func.block))
+      return false;
+
+    Supported supported;
+    traverse_block(func.block, supported);
+    if (!supported.supported)
+      return false;
+
+    // Call sites are referenced by address, so they must not move
+    CallCounter counter;
+    traverse_block(func.block, counter);
+    CompiledFunc compiled;
+    compiled.calls.reserve(counter.count);
+
+    Assembler assembler;
+    NativeCompiler compiler {func, assembler, compiled.calls};
+    compiler.compile();
+
+    // Mapped writable, then switched to executable once written
+    auto page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    auto size = (assembler.code.size() + page_size - 1) / page_size * page_size;
+    void* memory = mmap(
+      nullptr,
+      size,
+      PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS,
+      -1,
+      0);
+    if (memory == MAP_FAILED)
+      return false;
+
+    std::memcpy(memory, assembler.code.data(), assembler.code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+      munmap(memory, size);
+      return false;
+    }
+
+    compiled.entry = reinterpret_cast<NativeCode>(memory);
+    for (auto& loop : compiler.loops) {
+      compiled.loops.emplace(
+        loop.first,
+        reinterpret_cast<NativeCode>(static_cast<unsigned char*>(memory) + loop.second));
+    }
+    compiled.memory = memory;
+    compiled.size = size;
+    auto& added = this->funcs.emplace(&func, std::move(compiled)).first->second;
+    this->attach(func, added);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+}
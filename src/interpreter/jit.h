@@ -0,0 +1,152 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "program/func.h"
+
+// Native code is only generated for x86-64 Linux
+#if defined(__x86_64__) && defined(__linux__)
+#define ZVM_JIT 1
+#else
+#define ZVM_JIT 0
+#endif
+
+namespace zvm {
+
+  enum class ExitKind;
+
+  struct JitRuntime;
+  struct JitCall;
+
+  // Entry point of a compiled func. `registers` is a zeroed window
+  // laid out by the func's RegisterList with the arguments in its
+  // first registers, exactly as for an interpreter frame. Returns
+  // ExitKind::Return with the value in runtime.return_value, or
+  // ExitKind::Throw with the value in runtime.thrown_value.
+  using NativeCode = ExitKind (*)(JitRuntime& runtime, unsigned char* registers);
+
+  // Makes a call on behalf of native code, storing the result in the
+  // caller's target register. Returns like NativeCode.
+  using NativeCallHandler = ExitKind (*)(
+    JitRuntime& runtime,
+    unsigned char* registers,
+    const JitCall& call);
+
+  // Per-thread state shared by native code and the interpreter which
+  // runs it. Native code reads and writes these fields directly.
+  struct JitRuntime {
+    // Native calls nest on the machine stack, so their depth is bounded
+    static constexpr uint32_t max_depth = 10000;
+    static constexpr uint32_t default_stack_budget = 4 << 20;
+
+    RegisterValue return_value = 0;
+    RegisterValue thrown_value = 0;
+    NativeCallHandler call = nullptr;
+    // Passed through to `call`
+    void* context = nullptr;
+    uint32_t depth = 0;
+    // Bytes of machine stack which AOT code may still take for the
+    // register windows of its direct calls. A direct call which would
+    // exceed it throws 0, as a call beyond max_depth does.
+    uint32_t stack_budget = default_stack_budget;
+  };
+
+  // A call statement in native code
+  struct JitCall {
+    const CallStatement* stmt;
+    // Register layout of the calling func
+    const RegisterSlot* slots;
+  };
+
+  // Baseline compiler from Funcs to native code. Each statement is
+  // translated on its own: registers stay in their frame slots, If,
+  // Repeat, Break and Try become native branches, and every call goes
+  // through the runtime's call handler, which finds the callee's code
+  // in this table or runs it in the interpreter. Funcs are compiled
+  // one at a time, so the choice of engine is per func.
+  //
+  // Compiled code bakes in the func's register layout and must not
+  // outlive it. Compile every func before the Jit is shared between
+  // threads.
+  //
+  // The first Jit to compile a func attaches its CompiledFunc to the
+  // func's native_code, so looking up the entry for a call is a load
+  // and a compare. A Jit which finds the func claimed by another uses
+  // its table instead.
+  struct Jit {
+    struct CompiledFunc {
+      const Jit* owner = nullptr;
+      NativeCode entry = nullptr;
+      void* memory = nullptr;
+      std::size_t size = 0;
+      // Referenced by address from the code
+      std::vector<JitCall> calls;
+      // Entries at the head of each repeat's body, for frames which
+      // switch to native code in the middle of a loop. Everything
+      // after the loop runs natively too, so an entry returns from
+      // the whole func.
+      std::unordered_map<const RepeatStatement*, NativeCode> loops;
+    };
+
+    std::unordered_map<const Func*, CompiledFunc> funcs;
+
+    Jit() {}
+    ~Jit();
+
+    Jit(const Jit& other) = delete;
+    Jit& operator=(const Jit& other) = delete;
+
+    // Compiles a valid func. Returns false, leaving the func to the
+    // interpreter, if it yields, has a finally statement or has been
+    // fused, or if native code is not available.
+    bool compile(const Func& func);
+
+    // Adds code compiled elsewhere, such as an AOT library, which
+    // stays owned by its caller
+    void add(const Func& func, NativeCode entry) {
+      auto& compiled = this->funcs[&func];
+      compiled.entry = entry;
+      this->attach(func, compiled);
+    }
+
+    NativeCode entry(const Func& func) const {
+      auto* attached = static_cast<const CompiledFunc*>(
+        func.native_code.load(std::memory_order_acquire));
+      // No Jit has compiled the func
+      if (!attached)
+        return nullptr;
+      if (attached->owner == this)
+        return attached->entry;
+
+      auto iter = this->funcs.find(&func);
+      return iter == this->funcs.end() ? nullptr : iter->second.entry;
+    }
+
+    // Attaches `compiled` to `func` unless another Jit got there first
+    void attach(const Func& func, CompiledFunc& compiled) {
+      compiled.owner = this;
+      const void* expected = nullptr;
+      func.native_code.compare_exchange_strong(
+        expected,
+        &compiled,
+        std::memory_order_release,
+        std::memory_order_relaxed);
+    }
+
+    // The entry at the head of `loop`, which must be in `func`, or
+    // nullptr if `func` is not compiled. Registers must hold the values
+    // the loop starts its next iteration with.
+    NativeCode loop_entry(const Func& func, const RepeatStatement& loop) const {
+      auto iter = this->funcs.find(&func);
+      if (iter == this->funcs.end())
+        return nullptr;
+
+      auto loop_iter = iter->second.loops.find(&loop);
+      return loop_iter == iter->second.loops.end() ? nullptr : loop_iter->second;
+    }
+  };
+
+}
@@ -0,0 +1,369 @@
+#include <cstddef>
+#include <type_traits>
+#include "lower.h"
+#include "superinstructions.h"
+#include "program/traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    struct Lowerer {
+      // A statement whose nested blocks are being lowered. `saved`
+      // holds what its handler needs once each block is done: jump
+      // and range positions, or the state of the enclosing repeat.
+      struct OpenStatement {
+        const Statement* stmt;
+        Block::const_iterator next;
+        Block::const_iterator end;
+        uint8_t child;
+        std::size_t saved[3];
+      };
+
+      Code& code;
+      // Open statements, innermost last, so that deep funcs do not
+      // recurse
+      std::vector<OpenStatement> open;
+      // Break jumps waiting for the end of the enclosing repeat
+      std::vector<std::size_t> breaks;
+      // Number of finally-protected regions being lowered, and the
+      // number open at the start of the innermost repeat
+      std::size_t finally_depth = 0;
+      std::size_t repeat_finally_depth = 0;
+
+      explicit Lowerer(Code& code) : code {code} {}
+
+      std::size_t position() const {
+        return this->code.instructions.size();
+      }
+
+      std::size_t emit(
+        Opcode op,
+        Register reg = 0,
+        int32_t operand = 0,
+        RegisterValue value = 0)
+      {
+        this->code.instructions.push_back({op, reg, operand, value});
+        return this->position() - 1;
+      }
+
+      void patch_jump(std::size_t from, std::size_t to) {
+        this->code.instructions[from].operand =
+          static_cast<int32_t>(to) - static_cast<int32_t>(from);
+      }
+
+      void lower_block(const Block& block) {
+        const std::size_t base = this->open.size();
+        this->open.push_back({nullptr, block.begin(), block.end(), 0, {}});
+
+        while (this->open.size() > base) {
+          auto& top = this->open.back();
+
+          if (top.next != top.end) {
+            const Statement& stmt = **top.next++;
+            if (is_fused_statement(stmt))
+              map_fused_statement(stmt, *this);
+            else
+              map_statement(stmt, *this);
+            continue;
+          }
+
+          if (top.stmt) {
+            ++top.child;
+            auto fn = [&](auto& typed) {
+              return this->next_block(typed, top);
+            };
+            if (map_statement(*top.stmt, fn))
+              continue;
+          }
+
+          this->open.pop_back();
+        }
+      }
+
+      // Opens the first block of `stmt`, with what its handler saves
+      void open_block(
+        const Statement& stmt,
+        const Block& block,
+        std::size_t saved0,
+        std::size_t saved1 = 0,
+        std::size_t saved2 = 0)
+      {
+        this->open.push_back({&stmt, block.begin(), block.end(), 0, {saved0, saved1, saved2}});
+      }
+
+      static bool lower_next(OpenStatement& open, const Block& block) {
+        open.next = block.begin();
+        open.end = block.end();
+        return true;
+      }
+
+      // Called once the nested blocks of `open` before `open.child`
+      // are lowered. Moves `open` on to the next block and returns
+      // true, or finishes the statement and returns false.
+      template<typename S>
+      bool next_block(const S& stmt, OpenStatement& open) {
+        return false;
+      }
+
+      // Fused statements are expanded back into their loads and tail
+      template<FusedKind kind, std::size_t load_count, typename Tail>
+      void operator()(const FusedStatement<kind, load_count, Tail>& stmt) {
+        for (std::size_t i = 0; i < load_count; ++i) {
+          this->emit(Opcode::Load, stmt.targets[i], 0, stmt.values[i]);
+        }
+        if constexpr (!std::is_void_v<Tail>)
+          (*this)(*stmt.tail);
+      }
+
+      void operator()(const LoadStatement& stmt) {
+        this->emit(Opcode::Load, stmt.target, 0, stmt.value);
+      }
+
+      void operator()(const CallStatement& stmt) {
+        auto index = static_cast<int32_t>(this->code.calls.size());
+        this->code.calls.push_back({
+          stmt.target,
+          stmt.interface,
+          stmt.func_name,
+          static_cast<uint32_t>(this->code.args.size()),
+          static_cast<uint32_t>(stmt.args.size()),
+          stmt.slot,
+          no_callee_index(),
+          stmt.callee,
+        });
+        this->code.args.insert(
+          this->code.args.end(),
+          stmt.args.begin(),
+          stmt.args.end());
+        this->emit(Opcode::Call, 0, index);
+      }
+
+      void operator()(const IfStatement& stmt) {
+        auto branch = this->emit(Opcode::JumpIfFalse, stmt.source);
+        this->open_block(stmt, stmt.true_block, branch);
+      }
+
+      bool next_block(const IfStatement& stmt, OpenStatement& open) {
+        auto branch = open.saved[0];
+
+        if (open.child == 2) {
+          this->patch_jump(open.saved[1], this->position());
+          return false;
+        }
+
+        if (stmt.false_block.empty()) {
+          this->patch_jump(branch, this->position());
+          return false;
+        }
+
+        open.saved[1] = this->emit(Opcode::Jump);
+        this->patch_jump(branch, this->position());
+        return lower_next(open, stmt.false_block);
+      }
+
+      void operator()(const RepeatStatement& stmt) {
+        auto outer_breaks = this->breaks.size();
+        auto outer_finally_depth = this->repeat_finally_depth;
+        this->repeat_finally_depth = this->finally_depth;
+
+        this->open_block(
+          stmt,
+          stmt.block,
+          outer_breaks,
+          outer_finally_depth,
+          this->position());
+      }
+
+      bool next_block(const RepeatStatement& stmt, OpenStatement& open) {
+        auto outer_breaks = open.saved[0];
+        auto start = open.saved[2];
+
+        this->patch_jump(this->emit(Opcode::Jump), start);
+        this->repeat_finally_depth = open.saved[1];
+
+        auto end = this->position();
+        for (auto i = outer_breaks; i < this->breaks.size(); ++i) {
+          this->patch_jump(this->breaks[i], end);
+        }
+        this->breaks.resize(outer_breaks);
+        return false;
+      }
+
+      void operator()(const BreakStatement& stmt) {
+        // Only breaks which leave a finally-protected region need the
+        // handler lookup of Leave
+        this->breaks.push_back(this->emit(
+          this->finally_depth > this->repeat_finally_depth
+            ? Opcode::Leave
+            : Opcode::Jump));
+      }
+
+      void operator()(const TryStatement& stmt) {
+        this->open_block(stmt, stmt.try_block, this->position());
+      }
+
+      bool next_block(const TryStatement& stmt, OpenStatement& open) {
+        if (open.child == 1) {
+          open.saved[1] = this->position();
+          open.saved[2] = this->emit(Opcode::Jump);
+          return lower_next(open, stmt.catch_block);
+        }
+
+        auto begin = open.saved[0];
+        auto end = open.saved[1];
+        auto skip = open.saved[2];
+        this->patch_jump(skip, this->position());
+
+        this->code.handlers.push_back({
+          static_cast<uint32_t>(begin),
+          static_cast<uint32_t>(end),
+          static_cast<uint32_t>(skip + 1),
+          static_cast<uint32_t>(this->position()),
+          HandlerKind::Catch,
+          stmt.target,
+        });
+        return false;
+      }
+
+      void operator()(const FinallyStatement& stmt) {
+        ++this->finally_depth;
+        this->open_block(stmt, stmt.block, this->position());
+      }
+
+      bool next_block(const FinallyStatement& stmt, OpenStatement& open) {
+        // The normal path falls through into the finally block
+        if (open.child == 1) {
+          --this->finally_depth;
+          open.saved[1] = this->position();
+          return lower_next(open, stmt.finally_block);
+        }
+
+        auto begin = open.saved[0];
+        auto end = open.saved[1];
+        auto index = static_cast<int32_t>(this->code.handlers.size());
+        this->emit(Opcode::EndFinally, 0, index);
+
+        this->code.handlers.push_back({
+          static_cast<uint32_t>(begin),
+          static_cast<uint32_t>(end),
+          static_cast<uint32_t>(end),
+          static_cast<uint32_t>(this->position()),
+          HandlerKind::Finally,
+          void_register(),
+        });
+        return false;
+      }
+
+      void operator()(const ReturnStatement& stmt) {
+        this->emit(Opcode::Return, stmt.source);
+      }
+
+      void operator()(const YieldStatement& stmt) {
+        this->emit(Opcode::Yield, stmt.source);
+      }
+
+      void operator()(const ThrowStatement& stmt) {
+        this->emit(Opcode::Throw, stmt.source);
+      }
+    };
+
+  }
+
+  Code lower_func(const Func& func) {
+    Code code;
+    code.func = &func;
+
+    Lowerer lowerer {code};
+    lowerer.lower_block(func.block);
+    lowerer.emit(Opcode::End);
+
+    return code;
+  }
+
+  const Code* LoweredModule::find(const Func& func) const {
+    auto iter = this->indices.find(&func);
+    return iter == this->indices.end() ? nullptr : &this->funcs[iter->second];
+  }
+
+  const Func* LoweredModule::resolve(
+    const CallSite& site,
+    RegisterType receiver_type,
+    CodeView& code) const
+  {
+    uint32_t index = site.callee_index;
+
+    if (site.interface != void_register()) {
+      auto iter = this->interface_types->find(receiver_type);
+      if (iter == this->interface_types->end())
+        return nullptr;
+
+      auto& func_map = iter->second->func_map;
+      auto method = func_map.find(site.func_name);
+      if (method == func_map.end())
+        return nullptr;
+
+      auto found = this->indices.find(method->second);
+      if (found == this->indices.end())
+        return nullptr;
+
+      index = found->second;
+    }
+
+    if (index == no_callee_index())
+      return nullptr;
+
+    auto& callee = this->funcs[index];
+    code = callee.view();
+    return callee.func;
+  }
+
+  void lower_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    LoweredModule& module)
+  {
+    module.interface_types = &interface_types;
+    module.funcs.clear();
+    module.indices.clear();
+
+    auto add = [&](const Func* func) {
+      if (module.indices.emplace(func, module.funcs.size()).second)
+        module.funcs.push_back(lower_func(*func));
+    };
+
+    for (auto* func : funcs) {
+      add(func);
+    }
+
+    for (auto& pair : global.func_map) {
+      add(pair.second);
+    }
+
+    for (auto& pair : interface_types) {
+      for (auto& method : pair.second->func_map) {
+        add(method.second);
+      }
+    }
+
+    for (auto& code : module.funcs) {
+      for (auto& site : code.calls) {
+        if (site.interface != void_register())
+          continue;
+
+        const Func* callee = site.callee;
+        if (!callee) {
+          auto iter = global.func_map.find(site.func_name);
+          if (iter != global.func_map.end())
+            callee = iter->second;
+        }
+
+        auto iter = module.indices.find(callee);
+        if (iter != module.indices.end())
+          site.callee_index = iter->second;
+      }
+    }
+  }
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "code.h"
+
+namespace zvm {
+
+  // Compiles a validated Func into a linear instruction stream. Fused
+  // statements are expanded back into the statements they replaced.
+  Code lower_func(const Func& func);
+
+  // Lowered code for a set of funcs which call each other. Global
+  // calls are bound to their callee's code when the module is lowered;
+  // interface calls look up the receiver's interface type.
+  struct LoweredModule : public CodeResolver {
+    const InterfaceTypeTable* interface_types = nullptr;
+    std::vector<Code> funcs;
+    std::unordered_map<const Func*, uint32_t> indices;
+
+    LoweredModule() {}
+
+    LoweredModule(const LoweredModule& other) = delete;
+    LoweredModule& operator=(const LoweredModule& other) = delete;
+
+    // The code of `func`, or nullptr if it is not in the module
+    const Code* find(const Func& func) const;
+
+    const Func* resolve(
+      const CallSite& site,
+      RegisterType receiver_type,
+      CodeView& code) const override;
+  };
+
+  // Lowers `funcs`, and every func reachable through `global` and
+  // `interface_types`, into `module`
+  void lower_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    LoweredModule& module);
+
+}
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <iomanip>
+#include "profile.h"
+#include "program/printer.h"
+
+namespace zvm {
+
+  namespace {
+
+    // Prefixes each line with the executions and cycles of its
+    // statement
+    struct ProfileAnnotator : public StatementAnnotator {
+      const ExecutionProfile& profile;
+
+      explicit ProfileAnnotator(const ExecutionProfile& profile) :
+        profile {profile} {}
+
+      void annotate(std::ostream& out, const Statement* stmt) override {
+        auto iter = stmt ? this->profile.statements.find(stmt) : this->profile.statements.end();
+        if (iter == this->profile.statements.end()) {
+          out << std::setw(26) << "" << " | ";
+          return;
+        }
+
+        out
+          << std::setw(10) << iter->second.executions
+          << std::setw(16) << iter->second.cycles
+          << " | ";
+      }
+    };
+
+  }
+
+  void print_profile(
+    std::ostream& out,
+    const ExecutionProfile& profile,
+    const std::vector<Pointer<Func>>& funcs)
+  {
+    std::vector<std::pair<uint32_t, ExecutionProfile::FuncCounts>> ran;
+    for (uint32_t i = 0; i < funcs.size(); ++i) {
+      auto iter = profile.funcs.find(funcs[i]);
+      if (iter != profile.funcs.end())
+        ran.emplace_back(i, iter->second);
+    }
+
+    std::stable_sort(ran.begin(), ran.end(), [](auto& a, auto& b) {
+      if (a.second.cycles != b.second.cycles)
+        return a.second.cycles > b.second.cycles;
+      return a.second.statements > b.second.statements;
+    });
+
+    out << "funcs\n";
+    for (auto& entry : ran) {
+      out << "  func " << entry.first
+        << ": calls " << entry.second.calls
+        << ", statements " << entry.second.statements
+        << ", cycles " << entry.second.cycles << '\n';
+    }
+
+    out << "methods\n";
+    for (auto& entry : profile.methods) {
+      out << "  type " << entry.first.first
+        << " method " << entry.first.second
+        << ": calls " << entry.second << '\n';
+    }
+
+    out << std::setw(10) << "count" << std::setw(16) << "cycles" << " |\n";
+    ProfileAnnotator annotator {profile};
+    for (auto& entry : ran) {
+      print_func(out, *funcs[entry.first], entry.first, &annotator);
+    }
+  }
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "program/func.h"
+#include "traits.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define ZVM_RDTSC 1
+#else
+#define ZVM_RDTSC 0
+#endif
+
+namespace zvm {
+
+  // The time stamp counter where available, otherwise steady clock
+  // nanoseconds
+  inline uint64_t read_cycle_counter() {
+#if ZVM_RDTSC
+    return __rdtsc();
+#else
+    return static_cast<uint64_t>(
+      std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+  }
+
+  // Counts gathered by ProfilingTraits. Cycles are self time: each
+  // statement is charged until the next statement starts, so a call
+  // is charged for entering its callee but not for the callee's
+  // statements. Native funcs are counted as calls only.
+  struct ExecutionProfile {
+    struct StatementCounts {
+      uint64_t executions = 0;
+      uint64_t cycles = 0;
+    };
+
+    struct FuncCounts {
+      uint64_t calls = 0;
+      uint64_t statements = 0;
+      uint64_t cycles = 0;
+    };
+
+    std::unordered_map<const Statement*, StatementCounts> statements;
+    std::unordered_map<const Func*, FuncCounts> funcs;
+    // Interface calls by receiver type and func name
+    std::map<std::pair<RegisterType, FuncName>, uint64_t> methods;
+
+    // The statement being timed
+    const Statement* timed_statement = nullptr;
+    const Func* timed_func = nullptr;
+    uint64_t timed_since = 0;
+
+    void count_statement(const Func& func, const Statement& stmt) {
+      ++this->statements[&stmt].executions;
+      ++this->funcs[&func].statements;
+    }
+
+    // Charges the statement being timed and starts timing `stmt`
+    void time_statement(const Func* func, const Statement* stmt) {
+      auto now = read_cycle_counter();
+      if (this->timed_statement) {
+        auto cycles = now - this->timed_since;
+        this->statements[this->timed_statement].cycles += cycles;
+        this->funcs[this->timed_func].cycles += cycles;
+      }
+      this->timed_statement = stmt;
+      this->timed_func = func;
+      this->timed_since = now;
+    }
+
+    // Charges the last statement. Call when execution stops.
+    void finish() {
+      this->time_statement(nullptr, nullptr);
+    }
+  };
+
+  // Records into the profile set with `profile()` on this thread,
+  // counting executions and, if `time` is set, cycles. Statement
+  // timing reads the cycle counter once per statement.
+  template<bool time>
+  struct BasicProfilingTraits : DefaultTraits {
+    static constexpr bool profile = true;
+
+    static ExecutionProfile*& current() {
+      static thread_local ExecutionProfile* profile = nullptr;
+      return profile;
+    }
+
+    static void profile_statement(const Func& func, const Statement& stmt) {
+      if (auto* profile = current()) {
+        profile->count_statement(func, stmt);
+        if constexpr (time)
+          profile->time_statement(&func, &stmt);
+      }
+    }
+
+    static void profile_func(const Func& func) {
+      if (auto* profile = current())
+        ++profile->funcs[&func].calls;
+    }
+
+    static void profile_method(RegisterType type, FuncName name) {
+      if (auto* profile = current())
+        ++profile->methods[{type, name}];
+    }
+  };
+
+  using ProfilingTraits = BasicProfilingTraits<false>;
+  using TimedProfilingTraits = BasicProfilingTraits<true>;
+
+  // Writes the funcs in `funcs` which ran, hottest first, the
+  // interface calls, and a listing of each func which ran with the
+  // executions and cycles of every statement. Funcs are numbered by
+  // their position in `funcs`, as in print_module.
+  void print_profile(
+    std::ostream& out,
+    const ExecutionProfile& profile,
+    const std::vector<Pointer<Func>>& funcs);
+
+}
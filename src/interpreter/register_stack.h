@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include "program/func.h"
+
+namespace zvm {
+
+  // Untyped register access works on the aligned 8 byte word which
+  // holds the register. Registers are naturally aligned and windows
+  // are sized and aligned in whole words, so the word always lies
+  // within the window, and no access branches on the register width.
+
+  inline RegisterValue* register_word(unsigned char* window, const RegisterSlot& slot) {
+    return reinterpret_cast<RegisterValue*>(window + (slot.offset & ~7u));
+  }
+
+  inline const RegisterValue* register_word(
+    const unsigned char* window,
+    const RegisterSlot& slot)
+  {
+    return reinterpret_cast<const RegisterValue*>(window + (slot.offset & ~7u));
+  }
+
+  // Reads a register as a RegisterValue, zero- or sign-extending
+  // narrow registers. Void registers read as 0.
+  inline RegisterValue load_register(
+    const unsigned char* window,
+    const RegisterSlot& slot)
+  {
+    RegisterValue word;
+    std::memcpy(&word, register_word(window, slot), sizeof(word));
+
+    // Move the register to the top of the word, then back down
+    unsigned bits = slot.width * 8u;
+    unsigned drop = 64 - bits;
+    RegisterValue high = bits ? word << (drop - slot.shift) : 0;
+    return slot.is_signed
+      ? static_cast<RegisterValue>(static_cast<int64_t>(high) >> drop)
+      : high >> (drop & 63);
+  }
+
+  // Writes the low bytes of `value` to a register
+  inline void store_register(
+    unsigned char* window,
+    const RegisterSlot& slot,
+    RegisterValue value)
+  {
+    RegisterValue* ptr = register_word(window, slot);
+    RegisterValue word;
+    std::memcpy(&word, ptr, sizeof(word));
+
+    unsigned bits = slot.width * 8u;
+    RegisterValue mask = bits ? ~RegisterValue(0) >> (64 - bits) << slot.shift : 0;
+    word = (word & ~mask) | ((value << slot.shift) & mask);
+    std::memcpy(ptr, &word, sizeof(word));
+  }
+
+  // A contiguous stack of register storage shared by every frame
+  // running on one thread. Each frame owns a window at the top of the
+  // stack, laid out by its func's RegisterList; a callee's window
+  // starts directly after its caller's. The storage is allocated once,
+  // so pushing a window is a bump of the top offset.
+  struct RegisterStack {
+    static constexpr std::size_t default_capacity = 8 << 20;
+
+    // Storage is allocated as RegisterValues so that every window is
+    // aligned for the widest register
+    std::unique_ptr<RegisterValue[]> values;
+    std::size_t capacity;
+    std::size_t top = 0;
+
+    // `capacity` is in bytes
+    explicit RegisterStack(std::size_t capacity = default_capacity) :
+      values {new RegisterValue[capacity / sizeof(RegisterValue)]},
+      capacity {capacity / sizeof(RegisterValue) * sizeof(RegisterValue)} {}
+
+    RegisterStack(const RegisterStack& other) = delete;
+    RegisterStack& operator=(const RegisterStack& other) = delete;
+
+    unsigned char* base() const {
+      return reinterpret_cast<unsigned char*>(this->values.get());
+    }
+
+    // Returns a zeroed window of `size` bytes, or nullptr if the stack
+    // is exhausted. `size` must be a multiple of
+    // RegisterList::frame_alignment.
+    unsigned char* push(std::size_t size) {
+      if (this->capacity - this->top < size)
+        return nullptr;
+
+      unsigned char* window = this->base() + this->top;
+      std::memset(window, 0, size);
+      this->top += size;
+      return window;
+    }
+
+    // Pops `window` and every window above it
+    void pop(unsigned char* window) {
+      this->top = static_cast<std::size_t>(window - this->base());
+    }
+  };
+
+}
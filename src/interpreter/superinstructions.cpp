@@ -0,0 +1,289 @@
+#include <algorithm>
+#include "superinstructions.h"
+#include "program/traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    using Kind = StatementKind;
+
+    // Sequences are counted by a key packing their kinds and length
+    uint32_t sequence_key(const Statement* const* stmts, uint8_t length) {
+      uint32_t key = static_cast<uint32_t>(length) << 24;
+      for (uint8_t i = 0; i < length; ++i) {
+        key |= static_cast<uint32_t>(stmts[i]->kind) << (i * 8);
+      }
+      return key;
+    }
+
+    StatementSequence sequence_from_key(uint32_t key, uint64_t count) {
+      StatementSequence sequence {{}, static_cast<uint8_t>(key >> 24), count};
+      for (uint8_t i = 0; i < sequence.length; ++i) {
+        sequence.kinds[i] = static_cast<StatementKind>((key >> (i * 8)) & 0xff);
+      }
+      return sequence;
+    }
+
+    struct SequenceCounter {
+      const ExecutionProfile& profile;
+      std::unordered_map<uint32_t, uint64_t> counts;
+
+      void count_block(const Block& block) {
+        for (std::size_t i = 0; i < block.size(); ++i) {
+          // Sequences already fused are not counted again
+          if (is_fused_statement(*block[i]))
+            continue;
+          map_statement(*block[i], *this);
+
+          for (uint8_t length = 2; length <= 3 && i + length <= block.size(); ++length) {
+            auto iter = this->profile.statements.find(block[i + length - 1]);
+            if (iter != this->profile.statements.end() && iter->second.executions)
+              this->counts[sequence_key(&block[i], length)] += iter->second.executions;
+          }
+        }
+      }
+
+      template<typename S>
+      void operator()(const S& stmt) {}
+
+      void operator()(const IfStatement& stmt) {
+        this->count_block(stmt.true_block);
+        this->count_block(stmt.false_block);
+      }
+
+      void operator()(const RepeatStatement& stmt) {
+        this->count_block(stmt.block);
+      }
+
+      void operator()(const TryStatement& stmt) {
+        this->count_block(stmt.try_block);
+        this->count_block(stmt.catch_block);
+      }
+
+      void operator()(const FinallyStatement& stmt) {
+        this->count_block(stmt.block);
+        this->count_block(stmt.finally_block);
+      }
+    };
+
+    struct StatementFuser {
+      ProgramArena& arena;
+      const SuperinstructionSet& set;
+      std::size_t fused = 0;
+
+      template<typename F>
+      Pointer<Statement> fuse(const Statement* const* loads, const Statement* tail = nullptr) {
+        auto* stmt = this->arena.create<F>();
+        for (std::size_t i = 0; i < F::loads; ++i) {
+          auto& load = cast_statement<LoadStatement>(*loads[i]);
+          stmt->targets[i] = load.target;
+          stmt->values[i] = load.value;
+        }
+        if constexpr (!std::is_void_v<typename F::TailStatement>)
+          stmt->tail = &cast_statement<typename F::TailStatement>(*tail);
+        ++this->fused;
+        return stmt;
+      }
+
+      // Fuses the last loads of a run with the If or Return after it.
+      // Returns the number of loads taken.
+      template<typename One, typename Two>
+      std::size_t fuse_tail(
+        Pointer<Statement>& fused,
+        const Statement* const* run_end,
+        std::size_t run,
+        const Statement* tail) {
+        if (run >= 2 && this->set.enabled(Two::fused_kind)) {
+          fused = this->fuse<Two>(run_end - 2, tail);
+          return 2;
+        }
+        if (this->set.enabled(One::fused_kind)) {
+          fused = this->fuse<One>(run_end - 1, tail);
+          return 1;
+        }
+        return 0;
+      }
+
+      void fuse_block(Block& block) {
+        // Statements fused earlier are left as they are
+        for (auto stmt : block) {
+          if (!is_fused_statement(*stmt))
+            map_statement(*stmt, *this);
+        }
+
+        Block out {block.get_allocator()};
+        out.reserve(block.size());
+
+        std::size_t i = 0;
+        while (i < block.size()) {
+          if (block[i]->kind != Kind::Load) {
+            out.push_back(block[i++]);
+            continue;
+          }
+
+          std::size_t end = i;
+          while (end < block.size() && block[end]->kind == Kind::Load) {
+            ++end;
+          }
+
+          // The loads which feed an If or Return are fused with it,
+          // and the rest of the run is fused into groups of loads
+          const Statement* const* loads = &block[i];
+          std::size_t run = end - i;
+          std::size_t tail_loads = 0;
+          Pointer<Statement> fused_tail = nullptr;
+          if (end < block.size()) {
+            auto* tail = block[end];
+            if (tail->kind == Kind::If) {
+              tail_loads = this->fuse_tail<LoadIfStatement, LoadLoadIfStatement>(
+                fused_tail, loads + run, run, tail);
+            } else if (tail->kind == Kind::Return) {
+              tail_loads = this->fuse_tail<LoadReturnStatement, LoadLoadReturnStatement>(
+                fused_tail, loads + run, run, tail);
+            }
+          }
+
+          std::size_t rest = run - tail_loads;
+          std::size_t j = 0;
+          while (j < rest) {
+            if (rest - j >= 3 && this->set.enabled(FusedKind::LoadLoadLoad)) {
+              out.push_back(this->fuse<LoadLoadLoadStatement>(loads + j));
+              j += 3;
+            } else if (rest - j >= 2 && this->set.enabled(FusedKind::LoadLoad)) {
+              out.push_back(this->fuse<LoadLoadStatement>(loads + j));
+              j += 2;
+            } else {
+              out.push_back(block[i + j]);
+              ++j;
+            }
+          }
+
+          if (fused_tail) {
+            out.push_back(fused_tail);
+            ++end;
+          }
+          i = end;
+        }
+
+        block = std::move(out);
+      }
+
+      template<typename S>
+      void operator()(S& stmt) {}
+
+      void operator()(IfStatement& stmt) {
+        this->fuse_block(stmt.true_block);
+        this->fuse_block(stmt.false_block);
+      }
+
+      void operator()(RepeatStatement& stmt) {
+        this->fuse_block(stmt.block);
+      }
+
+      void operator()(TryStatement& stmt) {
+        this->fuse_block(stmt.try_block);
+        this->fuse_block(stmt.catch_block);
+      }
+
+      void operator()(FinallyStatement& stmt) {
+        this->fuse_block(stmt.block);
+        this->fuse_block(stmt.finally_block);
+      }
+    };
+
+  }
+
+  std::vector<StatementSequence> rank_statement_sequences(
+    const std::vector<Pointer<Func>>& funcs,
+    const ExecutionProfile& profile) {
+    SequenceCounter counter {profile, {}};
+    for (auto* func : funcs) {
+      counter.count_block(func->block);
+    }
+
+    std::vector<StatementSequence> ranking;
+    ranking.reserve(counter.counts.size());
+    for (auto& entry : counter.counts) {
+      ranking.push_back(sequence_from_key(entry.first, entry.second));
+    }
+
+    // Ties go to longer sequences, then to earlier kinds, so that the
+    // ranking does not depend on hashing
+    std::sort(ranking.begin(), ranking.end(), [](auto& a, auto& b) {
+      if (a.count != b.count)
+        return a.count > b.count;
+      if (a.length != b.length)
+        return a.length > b.length;
+      return std::lexicographical_compare(
+        a.kinds, a.kinds + a.length,
+        b.kinds, b.kinds + b.length);
+    });
+    return ranking;
+  }
+
+  bool superinstruction_kind(const StatementSequence& sequence, FusedKind& kind) {
+    for (uint8_t i = 0; i + 1 < sequence.length; ++i) {
+      if (sequence.kinds[i] != Kind::Load)
+        return false;
+    }
+
+    bool triple = sequence.length == 3;
+    switch (sequence.kinds[sequence.length - 1]) {
+      case Kind::Load:
+        kind = triple ? FusedKind::LoadLoadLoad : FusedKind::LoadLoad;
+        return true;
+      case Kind::If:
+        kind = triple ? FusedKind::LoadLoadIf : FusedKind::LoadIf;
+        return true;
+      case Kind::Return:
+        kind = triple ? FusedKind::LoadLoadReturn : FusedKind::LoadReturn;
+        return true;
+      default:
+        return false;
+    }
+  }
+
+  SuperinstructionSet SuperinstructionSet::all() {
+    SuperinstructionSet set;
+    for (int kind = 0; kind < fused_kind_count; ++kind) {
+      set.enable(static_cast<FusedKind>(kind));
+    }
+    return set;
+  }
+
+  SuperinstructionSet select_superinstructions(
+    const std::vector<StatementSequence>& ranking,
+    const ExecutionProfile& profile,
+    double min_share) {
+    uint64_t dispatches = 0;
+    for (auto& entry : profile.statements) {
+      dispatches += entry.second.executions;
+    }
+
+    SuperinstructionSet set;
+    for (auto& sequence : ranking) {
+      FusedKind kind;
+      if (!superinstruction_kind(sequence, kind))
+        continue;
+
+      auto saved = sequence.count * (sequence.length - 1);
+      if (saved > 0 && saved >= min_share * dispatches)
+        set.enable(kind);
+    }
+    return set;
+  }
+
+  std::size_t fuse_statements(
+    Func& func,
+    ProgramArena& arena,
+    const SuperinstructionSet& set) {
+    if (!set.kinds)
+      return 0;
+
+    StatementFuser fuser {arena, set};
+    fuser.fuse_block(func.block);
+    return fuser.fused;
+  }
+
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <vector>
+#include "program/arena.h"
+#include "program/func.h"
+#include "program/traverse.h"
+#include "profile.h"
+
+namespace zvm {
+
+  // Superinstructions, which only appear in funcs rewritten by
+  // fuse_statements. They are private to the interpreter: their
+  // statement kinds follow the last StatementKind, and map_statement
+  // does not understand them. Passes over the tree decline fused funcs
+  // (see contains_fused_statements), so fusion should come last.
+  enum class FusedKind {
+    LoadLoad,
+    LoadLoadLoad,
+    LoadIf,
+    LoadLoadIf,
+    LoadReturn,
+    LoadLoadReturn,
+  };
+
+  constexpr int fused_kind_count = 6;
+
+  constexpr StatementKind fused_statement_kind(FusedKind kind) {
+    return static_cast<StatementKind>(
+      static_cast<int>(StatementKind::Throw) + 1 + static_cast<int>(kind));
+  }
+
+  inline FusedKind fused_kind(const Statement& stmt) {
+    return static_cast<FusedKind>(
+      static_cast<int>(stmt.kind) - static_cast<int>(StatementKind::Throw) - 1);
+  }
+
+  inline const char* fused_kind_name(FusedKind kind) {
+    switch (kind) {
+      case FusedKind::LoadLoad: return "LoadLoad";
+      case FusedKind::LoadLoadLoad: return "LoadLoadLoad";
+      case FusedKind::LoadIf: return "LoadIf";
+      case FusedKind::LoadLoadIf: return "LoadLoadIf";
+      case FusedKind::LoadReturn: return "LoadReturn";
+      case FusedKind::LoadLoadReturn: return "LoadLoadReturn";
+    }
+    return "?";
+  }
+
+  // A run of loads, optionally followed by an If or Return, executed
+  // with a single dispatch. The loads are copied out of the statements
+  // they replace. The tail is the original statement, so that an If
+  // still pushes its own blocks.
+  template<FusedKind kind_value, std::size_t load_count, typename Tail>
+  struct FusedStatement : public TypedStatement<fused_statement_kind(kind_value)> {
+    using TailStatement = Tail;
+    static constexpr FusedKind fused_kind = kind_value;
+    static constexpr std::size_t loads = load_count;
+
+    Register targets[load_count];
+    RegisterValue values[load_count];
+    const Tail* tail = nullptr;
+  };
+
+  using LoadLoadStatement =
+    FusedStatement<FusedKind::LoadLoad, 2, void>;
+  using LoadLoadLoadStatement =
+    FusedStatement<FusedKind::LoadLoadLoad, 3, void>;
+  using LoadIfStatement =
+    FusedStatement<FusedKind::LoadIf, 1, IfStatement>;
+  using LoadLoadIfStatement =
+    FusedStatement<FusedKind::LoadLoadIf, 2, IfStatement>;
+  using LoadReturnStatement =
+    FusedStatement<FusedKind::LoadReturn, 1, ReturnStatement>;
+  using LoadLoadReturnStatement =
+    FusedStatement<FusedKind::LoadLoadReturn, 2, ReturnStatement>;
+
+  // Like map_statement, for fused statements
+  template<typename F>
+  auto map_fused_statement(const Statement& stmt, F& fn) {
+    switch (fused_kind(stmt)) {
+      case FusedKind::LoadLoad:
+        return fn(cast_statement<LoadLoadStatement>(stmt));
+      case FusedKind::LoadLoadLoad:
+        return fn(cast_statement<LoadLoadLoadStatement>(stmt));
+      case FusedKind::LoadIf:
+        return fn(cast_statement<LoadIfStatement>(stmt));
+      case FusedKind::LoadLoadIf:
+        return fn(cast_statement<LoadLoadIfStatement>(stmt));
+      case FusedKind::LoadReturn:
+        return fn(cast_statement<LoadReturnStatement>(stmt));
+      case FusedKind::LoadLoadReturn:
+        return fn(cast_statement<LoadLoadReturnStatement>(stmt));
+    }
+    std::abort();
+  }
+
+  // Adjacent statements in a block, and how often they ran in a row.
+  // Blocks are only entered at their start, so the last statement of
+  // a sequence runs exactly as often as the whole sequence.
+  struct StatementSequence {
+    StatementKind kinds[3];
+    uint8_t length;
+    uint64_t count;
+  };
+
+  // Ranks the pairs and triples of statement kinds in `funcs` by how
+  // often they ran in `profile`, gathered with ProfilingTraits, most
+  // frequent first
+  std::vector<StatementSequence> rank_statement_sequences(
+    const std::vector<Pointer<Func>>& funcs,
+    const ExecutionProfile& profile);
+
+  // Returns the superinstruction which executes a sequence, or false
+  // if there is none
+  bool superinstruction_kind(const StatementSequence& sequence, FusedKind& kind);
+
+  // The superinstructions fuse_statements may form
+  struct SuperinstructionSet {
+    uint32_t kinds = 0;
+
+    static uint32_t bit(FusedKind kind) {
+      return uint32_t(1) << static_cast<uint32_t>(kind);
+    }
+
+    void enable(FusedKind kind) {
+      this->kinds |= bit(kind);
+    }
+
+    bool enabled(FusedKind kind) const {
+      return (this->kinds & bit(kind)) != 0;
+    }
+
+    static SuperinstructionSet all();
+  };
+
+  // Enables the superinstructions for the ranked sequences which
+  // would save at least `min_share` of the dispatches in `profile`
+  SuperinstructionSet select_superinstructions(
+    const std::vector<StatementSequence>& ranking,
+    const ExecutionProfile& profile,
+    double min_share = 0.01);
+
+  // Replaces the sequences in a valid func which form an enabled
+  // superinstruction, preferring triples to pairs. Fused statements
+  // are allocated from `arena`; the statements they replace are left
+  // in place so that profiles and If tails stay valid. Returns the
+  // number of superinstructions formed.
+  //
+  // Fused funcs run in InterpreterFrame, and lower_func expands them
+  // back into their loads and tails. Validation, the other passes, the
+  // Jit, the AOT emitter and write_module decline them, so run those
+  // first.
+  std::size_t fuse_statements(
+    Func& func,
+    ProgramArena& arena,
+    const SuperinstructionSet& set);
+
+}
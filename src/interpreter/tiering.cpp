@@ -0,0 +1,80 @@
+#include "tiering.h"
+
+namespace zvm {
+
+  Tiering::~Tiering() {
+    for (auto& entry : this->counters) {
+      void* attached = &entry.second;
+      entry.first->tiering_counters.compare_exchange_strong(
+        attached,
+        nullptr,
+        std::memory_order_release,
+        std::memory_order_relaxed);
+    }
+  }
+
+  Tiering::Counters& Tiering::find_counters(const Func& func) {
+    auto* attached = static_cast<Counters*>(
+      func.tiering_counters.load(std::memory_order_acquire));
+    if (attached && attached->owner == this)
+      return *attached;
+
+    // First call, or the func is attached to another Tiering
+    auto& counters = this->counters[&func];
+    if (!attached) {
+      counters.owner = this;
+      void* expected = nullptr;
+      func.tiering_counters.compare_exchange_strong(
+        expected,
+        &counters,
+        std::memory_order_release,
+        std::memory_order_relaxed);
+    }
+    return counters;
+  }
+
+  NativeCode Tiering::count_call(const Func& func) {
+    auto& counters = this->find_counters(func);
+    if (++counters.calls < this->call_threshold)
+      return nullptr;
+
+    return this->promote(func, counters);
+  }
+
+  NativeCode Tiering::count_back_edge(
+    const Func& func,
+    const RepeatStatement& loop,
+    Counters*& cache)
+  {
+    if (!cache)
+      cache = &this->find_counters(func);
+
+    auto& counters = *cache;
+    if (!counters.entry) {
+      if (++counters.back_edges < this->back_edge_threshold || !this->promote(func, counters))
+        return nullptr;
+    }
+
+    NativeCode entry = this->jit.loop_entry(func, loop);
+    if (entry)
+      ++this->loop_entry_count;
+    return entry;
+  }
+
+  NativeCode Tiering::promote(const Func& func, Counters& counters) {
+    if (counters.entry || counters.failed)
+      return counters.entry;
+
+    if (this->jit.compile(func))
+      counters.entry = this->jit.entry(func);
+
+    if (!counters.entry) {
+      counters.failed = true;
+      return nullptr;
+    }
+
+    ++this->compiled_count;
+    return counters.entry;
+  }
+
+}
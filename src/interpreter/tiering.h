@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include "program/func.h"
+#include "jit.h"
+
+namespace zvm {
+
+  // Moves hot funcs from the interpreter to native code. Frames with
+  // Traits::tiering count their calls and repeat back edges here, and
+  // a func is compiled by `jit` once either count crosses its
+  // threshold. Later calls to it run natively, and a frame looping in
+  // it continues in native code from the head of its loop.
+  //
+  // Counts are per func, kept from the first call on. Funcs which do
+  // not compile, such as fused funcs, stay interpreted and are not
+  // tried again. Like the Interpreter it is attached to, a Tiering
+  // must only be used by one thread at a time.
+  //
+  // The first Tiering to count a func attaches its counters to the
+  // func, so counting a call is a load and an owner compare rather
+  // than a hash lookup. Another Tiering counting the same func keeps
+  // its counters in its own table. A Tiering must not outlive the
+  // funcs it has counted.
+  struct Tiering {
+    struct Counters {
+      const Tiering* owner = nullptr;
+      uint32_t calls = 0;
+      uint32_t back_edges = 0;
+      NativeCode entry = nullptr;
+      bool failed = false;
+    };
+
+    uint32_t call_threshold;
+    uint32_t back_edge_threshold;
+    Jit jit;
+    std::unordered_map<const Func*, Counters> counters;
+    std::size_t compiled_count = 0;
+    // Frames which switched to native code mid-loop
+    std::size_t loop_entry_count = 0;
+
+    explicit Tiering(uint32_t call_threshold = 1000, uint32_t back_edge_threshold = 10000) :
+      call_threshold {call_threshold},
+      back_edge_threshold {back_edge_threshold} {}
+
+    ~Tiering();
+
+    Tiering(const Tiering& other) = delete;
+    Tiering& operator=(const Tiering& other) = delete;
+
+    Counters& find_counters(const Func& func);
+
+    // Counts a call to `func`, which has no native code. Returns its
+    // native code if the call makes it hot and it compiles.
+    NativeCode count_call(const Func& func);
+
+    // Counts a back edge of `loop` in `func`. Returns the loop's entry
+    // once `func` has native code. `cache` holds the func's counters
+    // between back edges of one frame, and starts out null.
+    NativeCode count_back_edge(const Func& func, const RepeatStatement& loop, Counters*& cache);
+
+    NativeCode promote(const Func& func, Counters& counters);
+  };
+
+}
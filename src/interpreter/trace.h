@@ -0,0 +1,65 @@
+#pragma once
+
+#include <iostream>
+#include "superinstructions.h"
+#include "traits.h"
+
+namespace zvm {
+
+  inline const char* statement_kind_name(StatementKind kind) {
+    using Kind = StatementKind;
+    switch (kind) {
+      case Kind::Load: return "Load";
+      case Kind::Call: return "Call";
+      case Kind::If: return "If";
+      case Kind::Repeat: return "Repeat";
+      case Kind::Break: return "Break";
+      case Kind::Try: return "Try";
+      case Kind::Finally: return "Finally";
+      case Kind::Return: return "Return";
+      case Kind::Yield: return "Yield";
+      case Kind::Throw: return "Throw";
+    }
+    return "?";
+  }
+
+  inline const char* opcode_name(Opcode op) {
+    switch (op) {
+      case Opcode::Load: return "Load";
+      case Opcode::Call: return "Call";
+      case Opcode::Jump: return "Jump";
+      case Opcode::JumpIfFalse: return "JumpIfFalse";
+      case Opcode::Return: return "Return";
+      case Opcode::Yield: return "Yield";
+      case Opcode::Throw: return "Throw";
+      case Opcode::Leave: return "Leave";
+      case Opcode::EndFinally: return "EndFinally";
+      case Opcode::End: return "End";
+    }
+    return "?";
+  }
+
+  // Debugging policy which writes each executed statement or
+  // instruction to stdout and checks register accesses
+  struct TraceTraits : DefaultTraits {
+    static constexpr bool trace = true;
+    static constexpr bool check = true;
+
+    static void trace_statement(const Statement& stmt) {
+      if (is_fused_statement(stmt))
+        std::cout << fused_kind_name(fused_kind(stmt)) << "\n";
+      else
+        std::cout << statement_kind_name(stmt.kind) << "\n";
+    }
+
+    static void trace_instruction(const Instruction& inst) {
+      std::cout << opcode_name(inst.op) << "\n";
+    }
+
+    [[noreturn]] static void check_failed(const char* message) {
+      std::cerr << "interpreter check failed: " << message << "\n";
+      std::abort();
+    }
+  };
+
+}
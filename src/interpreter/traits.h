@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdlib>
+#include "program/func.h"
+#include "code.h"
+
+// Direct-threaded dispatch relies on the "labels as values" extension
+#if defined(__GNUC__) || defined(__clang__)
+#define ZVM_COMPUTED_GOTO 1
+#else
+#define ZVM_COMPUTED_GOTO 0
+#endif
+
+namespace zvm {
+
+  enum class Dispatch {
+    Switch,
+    Threaded,
+  };
+
+  // Interpreter policies are selected at compile time through the
+  // Traits parameter of InterpreterFrame and CodeFrame. DefaultTraits
+  // is the production policy: no tracing, no runtime checks, no
+  // profiling, no tiering, and switch dispatch. Custom traits should
+  // derive from DefaultTraits and override only what they need.
+  struct DefaultTraits {
+    static constexpr bool trace = false;
+    static constexpr bool check = false;
+    static constexpr Dispatch dispatch = Dispatch::Switch;
+    static constexpr bool count_inline_caches = false;
+    // Enables the profile_* hooks of InterpreterFrame
+    static constexpr bool profile = false;
+    // Counts calls and back edges into the interpreter's Tiering, if
+    // it has one
+    static constexpr bool tiering = false;
+
+    static void trace_statement(const Statement& stmt) {}
+    static void trace_instruction(const Instruction& inst) {}
+
+    // Called before `stmt` of `func` executes
+    static void profile_statement(const Func& func, const Statement& stmt) {}
+    // Called when `func` is entered, whether interpreted or native
+    static void profile_func(const Func& func) {}
+    // Called when an interface call resolves
+    static void profile_method(RegisterType type, FuncName name) {}
+
+    [[noreturn]] static void check_failed(const char* message) {
+      std::abort();
+    }
+  };
+
+  struct CheckedTraits : DefaultTraits {
+    static constexpr bool check = true;
+  };
+
+  struct InlineCacheCountingTraits : DefaultTraits {
+    static constexpr bool count_inline_caches = true;
+  };
+
+  struct ThreadedTraits : DefaultTraits {
+    static constexpr Dispatch dispatch = Dispatch::Threaded;
+  };
+
+  struct TieringTraits : DefaultTraits {
+    static constexpr bool tiering = true;
+  };
+
+  template<typename Traits>
+  constexpr bool use_threaded_dispatch() {
+    return ZVM_COMPUTED_GOTO && Traits::dispatch == Dispatch::Threaded;
+  }
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include "program/func.h"
+#include "interpreter/code.h"
+
+namespace zvm {
+
+  // Binary module layout. A module file is a Header followed by
+  // sections of fixed-size records. Every section is aligned to
+  // ModuleFormat::alignment so that the file can be mapped and read
+  // in place. Records refer to each other by index, never by pointer.
+  // The format is little-endian.
+  //
+  // Each block is a contiguous run of node records, so a block is
+  // described by a (begin, count) pair into the node section.
+  namespace ModuleFormat {
+
+    constexpr uint32_t magic = 0x4d4d565a; // "ZVMM"
+    constexpr uint32_t version = 2;
+    constexpr uint32_t byte_order = 0x01020304;
+    constexpr uint64_t alignment = 16;
+    constexpr uint32_t no_interface = ~0u;
+
+    struct Section {
+      uint64_t offset;
+      uint64_t count;
+    };
+
+    struct Header {
+      uint32_t magic;
+      uint32_t version;
+      uint32_t byte_order;
+      uint32_t global_interface;
+      Section funcs;
+      Section interfaces;
+      Section methods;
+      Section interface_types;
+      Section register_types;
+      Section nodes;
+      Section node_args;
+      Section instructions;
+      Section call_sites;
+      Section call_args;
+      Section handlers;
+      uint64_t size;
+    };
+
+    struct FuncRecord {
+      Register arg_count;
+      Register register_count;
+      uint32_t registers_begin;
+      RegisterType return_type;
+      uint32_t block_begin;
+      uint32_t block_count;
+      uint32_t code_begin;
+      uint32_t code_count;
+      uint32_t calls_begin;
+      uint32_t call_count;
+      uint32_t call_args_begin;
+      uint32_t call_arg_count;
+      uint32_t handlers_begin;
+      uint32_t handler_count;
+      uint32_t reserved;
+    };
+
+    // Methods of an interface are sorted by name
+    struct InterfaceRecord {
+      uint32_t methods_begin;
+      uint32_t method_count;
+    };
+
+    struct MethodRecord {
+      FuncName name;
+      uint16_t reserved;
+      uint32_t func_index;
+    };
+
+    // Sorted by type
+    struct InterfaceTypeRecord {
+      RegisterType type;
+      uint32_t interface_index;
+    };
+
+    // Field use by kind:
+    // - Load: reg = target, value
+    // - Call: reg = target, interface, func_name, first = args
+    // - If: reg = source, first = true block, second = false block
+    // - Repeat: first = block
+    // - Try: reg = target, first = try block, second = catch block
+    // - Finally: first = block, second = finally block
+    // - Return, Yield, Throw: reg = source
+    struct NodeRecord {
+      uint8_t kind;
+      uint8_t reserved;
+      Register reg;
+      Register interface;
+      FuncName func_name;
+      uint32_t first_begin;
+      uint32_t first_count;
+      uint32_t second_begin;
+      uint32_t second_count;
+      RegisterValue value;
+    };
+
+    static_assert(sizeof(Header) == 200, "unexpected Header size");
+    static_assert(sizeof(FuncRecord) == 56, "unexpected FuncRecord size");
+    static_assert(sizeof(NodeRecord) == 32, "unexpected NodeRecord size");
+
+  }
+
+}
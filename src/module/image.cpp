@@ -0,0 +1,623 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include "image.h"
+#include "program/traverse.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define ZVM_HAS_MMAP 1
+#else
+#define ZVM_HAS_MMAP 0
+#endif
+
+namespace zvm {
+
+  namespace {
+
+    bool in_range(uint64_t begin, uint64_t count, uint64_t limit) {
+      return begin <= limit && count <= limit - begin;
+    }
+
+    // Checks that every offset, index and range in the image stays
+    // within its section, so that the records and code can be used
+    // without further bounds checks
+    struct ImageVerifier {
+      const ModuleImage& image;
+      const ModuleFormat::Header& header;
+
+      explicit ImageVerifier(const ModuleImage& image) :
+        image {image},
+        header {*image.header} {}
+
+      template<typename T>
+      bool check_section(const ModuleFormat::Section& section) {
+        if (section.offset % ModuleFormat::alignment != 0)
+          return false;
+
+        if (section.count > this->image.size / sizeof(T))
+          return false;
+
+        return in_range(
+          section.offset,
+          section.count * sizeof(T),
+          this->image.size);
+      }
+
+      bool check_sections() {
+        return
+          this->check_section<ModuleFormat::FuncRecord>(this->header.funcs) &&
+          this->check_section<ModuleFormat::InterfaceRecord>(this->header.interfaces) &&
+          this->check_section<ModuleFormat::MethodRecord>(this->header.methods) &&
+          this->check_section<ModuleFormat::InterfaceTypeRecord>(this->header.interface_types) &&
+          this->check_section<RegisterType>(this->header.register_types) &&
+          this->check_section<ModuleFormat::NodeRecord>(this->header.nodes) &&
+          this->check_section<Register>(this->header.node_args) &&
+          this->check_section<Instruction>(this->header.instructions) &&
+          this->check_section<CallSite>(this->header.call_sites) &&
+          this->check_section<Register>(this->header.call_args) &&
+          this->check_section<Handler>(this->header.handlers);
+      }
+
+      bool check_interfaces() {
+        auto* interfaces = this->image.section<ModuleFormat::InterfaceRecord>(
+          this->header.interfaces);
+
+        for (uint64_t i = 0; i < this->header.interfaces.count; ++i) {
+          if (!in_range(
+            interfaces[i].methods_begin,
+            interfaces[i].method_count,
+            this->header.methods.count))
+          {
+            return false;
+          }
+        }
+
+        auto* methods = this->image.section<ModuleFormat::MethodRecord>(
+          this->header.methods);
+
+        for (uint64_t i = 0; i < this->header.methods.count; ++i) {
+          if (methods[i].func_index >= this->header.funcs.count)
+            return false;
+        }
+
+        auto* types = this->image.section<ModuleFormat::InterfaceTypeRecord>(
+          this->header.interface_types);
+
+        for (uint64_t i = 0; i < this->header.interface_types.count; ++i) {
+          if (types[i].interface_index >= this->header.interfaces.count)
+            return false;
+        }
+
+        return this->header.global_interface < this->header.interfaces.count;
+      }
+
+      bool check_nodes() {
+        auto* nodes = this->image.nodes();
+        auto node_count = this->header.nodes.count;
+
+        for (uint64_t i = 0; i < node_count; ++i) {
+          auto& node = nodes[i];
+          if (node.kind > static_cast<uint8_t>(StatementKind::Throw))
+            return false;
+
+          auto kind = static_cast<StatementKind>(node.kind);
+          if (kind == StatementKind::Call) {
+            if (!in_range(node.first_begin, node.first_count, this->header.node_args.count))
+              return false;
+            continue;
+          }
+
+          // Child blocks always follow their parent, which rules out
+          // cycles
+          if (node.first_count && (
+            node.first_begin <= i ||
+            !in_range(node.first_begin, node.first_count, node_count)))
+          {
+            return false;
+          }
+
+          if (node.second_count && (
+            node.second_begin <= i ||
+            !in_range(node.second_begin, node.second_count, node_count)))
+          {
+            return false;
+          }
+        }
+
+        return true;
+      }
+
+      bool check_reg(Register reg, Register register_count) {
+        return reg < register_count || reg == void_register();
+      }
+
+      bool check_code(const ModuleFormat::FuncRecord& func) {
+        if (!in_range(func.code_begin, func.code_count, this->header.instructions.count))
+          return false;
+
+        if (!in_range(func.calls_begin, func.call_count, this->header.call_sites.count))
+          return false;
+
+        if (!in_range(func.call_args_begin, func.call_arg_count, this->header.call_args.count))
+          return false;
+
+        if (!in_range(func.handlers_begin, func.handler_count, this->header.handlers.count))
+          return false;
+
+        auto* handlers = this->image.section<Handler>(this->header.handlers)
+          + func.handlers_begin;
+
+        for (uint32_t i = 0; i < func.handler_count; ++i) {
+          auto& handler = handlers[i];
+          if (
+            handler.begin > handler.end ||
+            handler.end > func.code_count ||
+            handler.target > handler.target_end ||
+            handler.target_end > func.code_count ||
+            handler.target >= func.code_count)
+          {
+            return false;
+          }
+
+          if (handler.kind == HandlerKind::Catch) {
+            if (!this->check_reg(handler.reg, func.register_count))
+              return false;
+          } else if (handler.kind != HandlerKind::Finally) {
+            return false;
+          }
+        }
+
+        auto* code = this->image.section<Instruction>(this->header.instructions)
+          + func.code_begin;
+
+        // Execution must end at End rather than run off the code
+        if (func.code_count == 0 || code[func.code_count - 1].op != Opcode::End)
+          return false;
+
+        for (uint32_t i = 0; i < func.code_count; ++i) {
+          auto& inst = code[i];
+          switch (inst.op) {
+            case Opcode::Load:
+              if (inst.reg >= func.register_count)
+                return false;
+              break;
+            case Opcode::Call:
+              if (inst.operand < 0 || static_cast<uint32_t>(inst.operand) >= func.call_count)
+                return false;
+              break;
+            case Opcode::EndFinally:
+              if (
+                inst.operand < 0 ||
+                static_cast<uint32_t>(inst.operand) >= func.handler_count ||
+                handlers[inst.operand].kind != HandlerKind::Finally)
+              {
+                return false;
+              }
+              break;
+            case Opcode::Jump:
+            case Opcode::JumpIfFalse:
+            case Opcode::Leave: {
+              int64_t target = static_cast<int64_t>(i) + inst.operand;
+              if (target < 0 || target >= func.code_count)
+                return false;
+              if (inst.op == Opcode::JumpIfFalse && inst.reg >= func.register_count)
+                return false;
+              break;
+            }
+            // As in the validator, only void funcs return or yield the
+            // void register, and any func may throw it
+            case Opcode::Return:
+            case Opcode::Yield:
+              if (inst.reg == void_register() && func.return_type != RegisterTypes::Void)
+                return false;
+              if (!this->check_reg(inst.reg, func.register_count))
+                return false;
+              break;
+            case Opcode::Throw:
+              if (!this->check_reg(inst.reg, func.register_count))
+                return false;
+              break;
+            case Opcode::End:
+              break;
+            default:
+              return false;
+          }
+        }
+
+        auto* sites = this->image.section<CallSite>(this->header.call_sites)
+          + func.calls_begin;
+        auto* args = this->image.section<Register>(this->header.call_args)
+          + func.call_args_begin;
+
+        for (uint32_t i = 0; i < func.call_count; ++i) {
+          auto& site = sites[i];
+          if (!in_range(site.args_begin, site.arg_count, func.call_arg_count))
+            return false;
+
+          if (
+            !this->check_reg(site.target, func.register_count) ||
+            !this->check_reg(site.interface, func.register_count))
+          {
+            return false;
+          }
+
+          if (
+            site.callee_index != no_callee_index() &&
+            site.callee_index >= this->header.funcs.count)
+          {
+            return false;
+          }
+
+          for (uint32_t arg = 0; arg < site.arg_count; ++arg) {
+            if (args[site.args_begin + arg] >= func.register_count)
+              return false;
+          }
+        }
+
+        return true;
+      }
+
+      bool check_funcs() {
+        for (uint32_t i = 0; i < this->header.funcs.count; ++i) {
+          auto& func = this->image.func_record(i);
+
+          if (!in_range(
+            func.registers_begin,
+            func.register_count,
+            this->header.register_types.count))
+          {
+            return false;
+          }
+
+          if (func.arg_count > func.register_count)
+            return false;
+
+          if (!in_range(func.block_begin, func.block_count, this->header.nodes.count))
+            return false;
+
+          if (!this->check_code(func))
+            return false;
+        }
+
+        return true;
+      }
+
+      bool verify() {
+        if (
+          this->header.magic != ModuleFormat::magic ||
+          this->header.version != ModuleFormat::version ||
+          this->header.byte_order != ModuleFormat::byte_order ||
+          this->header.size != this->image.size)
+        {
+          return false;
+        }
+
+        return
+          this->check_sections() &&
+          this->check_interfaces() &&
+          this->check_nodes() &&
+          this->check_funcs();
+      }
+    };
+
+    void build_signatures(ModuleImage& image) {
+      auto& header = *image.header;
+
+      image.func_count = static_cast<uint32_t>(header.funcs.count);
+      image.funcs.reset(new Func[image.func_count]);
+
+      auto* register_types = image.section<RegisterType>(header.register_types);
+
+      for (uint32_t i = 0; i < image.func_count; ++i) {
+        auto& record = image.func_record(i);
+        auto& func = image.funcs[i];
+        func.arg_count = record.arg_count;
+        func.return_type = record.return_type;
+        func.registers.assign(
+          register_types + record.registers_begin,
+          register_types + record.registers_begin + record.register_count);
+      }
+
+      auto* interfaces = image.section<ModuleFormat::InterfaceRecord>(header.interfaces);
+      auto* methods = image.section<ModuleFormat::MethodRecord>(header.methods);
+
+      image.interfaces.resize(header.interfaces.count);
+      for (uint64_t i = 0; i < header.interfaces.count; ++i) {
+        auto& record = interfaces[i];
+        auto& func_map = image.interfaces[i].func_map;
+        func_map.reserve(record.method_count);
+
+        for (uint32_t m = 0; m < record.method_count; ++m) {
+          auto& method = methods[record.methods_begin + m];
+          func_map[method.name] = &image.funcs[method.func_index];
+        }
+      }
+
+      auto* types = image.section<ModuleFormat::InterfaceTypeRecord>(
+        header.interface_types);
+
+      image.interface_types.reserve(header.interface_types.count);
+      for (uint64_t i = 0; i < header.interface_types.count; ++i) {
+        image.interface_types[types[i].type] =
+          &image.interfaces[types[i].interface_index];
+      }
+    }
+
+    bool load(ModuleImage& image) {
+      if (image.size < sizeof(ModuleFormat::Header))
+        return false;
+
+      image.header = reinterpret_cast<const ModuleFormat::Header*>(image.data);
+
+      if (!ImageVerifier {image}.verify())
+        return false;
+
+      build_signatures(image);
+      return true;
+    }
+
+    // Presents node records to statement visitors. Each record is
+    // turned into a transient statement on the native stack for each
+    // event, and argument lists use a stack buffer, so walking
+    // allocates nothing for typical calls. Nested blocks are walked
+    // with an explicit stack, so deep funcs do not recurse.
+    struct ImageSource : public StatementSource {
+      struct Frame {
+        uint32_t next;
+        uint32_t end;
+        // The node whose blocks are walked, or ~0 for the root
+        uint32_t owner;
+        uint8_t child;
+      };
+
+      static constexpr uint32_t no_owner = ~uint32_t(0);
+
+      const ModuleImage& image;
+      uint32_t begin;
+      uint32_t count;
+      mutable std::vector<Frame> frames;
+
+      ImageSource(const ModuleImage& image, uint32_t begin, uint32_t count) :
+        image {image},
+        begin {begin},
+        count {count} {}
+
+      static bool has_blocks(StatementKind kind) {
+        using Kind = StatementKind;
+        return kind == Kind::If || kind == Kind::Repeat || kind == Kind::Try || kind == Kind::Finally;
+      }
+
+      bool walk(StatementEvents& events) const override {
+        auto* nodes = this->image.nodes();
+        auto& frames = this->frames;
+        frames.clear();
+        frames.push_back({this->begin, this->begin + this->count, no_owner, 0});
+
+        // Returns false if the node has no more blocks to walk
+        auto next_block = [&](uint32_t owner, uint8_t child) {
+          auto& node = nodes[owner];
+          for (; child < 2; ++child) {
+            auto begin = child == 0 ? node.first_begin : node.second_begin;
+            auto count = child == 0 ? node.first_count : node.second_count;
+            if (count) {
+              frames.push_back({begin, begin + count, owner, child});
+              return true;
+            }
+          }
+          return false;
+        };
+
+        while (!frames.empty()) {
+          auto& frame = frames.back();
+
+          if (frame.next != frame.end) {
+            auto index = frame.next++;
+            auto action = this->emit(events, nodes[index], true);
+            if (action == TraversalAction::Stop) {
+              frames.clear();
+              return false;
+            }
+
+            bool walk_blocks = action == TraversalAction::Continue &&
+              has_blocks(static_cast<StatementKind>(nodes[index].kind));
+            if (!walk_blocks || !next_block(index, 0))
+              this->emit(events, nodes[index], false);
+            continue;
+          }
+
+          auto owner = frame.owner;
+          auto child = frame.child;
+          frames.pop_back();
+          if (owner != no_owner && !next_block(owner, child + 1))
+            this->emit(events, nodes[owner], false);
+        }
+
+        return true;
+      }
+
+      TraversalAction emit(
+        StatementEvents& events,
+        const ModuleFormat::NodeRecord& node,
+        bool enter) const
+      {
+        auto fire = [&](const Statement& stmt) {
+          if (enter)
+            return events.enter(stmt);
+          events.leave(stmt);
+          return TraversalAction::Continue;
+        };
+
+        using Kind = StatementKind;
+        switch (static_cast<Kind>(node.kind)) {
+          case Kind::Load:
+            return fire(LoadStatement {node.reg, node.value});
+          case Kind::Call: {
+            alignas(std::max_align_t) char buffer[512];
+            std::pmr::monotonic_buffer_resource memory {buffer, sizeof(buffer)};
+
+            auto* args = this->image.node_args() + node.first_begin;
+            return fire(CallStatement {
+              node.reg,
+              node.interface,
+              node.func_name,
+              ArgList {args, args + node.first_count, &memory},
+            });
+          }
+          case Kind::If:
+            return fire(IfStatement {node.reg});
+          case Kind::Repeat:
+            return fire(RepeatStatement {});
+          case Kind::Break:
+            return fire(BreakStatement {});
+          case Kind::Try:
+            return fire(TryStatement {node.reg});
+          case Kind::Finally:
+            return fire(FinallyStatement {});
+          case Kind::Return:
+            return fire(ReturnStatement {node.reg});
+          case Kind::Yield:
+            return fire(YieldStatement {node.reg});
+          case Kind::Throw:
+            return fire(ThrowStatement {node.reg});
+        }
+        // Node kinds are checked when the image is loaded
+        return TraversalAction::Stop;
+      }
+    };
+
+  }
+
+  ModuleImage::~ModuleImage() {
+#if ZVM_HAS_MMAP
+    if (this->mapping)
+      munmap(this->mapping, this->size);
+#endif
+  }
+
+  CodeView ModuleImage::code(uint32_t index) const {
+    auto& record = this->func_record(index);
+    auto& header = *this->header;
+
+    return {
+      this->section<Instruction>(header.instructions) + record.code_begin,
+      record.code_count,
+      this->section<CallSite>(header.call_sites) + record.calls_begin,
+      record.call_count,
+      this->section<Register>(header.call_args) + record.call_args_begin,
+      record.call_arg_count,
+      this->section<Handler>(header.handlers) + record.handlers_begin,
+      record.handler_count,
+      record.register_count,
+    };
+  }
+
+  const Func* ModuleImage::resolve(
+    const CallSite& site,
+    RegisterType receiver_type,
+    CodeView& code) const
+  {
+    const Func* target = nullptr;
+
+    if (site.interface != void_register()) {
+      auto iter = this->interface_types.find(receiver_type);
+      if (iter == this->interface_types.end())
+        return nullptr;
+
+      auto& func_map = iter->second->func_map;
+      auto method = func_map.find(site.func_name);
+      if (method != func_map.end())
+        target = method->second;
+    } else if (site.callee_index != no_callee_index()) {
+      target = &this->funcs[site.callee_index];
+    } else {
+      auto& func_map = this->global().func_map;
+      auto iter = func_map.find(site.func_name);
+      if (iter != func_map.end())
+        target = iter->second;
+    }
+
+    if (!target)
+      return nullptr;
+
+    code = this->code(this->func_index(*target));
+    return target;
+  }
+
+  std::unique_ptr<ModuleImage> open_module_image(const char* path) {
+#if ZVM_HAS_MMAP
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+      return nullptr;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+      ::close(fd);
+      return nullptr;
+    }
+
+    auto size = static_cast<std::size_t>(info.st_size);
+    void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (mapping == MAP_FAILED)
+      return nullptr;
+
+    auto image = std::make_unique<ModuleImage>();
+    image->mapping = mapping;
+    image->data = static_cast<const char*>(mapping);
+    image->size = size;
+
+    if (!load(*image))
+      return nullptr;
+
+    return image;
+#else
+    std::ifstream in {path, std::ios::binary};
+    if (!in)
+      return nullptr;
+
+    std::vector<char> bytes {
+      std::istreambuf_iterator<char>(in),
+      std::istreambuf_iterator<char>(),
+    };
+
+    return load_module_image(std::move(bytes));
+#endif
+  }
+
+  std::unique_ptr<ModuleImage> load_module_image(std::vector<char>&& bytes) {
+    auto image = std::make_unique<ModuleImage>();
+    image->buffer = std::move(bytes);
+    image->data = image->buffer.data();
+    image->size = image->buffer.size();
+
+    if (!load(*image))
+      return nullptr;
+
+    return image;
+  }
+
+  bool validate_image_func(
+    ModuleImage& image,
+    uint32_t index,
+    ValidationToken validation_token,
+    SubtypeCache* subtype_cache)
+  {
+    auto& record = image.func_record(index);
+    ImageSource source {image, record.block_begin, record.block_count};
+
+    return validate_func(
+      image.funcs[index],
+      source,
+      image.global(),
+      image.interface_types,
+      validation_token,
+      subtype_cache);
+  }
+
+}
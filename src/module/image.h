@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include "format.h"
+#include "program/validator.h"
+
+namespace zvm {
+
+  // A loaded binary module. The file is mapped read-only and its
+  // statement records and lowered code are used in place. Loading
+  // allocates once per func and per interface (for the signatures and
+  // dispatch maps below) and never per statement.
+  struct ModuleImage : public CodeResolver {
+    const char* data = nullptr;
+    std::size_t size = 0;
+    void* mapping = nullptr;
+    std::vector<char> buffer;
+
+    const ModuleFormat::Header* header = nullptr;
+
+    // Signature-only funcs: registers, arg count and return type are
+    // filled in, but the block is empty
+    std::unique_ptr<Func[]> funcs;
+    uint32_t func_count = 0;
+    std::vector<Interface> interfaces;
+    InterfaceTypeTable interface_types;
+
+    ModuleImage() {}
+    ~ModuleImage();
+
+    ModuleImage(const ModuleImage& other) = delete;
+    ModuleImage& operator=(const ModuleImage& other) = delete;
+
+    template<typename T>
+    const T* section(const ModuleFormat::Section& section) const {
+      return reinterpret_cast<const T*>(this->data + section.offset);
+    }
+
+    const ModuleFormat::FuncRecord& func_record(uint32_t index) const {
+      return this->section<ModuleFormat::FuncRecord>(this->header->funcs)[index];
+    }
+
+    const ModuleFormat::NodeRecord* nodes() const {
+      return this->section<ModuleFormat::NodeRecord>(this->header->nodes);
+    }
+
+    const Register* node_args() const {
+      return this->section<Register>(this->header->node_args);
+    }
+
+    const Interface& global() const {
+      return this->interfaces[this->header->global_interface];
+    }
+
+    uint32_t func_index(const Func& func) const {
+      return static_cast<uint32_t>(&func - this->funcs.get());
+    }
+
+    CodeView code(uint32_t index) const;
+
+    // Resolves calls between the funcs of the image, so that mapped
+    // code can be run with CodeFrame
+    const Func* resolve(
+      const CallSite& site,
+      RegisterType receiver_type,
+      CodeView& code) const override;
+  };
+
+  // Maps the module file at `path`. Returns nullptr if the file cannot
+  // be read or is not a well-formed module.
+  std::unique_ptr<ModuleImage> open_module_image(const char* path);
+
+  // Loads a module from bytes in memory
+  std::unique_ptr<ModuleImage> load_module_image(std::vector<char>&& bytes);
+
+  // Validates the statement records of one func in place
+  bool validate_image_func(
+    ModuleImage& image,
+    uint32_t index,
+    ValidationToken validation_token = 0,
+    SubtypeCache* subtype_cache = nullptr);
+
+}
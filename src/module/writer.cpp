@@ -0,0 +1,360 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include "writer.h"
+#include "format.h"
+#include "interpreter/lower.h"
+#include "program/traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    struct ModuleWriter {
+      std::vector<const Func*> funcs;
+      std::unordered_map<const Func*, uint32_t> func_indices;
+      std::vector<const Interface*> interfaces;
+      std::unordered_map<const Interface*, uint32_t> interface_indices;
+
+      std::vector<ModuleFormat::FuncRecord> func_records;
+      std::vector<ModuleFormat::InterfaceRecord> interface_records;
+      std::vector<ModuleFormat::MethodRecord> method_records;
+      std::vector<ModuleFormat::InterfaceTypeRecord> type_records;
+      std::vector<RegisterType> register_types;
+      std::vector<ModuleFormat::NodeRecord> nodes;
+      std::vector<Register> node_args;
+      std::vector<Instruction> instructions;
+      std::vector<CallSite> call_sites;
+      std::vector<Register> call_args;
+      std::vector<Handler> handlers;
+
+      void add_func(const Func* func) {
+        if (this->func_indices.count(func))
+          return;
+
+        this->func_indices[func] = static_cast<uint32_t>(this->funcs.size());
+        this->funcs.push_back(func);
+      }
+
+      // Methods are added in name order so that output is
+      // deterministic
+      static std::vector<std::pair<FuncName, const Func*>> sorted_methods(
+        const Interface& interface)
+      {
+        std::vector<std::pair<FuncName, const Func*>> methods {
+          interface.func_map.begin(),
+          interface.func_map.end(),
+        };
+        std::sort(methods.begin(), methods.end());
+        return methods;
+      }
+
+      uint32_t add_interface(const Interface* interface) {
+        auto iter = this->interface_indices.find(interface);
+        if (iter != this->interface_indices.end())
+          return iter->second;
+
+        auto index = static_cast<uint32_t>(this->interfaces.size());
+        this->interface_indices[interface] = index;
+        this->interfaces.push_back(interface);
+
+        for (auto& method : sorted_methods(*interface)) {
+          this->add_func(method.second);
+        }
+
+        return index;
+      }
+
+      void write_interfaces() {
+        for (auto* interface : this->interfaces) {
+          auto methods = sorted_methods(*interface);
+          this->interface_records.push_back({
+            static_cast<uint32_t>(this->method_records.size()),
+            static_cast<uint32_t>(methods.size()),
+          });
+
+          for (auto& method : methods) {
+            this->method_records.push_back({
+              method.first,
+              0,
+              this->func_indices.at(method.second),
+            });
+          }
+        }
+      }
+
+      // A statement whose nested blocks are being written, and the
+      // index of the next record in them. Both blocks are placed
+      // together when the statement is entered, so their records are
+      // consecutive.
+      struct OpenStatement {
+        const Statement* stmt;
+        uint32_t next;
+      };
+
+      std::vector<OpenStatement> open;
+
+      uint32_t reserve_block(const Block& block) {
+        auto begin = static_cast<uint32_t>(this->nodes.size());
+        this->nodes.resize(begin + block.size());
+        return begin;
+      }
+
+      void write_block(const Block& block, uint32_t begin) {
+        this->open.push_back({nullptr, begin});
+        traverse_block(block, *this);
+        this->open.clear();
+      }
+
+      template<typename S>
+      void enter_statement(const S& stmt) {
+        // Nested blocks are placed while the record is built, so the
+        // record is assigned by index afterwards
+        auto index = this->open.back().next++;
+        auto record = (*this)(stmt);
+        this->nodes[index] = record;
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {
+        if (this->open.back().stmt == &stmt)
+          this->open.pop_back();
+      }
+
+      static ModuleFormat::NodeRecord make_record(
+        StatementKind kind,
+        Register reg = 0)
+      {
+        ModuleFormat::NodeRecord record {};
+        record.kind = static_cast<uint8_t>(kind);
+        record.reg = reg;
+        return record;
+      }
+
+      void set_blocks(
+        ModuleFormat::NodeRecord& record,
+        const Statement& stmt,
+        const Block& first,
+        const Block* second = nullptr)
+      {
+        record.first_begin = this->reserve_block(first);
+        record.first_count = static_cast<uint32_t>(first.size());
+        if (second) {
+          record.second_begin = this->reserve_block(*second);
+          record.second_count = static_cast<uint32_t>(second->size());
+        }
+
+        if (record.first_count || record.second_count)
+          this->open.push_back({&stmt, record.first_begin});
+      }
+
+      ModuleFormat::NodeRecord operator()(const LoadStatement& stmt) {
+        auto record = make_record(stmt.kind, stmt.target);
+        record.value = stmt.value;
+        return record;
+      }
+
+      ModuleFormat::NodeRecord operator()(const CallStatement& stmt) {
+        auto record = make_record(stmt.kind, stmt.target);
+        record.interface = stmt.interface;
+        record.func_name = stmt.func_name;
+        record.first_begin = static_cast<uint32_t>(this->node_args.size());
+        record.first_count = static_cast<uint32_t>(stmt.args.size());
+        this->node_args.insert(
+          this->node_args.end(),
+          stmt.args.begin(),
+          stmt.args.end());
+        return record;
+      }
+
+      ModuleFormat::NodeRecord operator()(const IfStatement& stmt) {
+        auto record = make_record(stmt.kind, stmt.source);
+        this->set_blocks(record, stmt, stmt.true_block, &stmt.false_block);
+        return record;
+      }
+
+      ModuleFormat::NodeRecord operator()(const RepeatStatement& stmt) {
+        auto record = make_record(stmt.kind);
+        this->set_blocks(record, stmt, stmt.block);
+        return record;
+      }
+
+      ModuleFormat::NodeRecord operator()(const BreakStatement& stmt) {
+        return make_record(stmt.kind);
+      }
+
+      ModuleFormat::NodeRecord operator()(const TryStatement& stmt) {
+        auto record = make_record(stmt.kind, stmt.target);
+        this->set_blocks(record, stmt, stmt.try_block, &stmt.catch_block);
+        return record;
+      }
+
+      ModuleFormat::NodeRecord operator()(const FinallyStatement& stmt) {
+        auto record = make_record(stmt.kind);
+        this->set_blocks(record, stmt, stmt.block, &stmt.finally_block);
+        return record;
+      }
+
+      ModuleFormat::NodeRecord operator()(const ReturnStatement& stmt) {
+        return make_record(stmt.kind, stmt.source);
+      }
+
+      ModuleFormat::NodeRecord operator()(const YieldStatement& stmt) {
+        return make_record(stmt.kind, stmt.source);
+      }
+
+      ModuleFormat::NodeRecord operator()(const ThrowStatement& stmt) {
+        return make_record(stmt.kind, stmt.source);
+      }
+
+      void write_func(const Func& func) {
+        ModuleFormat::FuncRecord record {};
+        record.arg_count = func.arg_count;
+        record.register_count = static_cast<Register>(func.registers.size());
+        record.registers_begin = static_cast<uint32_t>(this->register_types.size());
+        record.return_type = func.return_type;
+
+        this->register_types.insert(
+          this->register_types.end(),
+          func.registers.begin(),
+          func.registers.end());
+
+        record.block_begin = this->reserve_block(func.block);
+        record.block_count = static_cast<uint32_t>(func.block.size());
+        this->write_block(func.block, record.block_begin);
+
+        Code code = lower_func(func);
+
+        record.code_begin = static_cast<uint32_t>(this->instructions.size());
+        record.code_count = static_cast<uint32_t>(code.instructions.size());
+        this->instructions.insert(
+          this->instructions.end(),
+          code.instructions.begin(),
+          code.instructions.end());
+
+        record.calls_begin = static_cast<uint32_t>(this->call_sites.size());
+        record.call_count = static_cast<uint32_t>(code.calls.size());
+        for (auto site : code.calls) {
+          auto iter = this->func_indices.find(site.callee);
+          site.callee_index = iter == this->func_indices.end()
+            ? no_callee_index()
+            : iter->second;
+          site.callee = nullptr;
+          this->call_sites.push_back(site);
+        }
+
+        record.call_args_begin = static_cast<uint32_t>(this->call_args.size());
+        record.call_arg_count = static_cast<uint32_t>(code.args.size());
+        this->call_args.insert(
+          this->call_args.end(),
+          code.args.begin(),
+          code.args.end());
+
+        record.handlers_begin = static_cast<uint32_t>(this->handlers.size());
+        record.handler_count = static_cast<uint32_t>(code.handlers.size());
+        this->handlers.insert(
+          this->handlers.end(),
+          code.handlers.begin(),
+          code.handlers.end());
+
+        this->func_records.push_back(record);
+      }
+
+      template<typename T>
+      static void place(
+        std::vector<char>& out,
+        ModuleFormat::Section& section,
+        const std::vector<T>& items)
+      {
+        auto offset = (out.size() + ModuleFormat::alignment - 1)
+          & ~(ModuleFormat::alignment - 1);
+
+        section = {offset, items.size()};
+        out.resize(offset + items.size() * sizeof(T));
+        if (!items.empty())
+          std::memcpy(out.data() + offset, items.data(), items.size() * sizeof(T));
+      }
+
+      std::vector<char> finish(uint32_t global_interface) {
+        ModuleFormat::Header header {};
+        header.magic = ModuleFormat::magic;
+        header.version = ModuleFormat::version;
+        header.byte_order = ModuleFormat::byte_order;
+        header.global_interface = global_interface;
+
+        std::vector<char> out(sizeof(header));
+        place(out, header.funcs, this->func_records);
+        place(out, header.interfaces, this->interface_records);
+        place(out, header.methods, this->method_records);
+        place(out, header.interface_types, this->type_records);
+        place(out, header.register_types, this->register_types);
+        place(out, header.nodes, this->nodes);
+        place(out, header.node_args, this->node_args);
+        place(out, header.instructions, this->instructions);
+        place(out, header.call_sites, this->call_sites);
+        place(out, header.call_args, this->call_args);
+        place(out, header.handlers, this->handlers);
+        header.size = out.size();
+
+        std::memcpy(out.data(), &header, sizeof(header));
+        return out;
+      }
+    };
+
+  }
+
+  std::vector<char> write_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types)
+  {
+    ModuleWriter writer;
+
+    for (auto* func : funcs) {
+      writer.add_func(func);
+    }
+
+    auto global_index = writer.add_interface(&global);
+
+    std::vector<std::pair<RegisterType, const Interface*>> types {
+      interface_types.begin(),
+      interface_types.end(),
+    };
+    std::sort(types.begin(), types.end());
+
+    for (auto& pair : types) {
+      writer.type_records.push_back({pair.first, writer.add_interface(pair.second)});
+    }
+
+    writer.write_interfaces();
+
+    // The format has no records for fused statements
+    for (auto* func : writer.funcs) {
+      if (contains_fused_statements(func->block))
+        return {};
+    }
+
+    for (auto* func : writer.funcs) {
+      writer.write_func(*func);
+    }
+
+    return writer.finish(global_index);
+  }
+
+  bool write_module_file(
+    const char* path,
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types)
+  {
+    auto bytes = write_module(funcs, global, interface_types);
+    if (bytes.empty())
+      return false;
+
+    std::ofstream out {path, std::ios::binary | std::ios::trunc};
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    return static_cast<bool>(out);
+  }
+
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include "program/func.h"
+
+namespace zvm {
+
+  // Serializes `funcs`, and every func reachable through `global` and
+  // `interface_types`, into the binary module format. Each func is
+  // stored both as its statement tree and as lowered code. Funcs
+  // should be linked first so that lowered calls carry their callee.
+  // Returns an empty vector if a func has been fused.
+  std::vector<char> write_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types);
+
+  bool write_module_file(
+    const char* path,
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types);
+
+}
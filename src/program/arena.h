@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <initializer_list>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "func.h"
+
+namespace zvm {
+
+  // Owns the statements, block contents and argument lists of a
+  // module. Memory is bump-allocated from large chunks, and the entire
+  // module is freed at once when the arena is released or destroyed.
+  // Destructors of arena objects are never run.
+  //
+  // Everything reachable from an arena statement must also come from
+  // the arena: build blocks with ProgramArena::block and argument
+  // lists with ProgramArena::args rather than make_block. A Func whose
+  // block is built in the arena should be constructed with resource(),
+  // or assigning the block copies it to the heap.
+  struct ProgramArena {
+    static constexpr std::size_t default_chunk_size = 64 * 1024;
+
+    std::pmr::monotonic_buffer_resource memory;
+
+    explicit ProgramArena(std::size_t chunk_size = default_chunk_size) :
+      memory {chunk_size} {}
+
+    ProgramArena(const ProgramArena& other) = delete;
+    ProgramArena& operator=(const ProgramArena& other) = delete;
+
+    std::pmr::memory_resource* resource() {
+      return &this->memory;
+    }
+
+    template<typename T, typename ...Args>
+    T* create(Args&& ...args) {
+      static_assert(
+        std::is_base_of_v<Statement, T>,
+        "ProgramArena::create requires a Statement type");
+
+      void* ptr = this->memory.allocate(sizeof(T), alignof(T));
+      T* stmt = new (ptr) T(std::forward<Args>(args)...);
+
+      if constexpr (std::is_same_v<T, CallStatement>) {
+        if (stmt->interface != void_register()) {
+          void* cache = this->memory.allocate(sizeof(InlineCache), alignof(InlineCache));
+          stmt->cache = new (cache) InlineCache;
+        }
+      }
+
+      return stmt;
+    }
+
+    Block block(std::initializer_list<Pointer<Statement>> init = {}) {
+      return Block {init, &this->memory};
+    }
+
+    Block block(std::size_t capacity) {
+      Block block {&this->memory};
+      block.reserve(capacity);
+      return block;
+    }
+
+    ArgList args(std::initializer_list<Register> init = {}) {
+      return ArgList {init, &this->memory};
+    }
+
+    ArgList args(std::size_t capacity) {
+      ArgList args {&this->memory};
+      args.reserve(capacity);
+      return args;
+    }
+
+    // Frees every statement, block and argument list in the arena
+    void release() {
+      this->memory.release();
+    }
+  };
+
+}
@@ -0,0 +1,369 @@
+#include <algorithm>
+#include <cstdlib>
+#include "flat.h"
+
+namespace zvm {
+
+  namespace {
+
+    constexpr uint32_t no_owner = ~0u;
+
+    struct StatementCounter {
+      std::size_t count = 0;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {
+        ++this->count;
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    bool has_blocks(StatementKind kind) {
+      using Kind = StatementKind;
+      return kind == Kind::If || kind == Kind::Repeat || kind == Kind::Try || kind == Kind::Finally;
+    }
+
+    template<typename T>
+    std::size_t array_size(const std::vector<T>& array) {
+      return array.capacity() * sizeof(T);
+    }
+
+    // FNV-1a
+    uint64_t hash_bytes(uint64_t hash, const void* data, std::size_t size) {
+      auto* bytes = static_cast<const unsigned char*>(data);
+      for (std::size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+      }
+      return hash;
+    }
+
+    template<typename T>
+    uint64_t hash_array(uint64_t hash, const std::vector<T>& array) {
+      auto size = static_cast<uint64_t>(array.size());
+      hash = hash_bytes(hash, &size, sizeof(size));
+      return hash_bytes(hash, array.data(), array.size() * sizeof(T));
+    }
+
+    // Fills in the statements of one block at a time, leaving nested
+    // blocks pending so that each block's ids are contiguous
+    struct Flattener {
+      struct Pending {
+        const Block* block;
+        uint32_t begin;
+      };
+
+      FlatFunc& flat;
+      std::vector<Pending> pending;
+      uint32_t next;
+      uint32_t id = 0;
+
+      void add_blocks(const Block& first, const Block& second) {
+        this->flat.operands[this->id] = static_cast<uint32_t>(this->flat.blocks.size());
+        for (auto* block : {&first, &second}) {
+          auto count = static_cast<uint32_t>(block->size());
+          this->flat.blocks.push_back({this->next, count});
+          this->pending.push_back({block, this->next});
+          this->next += count;
+        }
+      }
+
+      void operator()(const LoadStatement& stmt) {
+        this->flat.regs[this->id] = stmt.target;
+        this->flat.operands[this->id] = static_cast<uint32_t>(this->flat.values.size());
+        this->flat.values.push_back(stmt.value);
+      }
+
+      void operator()(const CallStatement& stmt) {
+        this->flat.regs[this->id] = stmt.target;
+        this->flat.operands[this->id] = static_cast<uint32_t>(this->flat.calls.size());
+        this->flat.calls.push_back({
+          stmt.interface,
+          stmt.func_name,
+          static_cast<uint32_t>(this->flat.args.size()),
+          static_cast<uint32_t>(stmt.args.size()),
+        });
+        this->flat.args.insert(this->flat.args.end(), stmt.args.begin(), stmt.args.end());
+      }
+
+      void operator()(const IfStatement& stmt) {
+        this->flat.regs[this->id] = stmt.source;
+        this->add_blocks(stmt.true_block, stmt.false_block);
+      }
+
+      void operator()(const RepeatStatement& stmt) {
+        static const Block empty;
+        this->add_blocks(stmt.block, empty);
+      }
+
+      void operator()(const BreakStatement& stmt) {}
+
+      void operator()(const TryStatement& stmt) {
+        this->flat.regs[this->id] = stmt.target;
+        this->add_blocks(stmt.try_block, stmt.catch_block);
+      }
+
+      void operator()(const FinallyStatement& stmt) {
+        this->add_blocks(stmt.block, stmt.finally_block);
+      }
+
+      void operator()(const ReturnStatement& stmt) {
+        this->flat.regs[this->id] = stmt.source;
+      }
+
+      void operator()(const YieldStatement& stmt) {
+        this->flat.regs[this->id] = stmt.source;
+      }
+
+      void operator()(const ThrowStatement& stmt) {
+        this->flat.regs[this->id] = stmt.source;
+      }
+    };
+
+  }
+
+  std::size_t FlatFunc::memory_size() const {
+    return
+      array_size(this->kinds) +
+      array_size(this->regs) +
+      array_size(this->operands) +
+      array_size(this->values) +
+      array_size(this->calls) +
+      array_size(this->args) +
+      array_size(this->blocks);
+  }
+
+  std::size_t FlatFunc::count(StatementKind kind) const {
+    return static_cast<std::size_t>(std::count(
+      this->kinds.begin(),
+      this->kinds.end(),
+      static_cast<uint8_t>(kind)));
+  }
+
+  uint64_t FlatFunc::hash() const {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    hash = hash_array(hash, this->kinds);
+    hash = hash_array(hash, this->regs);
+    hash = hash_array(hash, this->operands);
+    hash = hash_array(hash, this->values);
+    hash = hash_array(hash, this->calls);
+    hash = hash_array(hash, this->args);
+    hash = hash_array(hash, this->blocks);
+    return hash;
+  }
+
+  FlatFunc flatten_func(const Func& func) {
+    StatementCounter counter;
+    traverse_block(func.block, counter);
+
+    FlatFunc flat;
+    flat.kinds.resize(counter.count);
+    flat.regs.resize(counter.count, void_register());
+    flat.operands.resize(counter.count);
+    flat.root = {0, static_cast<uint32_t>(func.block.size())};
+
+    Flattener flattener {flat, {{&func.block, 0}}, flat.root.count};
+    while (!flattener.pending.empty()) {
+      auto pending = flattener.pending.back();
+      flattener.pending.pop_back();
+
+      for (std::size_t i = 0; i < pending.block->size(); ++i) {
+        auto& stmt = *(*pending.block)[i];
+        flattener.id = pending.begin + static_cast<uint32_t>(i);
+        flat.kinds[flattener.id] = static_cast<uint8_t>(stmt.kind);
+        map_statement(stmt, flattener);
+      }
+    }
+
+    return flat;
+  }
+
+  Block expand_flat_func(const FlatFunc& flat, ProgramArena& arena) {
+    struct Pending {
+      Block* block;
+      FlatFunc::BlockRange range;
+    };
+
+    Block root = arena.block(flat.root.count);
+    std::vector<Pending> pending {{&root, flat.root}};
+
+    while (!pending.empty()) {
+      auto [block, range] = pending.back();
+      pending.pop_back();
+
+      for (uint32_t id = range.begin; id < range.begin + range.count; ++id) {
+        auto reg = flat.regs[id];
+        auto operand = flat.operands[id];
+
+        // Nested blocks are created in the arena with their statement,
+        // and filled in once they are in place
+        auto nest = [&](Block& target, uint8_t index) {
+          auto& nested = flat.nested_block(id, index);
+          target.reserve(nested.count);
+          pending.push_back({&target, nested});
+        };
+
+        using Kind = StatementKind;
+        switch (flat.kind(id)) {
+          case Kind::Load:
+            block->push_back(arena.create<LoadStatement>(reg, flat.values[operand]));
+            break;
+          case Kind::Call: {
+            auto& call = flat.calls[operand];
+            auto args = arena.args(call.arg_count);
+            args.insert(
+              args.end(),
+              flat.args.begin() + call.args_begin,
+              flat.args.begin() + call.args_begin + call.arg_count);
+            block->push_back(arena.create<CallStatement>(
+              reg,
+              call.interface,
+              call.func_name,
+              std::move(args)));
+            break;
+          }
+          case Kind::If: {
+            auto* stmt = arena.create<IfStatement>(reg, arena.block(), arena.block());
+            nest(stmt->true_block, 0);
+            nest(stmt->false_block, 1);
+            block->push_back(stmt);
+            break;
+          }
+          case Kind::Repeat: {
+            auto* stmt = arena.create<RepeatStatement>(arena.block());
+            nest(stmt->block, 0);
+            block->push_back(stmt);
+            break;
+          }
+          case Kind::Break:
+            block->push_back(arena.create<BreakStatement>());
+            break;
+          case Kind::Try: {
+            auto* stmt = arena.create<TryStatement>(reg, arena.block(), arena.block());
+            nest(stmt->try_block, 0);
+            nest(stmt->catch_block, 1);
+            block->push_back(stmt);
+            break;
+          }
+          case Kind::Finally: {
+            auto* stmt = arena.create<FinallyStatement>(arena.block(), arena.block());
+            nest(stmt->block, 0);
+            nest(stmt->finally_block, 1);
+            block->push_back(stmt);
+            break;
+          }
+          case Kind::Return:
+            block->push_back(arena.create<ReturnStatement>(reg));
+            break;
+          case Kind::Yield:
+            block->push_back(arena.create<YieldStatement>(reg));
+            break;
+          case Kind::Throw:
+            block->push_back(arena.create<ThrowStatement>(reg));
+            break;
+          default:
+            std::abort();
+        }
+      }
+    }
+
+    return root;
+  }
+
+  bool FlatSource::walk(StatementEvents& events) const {
+    auto& flat = this->flat;
+    auto& frames = this->frames;
+    frames.clear();
+    frames.push_back({flat.root.begin, flat.root.begin + flat.root.count, no_owner, 0});
+
+    // Returns false if the statement has no more blocks to walk
+    auto next_block = [&](uint32_t owner, uint8_t child) {
+      for (; child < 2; ++child) {
+        auto& range = flat.nested_block(owner, child);
+        if (range.count) {
+          frames.push_back({range.begin, range.begin + range.count, owner, child});
+          return true;
+        }
+      }
+      return false;
+    };
+
+    while (!frames.empty()) {
+      auto& frame = frames.back();
+
+      if (frame.next != frame.end) {
+        auto id = frame.next++;
+        auto action = this->emit(events, id, true);
+        if (action == TraversalAction::Stop) {
+          frames.clear();
+          return false;
+        }
+
+        bool walk_blocks = action == TraversalAction::Continue && has_blocks(flat.kind(id));
+        if (!walk_blocks || !next_block(id, 0))
+          this->emit(events, id, false);
+        continue;
+      }
+
+      auto owner = frame.owner;
+      auto child = frame.child;
+      frames.pop_back();
+      if (owner != no_owner && !next_block(owner, child + 1))
+        this->emit(events, owner, false);
+    }
+
+    return true;
+  }
+
+  TraversalAction FlatSource::emit(StatementEvents& events, uint32_t id, bool enter) const {
+    auto fire = [&](const Statement& stmt) {
+      if (enter)
+        return events.enter(stmt);
+      events.leave(stmt);
+      return TraversalAction::Continue;
+    };
+
+    auto& flat = this->flat;
+    auto reg = flat.regs[id];
+    auto operand = flat.operands[id];
+
+    using Kind = StatementKind;
+    switch (flat.kind(id)) {
+      case Kind::Load:
+        return fire(LoadStatement {reg, flat.values[operand]});
+      case Kind::Call: {
+        alignas(std::max_align_t) char buffer[512];
+        std::pmr::monotonic_buffer_resource memory {buffer, sizeof(buffer)};
+
+        auto& call = flat.calls[operand];
+        auto* args = flat.args.data() + call.args_begin;
+        return fire(CallStatement {
+          reg,
+          call.interface,
+          call.func_name,
+          ArgList {args, args + call.arg_count, &memory},
+        });
+      }
+      case Kind::If:
+        return fire(IfStatement {reg});
+      case Kind::Repeat:
+        return fire(RepeatStatement {});
+      case Kind::Break:
+        return fire(BreakStatement {});
+      case Kind::Try:
+        return fire(TryStatement {reg});
+      case Kind::Finally:
+        return fire(FinallyStatement {});
+      case Kind::Return:
+        return fire(ReturnStatement {reg});
+      case Kind::Yield:
+        return fire(YieldStatement {reg});
+      case Kind::Throw:
+        return fire(ThrowStatement {reg});
+      default:
+        std::abort();
+    }
+  }
+
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "arena.h"
+#include "func.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  // A func's statements as parallel arrays indexed by 32-bit statement
+  // ids. Every block is a contiguous run of ids, so a statement's
+  // nested blocks are ranges of the same arrays and whole-func scans
+  // read each array front to back.
+  //
+  // The meaning of a statement's operand depends on its kind: the
+  // index of its value in `values` for a Load, of its call in `calls`
+  // for a Call, and of its first block in `blocks` for a statement
+  // with nested blocks, whose second block follows it. `regs` holds
+  // the target of a Load, Call or Try and the source of the rest.
+  //
+  // Link results and inline caches are not kept: the flat form is for
+  // analysis and validation, not for execution.
+  struct FlatFunc {
+    struct Call {
+      Register interface;
+      FuncName func_name;
+      uint32_t args_begin;
+      uint32_t arg_count;
+    };
+
+    struct BlockRange {
+      uint32_t begin;
+      uint32_t count;
+    };
+
+    std::vector<uint8_t> kinds;
+    std::vector<Register> regs;
+    std::vector<uint32_t> operands;
+    std::vector<RegisterValue> values;
+    std::vector<Call> calls;
+    std::vector<Register> args;
+    std::vector<BlockRange> blocks;
+    BlockRange root {0, 0};
+
+    std::size_t size() const {
+      return this->kinds.size();
+    }
+
+    StatementKind kind(uint32_t id) const {
+      return static_cast<StatementKind>(this->kinds[id]);
+    }
+
+    const BlockRange& nested_block(uint32_t id, uint8_t index) const {
+      return this->blocks[this->operands[id] + index];
+    }
+
+    // Bytes held by the arrays
+    std::size_t memory_size() const;
+
+    std::size_t count(StatementKind kind) const;
+
+    // Hash of the statements, equal for funcs with equal statements
+    uint64_t hash() const;
+  };
+
+  // Converts a func's statements, which must not be fused
+  FlatFunc flatten_func(const Func& func);
+
+  // Rebuilds the statements of a flat func in `arena`
+  Block expand_flat_func(const FlatFunc& flat, ProgramArena& arena);
+
+  // Walks a flat func for traverse_source and validate_func. The
+  // statements passed to events are temporaries rebuilt from the
+  // arrays for each event, and the walk keeps its own stack, so deep
+  // funcs do not recurse. A source must not walk on two threads at
+  // once.
+  struct FlatSource : public StatementSource {
+    struct Frame {
+      uint32_t next;
+      uint32_t end;
+      // The statement whose blocks are walked, or ~0 for the root
+      uint32_t owner;
+      uint8_t child;
+    };
+
+    const FlatFunc& flat;
+    mutable std::vector<Frame> frames;
+
+    explicit FlatSource(const FlatFunc& flat) : flat {flat} {}
+
+    bool walk(StatementEvents& events) const override;
+    TraversalAction emit(StatementEvents& events, uint32_t id, bool enter) const;
+  };
+
+}
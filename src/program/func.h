@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <memory_resource>
 #include <utility>
 #include <vector>
 #include <unordered_map>
+#include "inline_cache.h"
+#include "registers.h"
 
 namespace zvm {
 
@@ -20,10 +24,12 @@ namespace zvm {
     Throw,
   };
 
+  // Statements are not polymorphic: the kind field identifies the
+  // concrete type, and statements are never deleted through a
+  // Statement pointer. See ProgramArena for ownership.
   struct Statement {
     const StatementKind kind;
     explicit Statement(StatementKind kind) : kind(kind) {}
-    virtual ~Statement() {}
   };
 
   template<StatementKind kind_value>
@@ -64,41 +70,38 @@ namespace zvm {
     return reinterpret_cast<const T&>(stmt);
   }
 
-  using Register = uint16_t;
-  using RegisterType = uint32_t;
-  using RegisterValue = uint64_t;
-
-  constexpr Register void_register() { return ~0; }
-  constexpr Register max_register() { return ~0 - 1; }
-
-  namespace RegisterTypes {
-    enum FundamentalTypes : RegisterType {
-      Void = 0,
-      Bool,
-      Int8,
-      Int16,
-      Int32,
-      Int64,
-      UInt8,
-      UInt16,
-      UInt32,
-      UInt64,
-      Float32,
-      Float64,
-
-      LastFundamentalType = Float64,
-      FirstInterfaceType = 0x100,
-    };
-  }
-
   // TODO: This should perhaps go into a common/memory file
   template<typename T>
   using Pointer = T*;
 
+  struct Func;
+
   using FuncName = uint16_t;
   using InterfaceName = uint16_t;
   using ValidationToken = uintptr_t;
-  using Block = std::vector<Pointer<Statement>>;
+  using MethodSlot = uint32_t;
+
+  // A linked method slot names the static interface of the call and
+  // the method's position within that interface
+  constexpr MethodSlot no_method_slot() { return ~0u; }
+
+  constexpr MethodSlot make_method_slot(uint32_t interface, uint32_t index) {
+    return (interface << 16) | index;
+  }
+
+  constexpr uint32_t method_slot_interface(MethodSlot slot) {
+    return slot >> 16;
+  }
+
+  constexpr uint32_t method_slot_index(MethodSlot slot) {
+    return slot & 0xffff;
+  }
+
+  // Blocks and argument lists take a memory resource so that they can
+  // be allocated from a ProgramArena. When no resource is given they
+  // use the default heap resource.
+  using Block = std::pmr::vector<Pointer<Statement>>;
+  using ArgList = std::pmr::vector<Register>;
 
   inline Block make_block(std::initializer_list<Pointer<Statement>> init) {
     return Block {std::move(init)};
@@ -108,7 +111,7 @@ namespace zvm {
     Register target;
     RegisterValue value;
 
-    LoadStatement(Register target, Register value) :
+    LoadStatement(Register target, RegisterValue value) :
       target {target},
       value {value} {}
   };
@@ -117,13 +120,20 @@ namespace zvm {
     Register target;
     Register interface;
     FuncName func_name;
-    std::vector<Register> args;
+    ArgList args;
+    // Resolved by link_module: the target of a global call, or the
+    // method slot of an interface call
+    Pointer<const Func> callee = nullptr;
+    MethodSlot slot = no_method_slot();
+    // Interface calls created by a ProgramArena get an inline cache
+    // from the arena. Calls without one always do a full lookup.
+    Pointer<InlineCache> cache = nullptr;
 
     CallStatement(
       Register target,
       Register interface,
       FuncName func_name,
-      std::vector<Register>&& args = {}) :
+      ArgList&& args = {}) :
         target {target},
         interface {interface},
         func_name {func_name},
@@ -198,13 +208,26 @@ namespace zvm {
 
   // TODO: Create useful constructors
   struct Func {
-    ValidationToken validation_token = 0;
+    // Published with release ordering so that funcs can be validated
+    // concurrently
+    std::atomic<ValidationToken> validation_token {0};
     Register arg_count = 0;
-    std::vector<RegisterType> registers;
+    RegisterList registers;
     RegisterType return_type = RegisterTypes::Void;
     Block block;
+    // Native code attached by the first Jit to compile the func, so
+    // that calls find it without a table lookup. See Jit::entry.
+    mutable std::atomic<const void*> native_code {nullptr};
+    // Call and back edge counters attached by the first Tiering to
+    // count the func. See Tiering::find_counters.
+    mutable std::atomic<void*> tiering_counters {nullptr};
 
     Func() {}
+
+    // The block uses `resource`, so that assigning a block allocated
+    // from the same resource takes its storage instead of copying it
+    explicit Func(std::pmr::memory_resource* resource) :
+      block {resource} {}
   };
 
   // TODO: Add a method for doing lookups. Eventually this should
@@ -214,6 +237,21 @@ namespace zvm {
     std::unordered_map<FuncName, Pointer<Func>> func_map;
   };
 
-  using InterfaceTypeTable = std::unordered_map<RegisterType, Pointer<Interface>>;
+  // The interface of each interface type. The generation identifies
+  // the table's contents to inline caches: every table starts with a
+  // generation of its own, and changed() must be called after the
+  // table or one of its interfaces is modified in place.
+  struct InterfaceTypeTable : public std::unordered_map<RegisterType, Pointer<Interface>> {
+    uint32_t generation = next_generation();
+
+    void changed() {
+      this->generation = next_generation();
+    }
+
+    static uint32_t next_generation() {
+      static std::atomic<uint32_t> counter {0};
+      return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+  };
 
 }
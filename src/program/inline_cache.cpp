@@ -0,0 +1,50 @@
+#include "inline_cache.h"
+#include "func.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    struct InlineCacheCollector {
+      uint32_t generation;
+      InlineCacheStats stats;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {}
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+
+      void enter_statement(const CallStatement& stmt) {
+        if (stmt.interface == void_register())
+          return;
+
+        this->stats.sites += 1;
+        if (!stmt.cache)
+          return;
+
+        auto& cache = *stmt.cache;
+        auto size = cache.size(this->generation);
+
+        if (cache.is_megamorphic(this->generation))
+          this->stats.megamorphic_sites += 1;
+        else if (size > 1)
+          this->stats.polymorphic_sites += 1;
+        else if (size == 1)
+          this->stats.monomorphic_sites += 1;
+
+        this->stats.hits += cache.hits.load(std::memory_order_relaxed);
+        this->stats.misses += cache.misses.load(std::memory_order_relaxed);
+      }
+    };
+
+  }
+
+  InlineCacheStats inline_cache_stats(const Func& func, uint32_t generation) {
+    InlineCacheCollector collector {generation};
+    traverse_block(func.block, collector);
+    return collector.stats;
+  }
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace zvm {
+
+  struct Func;
+
+  // Per-call-site cache mapping receiver interface types to call
+  // targets. The cache starts empty, becomes monomorphic after the
+  // first miss and polymorphic as more receiver types are seen. Once
+  // every entry is in use it is megamorphic, and further misses fall
+  // back to a full lookup without updating the cache.
+  //
+  // Entries are keyed by the generation of the InterfaceTypeTable the
+  // target was found in as well as by the receiver type, so an entry
+  // never answers for another table or for an edited one. Entries of
+  // other generations are free to be replaced.
+  //
+  // Readers on other threads check an entry's key before and after
+  // reading its target, so a concurrent replacement is seen as a miss.
+  struct InlineCache {
+    static constexpr int entry_count = 4;
+    static constexpr uint64_t empty_key = 0;
+    static constexpr uint64_t busy_key = ~uint64_t(0);
+
+    struct Entry {
+      std::atomic<uint64_t> key {empty_key};
+      std::atomic<const Func*> target {nullptr};
+    };
+
+    Entry entries[entry_count];
+    // The generation in which every entry was in use, if any
+    std::atomic<uint32_t> megamorphic_generation {0};
+
+    // Maintained only when the interpreter traits enable counting
+    std::atomic<uint64_t> hits {0};
+    std::atomic<uint64_t> misses {0};
+
+    InlineCache() {}
+
+    InlineCache(const InlineCache& other) = delete;
+    InlineCache& operator=(const InlineCache& other) = delete;
+
+    static uint64_t key(uint32_t generation, uint32_t type) {
+      return (static_cast<uint64_t>(generation) << 32) | type;
+    }
+
+    static uint32_t key_generation(uint64_t key) {
+      return static_cast<uint32_t>(key >> 32);
+    }
+
+    const Func* lookup(uint32_t generation, uint32_t type) const {
+      auto wanted = key(generation, type);
+      for (auto& entry : this->entries) {
+        if (entry.key.load(std::memory_order_acquire) != wanted)
+          continue;
+
+        auto* target = entry.target.load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (entry.key.load(std::memory_order_relaxed) != wanted)
+          return nullptr;
+        return target;
+      }
+      return nullptr;
+    }
+
+    void insert(uint32_t generation, uint32_t type, const Func* target) {
+      if (this->megamorphic_generation.load(std::memory_order_relaxed) == generation)
+        return;
+
+      auto wanted = key(generation, type);
+      for (auto& entry : this->entries) {
+        auto current = entry.key.load(std::memory_order_relaxed);
+        while (
+          current == empty_key ||
+          (current != busy_key && key_generation(current) != generation))
+        {
+          if (entry.key.compare_exchange_weak(
+            current,
+            busy_key,
+            std::memory_order_acquire))
+          {
+            std::atomic_thread_fence(std::memory_order_release);
+            entry.target.store(target, std::memory_order_relaxed);
+            entry.key.store(wanted, std::memory_order_release);
+            return;
+          }
+        }
+        if (current == wanted)
+          return;
+      }
+
+      this->megamorphic_generation.store(generation, std::memory_order_relaxed);
+    }
+
+    // Whether every entry was in use in `generation`. A cache which
+    // filled up in an earlier generation caches again.
+    bool is_megamorphic(uint32_t generation) const {
+      return this->megamorphic_generation.load(std::memory_order_relaxed) == generation;
+    }
+
+    // Number of entries cached in `generation`
+    int size(uint32_t generation) const {
+      int count = 0;
+      for (auto& entry : this->entries) {
+        auto entry_key = entry.key.load(std::memory_order_relaxed);
+        if (
+          entry_key != empty_key &&
+          entry_key != busy_key &&
+          key_generation(entry_key) == generation)
+        {
+          ++count;
+        }
+      }
+      return count;
+    }
+
+    void count_hit() {
+      this->hits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void count_miss() {
+      this->misses.fetch_add(1, std::memory_order_relaxed);
+    }
+  };
+
+  struct InlineCacheStats {
+    uint64_t sites = 0;
+    uint64_t monomorphic_sites = 0;
+    uint64_t polymorphic_sites = 0;
+    uint64_t megamorphic_sites = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  // Sums the inline caches of every interface call site in `func`.
+  // Sites are classified by the entries they hold for `generation`,
+  // the current generation of the InterfaceTypeTable they are used
+  // with.
+  InlineCacheStats inline_cache_stats(const Func& func, uint32_t generation);
+
+}
@@ -0,0 +1,202 @@
+#include <algorithm>
+#include <unordered_set>
+#include "linker.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    // Numbers the methods of `interface` and builds the vtable of
+    // every type which has all of them
+    Linkage::InterfaceDispatch build_dispatch(
+      RegisterType type,
+      const Interface& interface,
+      const InterfaceTypeTable& interface_types,
+      Linkage& linkage)
+    {
+      // Slots are assigned in name order so that linking is
+      // deterministic
+      std::vector<FuncName> names;
+      names.reserve(interface.func_map.size());
+      for (auto& method : interface.func_map) {
+        names.push_back(method.first);
+      }
+      std::sort(names.begin(), names.end());
+
+      Linkage::InterfaceDispatch dispatch;
+      dispatch.type = type;
+      for (uint32_t slot = 0; slot < names.size(); ++slot) {
+        dispatch.slots[names[slot]] = slot;
+      }
+
+      for (auto& pair : interface_types) {
+        if (pair.first < RegisterTypes::FirstInterfaceType)
+          continue;
+
+        auto& func_map = pair.second->func_map;
+        bool complete = std::all_of(names.begin(), names.end(), [&](FuncName name) {
+          return func_map.count(name) != 0;
+        });
+        if (!complete)
+          continue;
+
+        auto index = pair.first - RegisterTypes::FirstInterfaceType;
+        if (index >= dispatch.vtable_offsets.size())
+          dispatch.vtable_offsets.resize(index + 1, Linkage::no_vtable);
+
+        auto offset = static_cast<uint32_t>(linkage.vtables.size());
+        dispatch.vtable_offsets[index] = offset;
+        for (auto name : names) {
+          linkage.vtables.push_back(func_map.at(name));
+        }
+      }
+
+      return dispatch;
+    }
+
+    struct CallLinker {
+      const Interface& global;
+      const InterfaceTypeTable& interface_types;
+      Linkage& linkage;
+      const Func* func = nullptr;
+      bool is_linked = true;
+
+      CallLinker(
+        const Interface& global,
+        const InterfaceTypeTable& interface_types,
+        Linkage& linkage) :
+          global {global},
+          interface_types {interface_types},
+          linkage {linkage} {}
+
+      void link_func(Func& func) {
+        this->func = &func;
+        this->link_block(func.block);
+      }
+
+      void link_block(Block& block) {
+        for (auto& stmt : block) {
+          map_statement(*stmt, *this);
+        }
+      }
+
+      // Returns the position in linkage.interfaces of the dispatch for
+      // calls through `type`, building it on first use, or no_vtable
+      // if there is none
+      uint32_t dispatch(RegisterType type) {
+        auto known = this->linkage.interface_indices.find(type);
+        if (known != this->linkage.interface_indices.end())
+          return known->second;
+
+        auto iter = this->interface_types.find(type);
+        if (iter == this->interface_types.end())
+          return Linkage::no_vtable;
+
+        if (this->linkage.interfaces.size() >= Linkage::max_interfaces)
+          return Linkage::no_vtable;
+
+        auto index = static_cast<uint32_t>(this->linkage.interfaces.size());
+        this->linkage.interfaces.push_back(build_dispatch(
+          type,
+          *iter->second,
+          this->interface_types,
+          this->linkage));
+        this->linkage.interface_indices[type] = index;
+        return index;
+      }
+
+      template<typename S>
+      void operator()(S& stmt) {}
+
+      void operator()(CallStatement& stmt) {
+        if (stmt.interface == void_register()) {
+          auto iter = this->global.func_map.find(stmt.func_name);
+          if (iter == this->global.func_map.end()) {
+            this->is_linked = false;
+            return;
+          }
+
+          stmt.callee = iter->second;
+          return;
+        }
+
+        if (stmt.interface >= this->func->registers.size()) {
+          this->is_linked = false;
+          return;
+        }
+
+        auto index = this->dispatch(this->func->registers[stmt.interface]);
+        if (index == Linkage::no_vtable) {
+          this->is_linked = false;
+          return;
+        }
+
+        auto& slots = this->linkage.interfaces[index].slots;
+        auto iter = slots.find(stmt.func_name);
+        if (iter == slots.end()) {
+          this->is_linked = false;
+          return;
+        }
+
+        stmt.slot = make_method_slot(index, iter->second);
+      }
+
+      void operator()(IfStatement& stmt) {
+        this->link_block(stmt.true_block);
+        this->link_block(stmt.false_block);
+      }
+
+      void operator()(RepeatStatement& stmt) {
+        this->link_block(stmt.block);
+      }
+
+      void operator()(TryStatement& stmt) {
+        this->link_block(stmt.try_block);
+        this->link_block(stmt.catch_block);
+      }
+
+      void operator()(FinallyStatement& stmt) {
+        this->link_block(stmt.block);
+        this->link_block(stmt.finally_block);
+      }
+    };
+
+  }
+
+  bool link_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    Linkage& linkage)
+  {
+    linkage.interfaces.clear();
+    linkage.interface_indices.clear();
+    linkage.vtables.clear();
+
+    std::unordered_set<Func*> linked;
+    CallLinker linker {global, interface_types, linkage};
+
+    auto link_func = [&](Func* func) {
+      if (linked.insert(func).second)
+        linker.link_func(*func);
+    };
+
+    for (auto* func : funcs) {
+      link_func(func);
+    }
+
+    for (auto& pair : global.func_map) {
+      link_func(pair.second);
+    }
+
+    for (auto& pair : interface_types) {
+      for (auto& method : pair.second->func_map) {
+        link_func(method.second);
+      }
+    }
+
+    return linker.is_linked;
+  }
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "func.h"
+
+namespace zvm {
+
+  // Dispatch tables produced by link_module. Every interface type
+  // which interface calls are made through numbers its own methods
+  // from zero, in name order, and every type with all of those methods
+  // gets a vtable for it with one entry per method. Interface types
+  // are expected to be numbered densely from FirstInterfaceType.
+  struct Linkage {
+    static constexpr uint32_t no_vtable = ~0u;
+    // Method slots encode the interface in 16 bits
+    static constexpr uint32_t max_interfaces = 0xffff;
+
+    struct InterfaceDispatch {
+      RegisterType type;
+      std::unordered_map<FuncName, uint32_t> slots;
+      // Offset into vtables of each type's vtable for this interface,
+      // indexed by (type - FirstInterfaceType)
+      std::vector<uint32_t> vtable_offsets;
+    };
+
+    std::vector<InterfaceDispatch> interfaces;
+    // Position in `interfaces` of each interface type's dispatch
+    std::unordered_map<RegisterType, uint32_t> interface_indices;
+    std::vector<Pointer<const Func>> vtables;
+
+    // `slot` is a linked method slot of a call through an interface
+    // that `type` is received as
+    const Func* method(RegisterType type, MethodSlot slot) const {
+      auto& dispatch = this->interfaces[method_slot_interface(slot)];
+      auto index = type - RegisterTypes::FirstInterfaceType;
+      if (index >= dispatch.vtable_offsets.size())
+        return nullptr;
+
+      auto offset = dispatch.vtable_offsets[index];
+      if (offset == no_vtable)
+        return nullptr;
+
+      return this->vtables[offset + method_slot_index(slot)];
+    }
+  };
+
+  // Resolves the call statements of `funcs`, and of every func
+  // reachable through `global` and `interface_types`. Global calls get
+  // a direct callee and interface calls get a method slot. Returns
+  // false if a call cannot be resolved.
+  bool link_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    Linkage& linkage);
+
+}
@@ -0,0 +1,265 @@
+#include <unordered_map>
+#include "liveness.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    // Live registers at each way out of the statement being analyzed
+    struct ExitLiveness {
+      // On a break out of the innermost repeat
+      const RegisterSet* break_live;
+      // When a call or throw raises an exception
+      const RegisterSet* throw_live;
+      // On a return, in addition to the returned register
+      const RegisterSet* return_live;
+    };
+
+    struct ReturnSources {
+      RegisterSet& sources;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {}
+
+      void enter_statement(const ReturnStatement& stmt) {
+        this->sources.insert(stmt.source);
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    // Backward liveness over the block tree. Each transfer function
+    // maps the registers live after a statement to those live before
+    // it. When `record` is set, each definition adds interference
+    // edges to the registers live across it.
+    struct LivenessAnalysis {
+      std::size_t register_count;
+      Liveness& result;
+      bool build_interference;
+      // Last fixed point of each repeat, used as the starting point
+      // when the repeat is analyzed again in a larger context
+      std::unordered_map<const RepeatStatement*, RegisterSet> repeat_heads;
+
+      LivenessAnalysis(
+        std::size_t register_count,
+        Liveness& result,
+        bool build_interference) :
+          register_count {register_count},
+          result {result},
+          build_interference {build_interference}
+      {
+        if (build_interference)
+          this->result.interference.resize(register_count);
+      }
+
+      void interfere(Register reg, const RegisterSet& live) {
+        if (reg == void_register() || !this->build_interference)
+          return;
+
+        live.for_each([&](Register other) {
+          if (other == reg)
+            return;
+          this->result.interference[reg].push_back(other);
+          this->result.interference[other].push_back(reg);
+        });
+      }
+
+      RegisterSet block(
+        const Block& block,
+        RegisterSet live,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        for (auto iter = block.rbegin(); iter != block.rend(); ++iter) {
+          auto fn = [&](auto& stmt) {
+            live = this->transfer(stmt, live, exits, record);
+          };
+          map_statement(**iter, fn);
+        }
+        return live;
+      }
+
+      RegisterSet transfer(
+        const LoadStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        if (record) {
+          if (!out.contains(stmt.target))
+            this->result.dead_loads.push_back(&stmt);
+          this->interfere(stmt.target, out);
+        }
+
+        RegisterSet live = out;
+        live.erase(stmt.target);
+        return live;
+      }
+
+      RegisterSet transfer(
+        const CallStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        if (record)
+          this->interfere(stmt.target, out);
+
+        RegisterSet live = out;
+        live.erase(stmt.target);
+        live.insert(stmt.interface);
+        for (auto arg : stmt.args) {
+          live.insert(arg);
+        }
+
+        // The callee may throw
+        live.merge(*exits.throw_live);
+        return live;
+      }
+
+      RegisterSet transfer(
+        const IfStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        RegisterSet live = this->block(stmt.true_block, out, exits, record);
+        live.merge(this->block(stmt.false_block, out, exits, record));
+        live.insert(stmt.source);
+        return live;
+      }
+
+      RegisterSet transfer(
+        const RepeatStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        ExitLiveness body_exits = exits;
+        body_exits.break_live = &out;
+
+        auto iter = this->repeat_heads.find(&stmt);
+        RegisterSet head = iter == this->repeat_heads.end()
+          ? RegisterSet {this->register_count}
+          : iter->second;
+
+        // The end of the body flows back to its start
+        while (true) {
+          RegisterSet next = this->block(stmt.block, head, body_exits, false);
+          next.merge(head);
+          if (next == head)
+            break;
+          head = std::move(next);
+        }
+
+        if (record)
+          this->block(stmt.block, head, body_exits, true);
+
+        this->repeat_heads[&stmt] = head;
+        return head;
+      }
+
+      RegisterSet transfer(
+        const BreakStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        return *exits.break_live;
+      }
+
+      RegisterSet transfer(
+        const TryStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        RegisterSet catch_live = this->block(stmt.catch_block, out, exits, record);
+
+        // The target is written on entry to the catch block
+        if (record)
+          this->interfere(stmt.target, catch_live);
+        catch_live.erase(stmt.target);
+
+        ExitLiveness try_exits = exits;
+        try_exits.throw_live = &catch_live;
+        return this->block(stmt.try_block, out, try_exits, record);
+      }
+
+      RegisterSet transfer(
+        const FinallyStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        // Any exit from the protected block runs the finally block
+        // first, so everything needed after each of those exits,
+        // including returned registers, stays live through it
+        RegisterSet finally_out = out;
+        finally_out.merge(*exits.break_live);
+        finally_out.merge(*exits.throw_live);
+        finally_out.merge(*exits.return_live);
+
+        ReturnSources sources {finally_out};
+        traverse_block(stmt.block, sources);
+
+        RegisterSet finally_live = this->block(
+          stmt.finally_block,
+          finally_out,
+          exits,
+          record);
+
+        ExitLiveness block_exits {&finally_live, &finally_live, &finally_live};
+        return this->block(stmt.block, finally_live, block_exits, record);
+      }
+
+      RegisterSet transfer(
+        const ReturnStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        RegisterSet live = *exits.return_live;
+        live.insert(stmt.source);
+        return live;
+      }
+
+      RegisterSet transfer(
+        const YieldStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        RegisterSet live = out;
+        live.insert(stmt.source);
+        return live;
+      }
+
+      RegisterSet transfer(
+        const ThrowStatement& stmt,
+        const RegisterSet& out,
+        const ExitLiveness& exits,
+        bool record)
+      {
+        RegisterSet live = *exits.throw_live;
+        live.insert(stmt.source);
+        return live;
+      }
+    };
+
+  }
+
+  Liveness analyze_liveness(const Func& func, bool interference) {
+    auto register_count = func.registers.size();
+    Liveness result {RegisterSet {register_count}, {}, {}};
+    LivenessAnalysis analysis {register_count, result, interference};
+
+    RegisterSet none {register_count};
+    ExitLiveness exits {&none, &none, &none};
+    result.entry = analysis.block(func.block, none, exits, true);
+    return result;
+  }
+
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "func.h"
+
+namespace zvm {
+
+  // A set of registers of one func
+  struct RegisterSet {
+    std::vector<uint64_t> words;
+
+    explicit RegisterSet(std::size_t count = 0) : words((count + 63) / 64) {}
+
+    void insert(Register reg) {
+      if (reg != void_register())
+        this->words[reg / 64] |= uint64_t(1) << (reg % 64);
+    }
+
+    void erase(Register reg) {
+      if (reg != void_register())
+        this->words[reg / 64] &= ~(uint64_t(1) << (reg % 64));
+    }
+
+    bool contains(Register reg) const {
+      return reg != void_register() && (this->words[reg / 64] >> (reg % 64)) & 1;
+    }
+
+    void merge(const RegisterSet& other) {
+      for (std::size_t i = 0; i < this->words.size(); ++i) {
+        this->words[i] |= other.words[i];
+      }
+    }
+
+    bool operator==(const RegisterSet& other) const {
+      return this->words == other.words;
+    }
+
+    template<typename F>
+    void for_each(F fn) const {
+      for (std::size_t i = 0; i < this->words.size(); ++i) {
+        for (uint64_t word = this->words[i]; word; word &= word - 1) {
+          fn(static_cast<Register>(i * 64 + __builtin_ctzll(word)));
+        }
+      }
+    }
+  };
+
+  struct Liveness {
+    // Registers read before they are written, which see their initial
+    // zero value
+    RegisterSet entry;
+    // For each register, the registers live across any statement which
+    // writes it. Left empty unless requested.
+    std::vector<std::vector<Register>> interference;
+    // Loads whose value is never read
+    std::vector<const LoadStatement*> dead_loads;
+  };
+
+  // Backward liveness over the block tree of a valid func, including
+  // repeat back edges, the edges from calls and throws into catch
+  // blocks, and the exits which run finally blocks.
+  Liveness analyze_liveness(const Func& func, bool interference = false);
+
+}
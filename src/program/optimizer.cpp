@@ -0,0 +1,274 @@
+#include <unordered_set>
+#include <vector>
+#include "optimizer.h"
+#include "liveness.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    struct StatementCounter {
+      std::size_t count = 0;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {
+        ++this->count;
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    std::size_t count_statements(Block::const_iterator begin, Block::const_iterator end) {
+      StatementCounter counter;
+      traverse_statements(begin, end, counter);
+      return counter.count;
+    }
+
+    // Registers written anywhere in a block tree
+    struct WrittenRegisters {
+      std::vector<Register>& registers;
+
+      template<typename S>
+      void enter_statement(const S& stmt) {}
+
+      void enter_statement(const LoadStatement& stmt) {
+        this->registers.push_back(stmt.target);
+      }
+
+      void enter_statement(const CallStatement& stmt) {
+        this->registers.push_back(stmt.target);
+      }
+
+      void enter_statement(const TryStatement& stmt) {
+        this->registers.push_back(stmt.target);
+      }
+
+      template<typename S>
+      void leave_statement(const S& stmt) {}
+    };
+
+    // The registers known to hold a constant at a point in a func. A
+    // point which cannot be reached knows every register.
+    struct ConstantState {
+      std::vector<bool> known;
+      std::vector<RegisterValue> values;
+      bool reachable = true;
+
+      explicit ConstantState(std::size_t register_count) :
+        known(register_count, false),
+        values(register_count, 0) {}
+
+      void set(Register reg, RegisterValue value) {
+        this->known[reg] = true;
+        this->values[reg] = value;
+      }
+
+      void kill(Register reg) {
+        if (reg != void_register())
+          this->known[reg] = false;
+      }
+
+      void kill_written(const Block& block) {
+        std::vector<Register> registers;
+        WrittenRegisters written {registers};
+        traverse_block(block, written);
+        for (auto reg : registers) {
+          this->kill(reg);
+        }
+      }
+
+      // Keeps only the constants which hold on both paths
+      void meet(const ConstantState& other) {
+        if (!other.reachable)
+          return;
+
+        if (!this->reachable) {
+          *this = other;
+          return;
+        }
+
+        for (std::size_t reg = 0; reg < this->known.size(); ++reg) {
+          if (this->known[reg] && (!other.known[reg] || this->values[reg] != other.values[reg]))
+            this->known[reg] = false;
+        }
+      }
+    };
+
+    // Forward constant propagation. Ifs with a known condition are
+    // replaced in place by the statements of the branch they take, which
+    // are then folded in turn, and statements which cannot be reached
+    // after a return, throw or break are dropped. Joins are handled
+    // conservatively: registers written in a repeat body are unknown on
+    // entry to it, and registers written in a try or protected block
+    // are unknown on entry to its catch or finally block.
+    struct ConstantFolder {
+      const Func& func;
+      std::size_t removed = 0;
+
+      explicit ConstantFolder(const Func& func) : func {func} {}
+
+      RegisterValue truncate(Register reg, RegisterValue value) const {
+        auto width = register_width(this->func.registers[reg]);
+        return width >= sizeof(RegisterValue)
+          ? value
+          : value & ((RegisterValue(1) << (width * 8)) - 1);
+      }
+
+      void fold_block(Block& block, ConstantState& state) {
+        std::size_t i = 0;
+        while (i < block.size()) {
+          if (!state.reachable) {
+            this->removed += count_statements(block.begin() + i, block.end());
+            block.erase(block.begin() + i, block.end());
+            return;
+          }
+
+          auto* if_stmt = as_statement_type<IfStatement>(*block[i]);
+          if (if_stmt && state.known[if_stmt->source]) {
+            bool condition = state.values[if_stmt->source] != 0;
+            auto& taken = condition ? if_stmt->true_block : if_stmt->false_block;
+            auto& dropped = condition ? if_stmt->false_block : if_stmt->true_block;
+            this->removed += 1 + count_statements(dropped.begin(), dropped.end());
+
+            block.erase(block.begin() + i);
+            block.insert(block.begin() + i, taken.begin(), taken.end());
+            continue;
+          }
+
+          auto fn = [&](auto& stmt) {
+            this->fold(stmt, state);
+          };
+          map_statement(*block[i], fn);
+          ++i;
+        }
+      }
+
+      void fold(LoadStatement& stmt, ConstantState& state) {
+        state.set(stmt.target, this->truncate(stmt.target, stmt.value));
+      }
+
+      void fold(CallStatement& stmt, ConstantState& state) {
+        state.kill(stmt.target);
+      }
+
+      void fold(IfStatement& stmt, ConstantState& state) {
+        ConstantState false_state = state;
+        this->fold_block(stmt.true_block, state);
+        this->fold_block(stmt.false_block, false_state);
+        state.meet(false_state);
+      }
+
+      void fold(RepeatStatement& stmt, ConstantState& state) {
+        state.kill_written(stmt.block);
+        ConstantState body_state = state;
+        this->fold_block(stmt.block, body_state);
+      }
+
+      void fold(BreakStatement& stmt, ConstantState& state) {
+        state.reachable = false;
+      }
+
+      void fold(TryStatement& stmt, ConstantState& state) {
+        ConstantState catch_state = state;
+        catch_state.kill_written(stmt.try_block);
+        catch_state.kill(stmt.target);
+
+        this->fold_block(stmt.try_block, state);
+        this->fold_block(stmt.catch_block, catch_state);
+        state.meet(catch_state);
+      }
+
+      void fold(FinallyStatement& stmt, ConstantState& state) {
+        ConstantState finally_state = state;
+        finally_state.kill_written(stmt.block);
+
+        this->fold_block(stmt.block, state);
+        this->fold_block(stmt.finally_block, finally_state);
+
+        // The finally block runs on every exit, but execution only
+        // continues past it when the protected block completed
+        bool reachable = state.reachable && finally_state.reachable;
+        state = std::move(finally_state);
+        state.reachable = reachable;
+      }
+
+      void fold(ReturnStatement& stmt, ConstantState& state) {
+        state.reachable = false;
+      }
+
+      void fold(YieldStatement& stmt, ConstantState& state) {}
+
+      void fold(ThrowStatement& stmt, ConstantState& state) {
+        state.reachable = false;
+      }
+    };
+
+    struct DeadLoadRemover {
+      const std::unordered_set<const Statement*>& dead;
+      std::size_t removed = 0;
+
+      void remove_from(Block& block) {
+        auto end = block.begin();
+        for (auto stmt : block) {
+          if (this->dead.count(stmt)) {
+            ++this->removed;
+            continue;
+          }
+
+          map_statement(*stmt, *this);
+          *end++ = stmt;
+        }
+        block.erase(end, block.end());
+      }
+
+      template<typename S>
+      void operator()(S& stmt) {}
+
+      void operator()(IfStatement& stmt) {
+        this->remove_from(stmt.true_block);
+        this->remove_from(stmt.false_block);
+      }
+
+      void operator()(RepeatStatement& stmt) {
+        this->remove_from(stmt.block);
+      }
+
+      void operator()(TryStatement& stmt) {
+        this->remove_from(stmt.try_block);
+        this->remove_from(stmt.catch_block);
+      }
+
+      void operator()(FinallyStatement& stmt) {
+        this->remove_from(stmt.block);
+        this->remove_from(stmt.finally_block);
+      }
+    };
+
+  }
+
+  std::size_t optimize_func(Func& func) {
+    if (contains_fused_statements(func.block))
+      return 0;
+
+    ConstantFolder folder {func};
+    ConstantState state {func.registers.size()};
+    folder.fold_block(func.block, state);
+
+    // Folding leaves the loads which fed known conditions unread, so
+    // liveness is computed on the folded tree
+    auto liveness = analyze_liveness(func);
+    std::unordered_set<const Statement*> dead {
+      liveness.dead_loads.begin(),
+      liveness.dead_loads.end()
+    };
+
+    DeadLoadRemover remover {dead};
+    if (!dead.empty())
+      remover.remove_from(func.block);
+
+    return folder.removed + remover.removed;
+  }
+
+}
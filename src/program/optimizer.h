@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include "func.h"
+
+namespace zvm {
+
+  // Simplifies a valid func in place:
+  // - constants loaded into registers are propagated into if
+  //   conditions, and an if whose condition is known is replaced by
+  //   the branch it takes;
+  // - statements after a return, throw or break are removed;
+  // - loads whose value is overwritten or otherwise never read are
+  //   removed.
+  // The func stays valid. Removed statements are not freed; they stay
+  // in their arena until it is released. A fused func is left as it
+  // is.
+  //
+  // Returns the number of statements removed, including those nested
+  // in removed statements.
+  std::size_t optimize_func(Func& func);
+
+}
@@ -0,0 +1,662 @@
+#include <cstring>
+#include "parser.h"
+#include "printer.h"
+
+namespace zvm {
+
+  namespace {
+
+    // Funcs and interfaces are created on first reference, so indices
+    // are capped to keep a typo from allocating without bound
+    constexpr uint64_t max_index = 1 << 24;
+
+    struct Token {
+      const char* begin = nullptr;
+      std::size_t size = 0;
+
+      bool is(const char* word, std::size_t length) const {
+        return this->size == length && std::memcmp(this->begin, word, length) == 0;
+      }
+
+      template<std::size_t N>
+      bool is(const char (&word)[N]) const {
+        return this->is(word, N - 1);
+      }
+    };
+
+    // Splits a line into whitespace-separated tokens. Everything after
+    // a `#` is a comment.
+    struct Tokens {
+      const char* pos;
+      const char* end;
+
+      static bool is_space(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+      }
+
+      bool next(Token& token) {
+        while (this->pos < this->end && is_space(*this->pos)) {
+          ++this->pos;
+        }
+
+        if (this->pos == this->end || *this->pos == '#')
+          return false;
+
+        token.begin = this->pos;
+        while (this->pos < this->end && !is_space(*this->pos) && *this->pos != '#') {
+          ++this->pos;
+        }
+        token.size = static_cast<std::size_t>(this->pos - token.begin);
+        return true;
+      }
+    };
+
+    // Yields the input one line at a time. Stream input is read into a
+    // fixed buffer in chunks; the unread tail of a chunk is moved to
+    // the front before the next read, so a line may not be longer than
+    // the buffer. Memory input is read in place.
+    struct LineReader {
+      std::istream* in = nullptr;
+      std::vector<char> buffer;
+      const char* pos = nullptr;
+      const char* end = nullptr;
+      bool at_eof = true;
+      bool is_too_long = false;
+      std::size_t line = 0;
+
+      explicit LineReader(std::istream& in) :
+        in {&in},
+        buffer(parser_chunk_size),
+        pos {buffer.data()},
+        end {buffer.data()},
+        at_eof {false} {}
+
+      LineReader(const char* data, std::size_t size) :
+        pos {data},
+        end {data + size} {}
+
+      bool refill() {
+        auto rest = static_cast<std::size_t>(this->end - this->pos);
+        if (rest == this->buffer.size()) {
+          this->is_too_long = true;
+          return false;
+        }
+
+        std::memmove(this->buffer.data(), this->pos, rest);
+        this->in->read(this->buffer.data() + rest, this->buffer.size() - rest);
+        auto count = static_cast<std::size_t>(this->in->gcount());
+
+        this->pos = this->buffer.data();
+        this->end = this->pos + rest + count;
+        if (!*this->in)
+          this->at_eof = true;
+        return true;
+      }
+
+      bool next(Tokens& tokens) {
+        while (true) {
+          auto size = static_cast<std::size_t>(this->end - this->pos);
+          auto* newline = size
+            ? static_cast<const char*>(std::memchr(this->pos, '\n', size))
+            : nullptr;
+
+          if (newline) {
+            tokens = {this->pos, newline};
+            this->pos = newline + 1;
+            ++this->line;
+            return true;
+          }
+
+          if (this->at_eof) {
+            if (!size)
+              return false;
+
+            tokens = {this->pos, this->end};
+            this->pos = this->end;
+            ++this->line;
+            return true;
+          }
+
+          if (!this->refill())
+            return false;
+        }
+      }
+    };
+
+    bool parse_number(const Token& token, uint64_t max, uint64_t& value) {
+      if (!token.size)
+        return false;
+
+      value = 0;
+      for (std::size_t i = 0; i < token.size; ++i) {
+        auto digit = static_cast<unsigned>(token.begin[i] - '0');
+        if (digit > 9 || value > (max - digit) / 10)
+          return false;
+        value = value * 10 + digit;
+      }
+      return true;
+    }
+
+    struct Parser {
+      // A statement whose blocks are still being read. The statement
+      // itself is created when its `end` is reached, once both blocks
+      // are complete, so that the blocks can be moved into it.
+      struct OpenStatement {
+        StatementKind kind;
+        Register reg;
+        // Position of the statement in the enclosing block
+        std::size_t slot;
+        // Start of each block in `pending`
+        std::size_t first_begin;
+        std::size_t second_begin;
+      };
+
+      static constexpr std::size_t no_second_block = ~std::size_t(0);
+
+      ParsedModule& module;
+      ParseError error;
+
+      // Statements of every open block in the current func, innermost
+      // block last
+      std::vector<Pointer<Statement>> pending;
+      std::vector<OpenStatement> open;
+      std::vector<Register> args;
+      // Register types are collected so that the layout is computed
+      // once per func
+      std::vector<RegisterType> register_types;
+      std::vector<bool> defined_funcs;
+      std::vector<bool> defined_interfaces;
+      bool has_global = false;
+
+      Func* func = nullptr;
+      Interface* interface = nullptr;
+
+      explicit Parser(ParsedModule& module) : module {module} {}
+
+      bool fail(const char* message) {
+        if (!this->error.message)
+          this->error.message = message;
+        return false;
+      }
+
+      Func& func_at(uint32_t index) {
+        while (this->module.funcs.size() <= index) {
+          this->module.funcs.emplace_back(this->module.arena.resource());
+          this->defined_funcs.push_back(false);
+        }
+        return this->module.funcs[index];
+      }
+
+      Interface& interface_at(uint32_t index) {
+        while (this->module.interfaces.size() <= index) {
+          this->module.interfaces.emplace_back();
+          this->defined_interfaces.push_back(false);
+        }
+        return this->module.interfaces[index];
+      }
+
+      bool read_index(Tokens& tokens, uint32_t& index) {
+        Token token;
+        uint64_t value;
+        if (!tokens.next(token) || !parse_number(token, max_index, value))
+          return this->fail("expected an index");
+
+        index = static_cast<uint32_t>(value);
+        return true;
+      }
+
+      bool read_number(Tokens& tokens, uint64_t max, uint64_t& value) {
+        Token token;
+        if (!tokens.next(token) || !parse_number(token, max, value))
+          return this->fail("expected a number");
+        return true;
+      }
+
+      bool parse_register(const Token& token, Register& reg) {
+        if (token.is("_")) {
+          reg = void_register();
+          return true;
+        }
+
+        uint64_t value;
+        if (token.size < 2 || token.begin[0] != 'r')
+          return this->fail("expected a register");
+
+        Token number {token.begin + 1, token.size - 1};
+        if (!parse_number(number, max_register(), value))
+          return this->fail("register out of range");
+
+        reg = static_cast<Register>(value);
+        return true;
+      }
+
+      bool read_register(Tokens& tokens, Register& reg) {
+        Token token;
+        if (!tokens.next(token))
+          return this->fail("expected a register");
+        return this->parse_register(token, reg);
+      }
+
+      bool parse_type(const Token& token, RegisterType& type) {
+        for (RegisterType t = 0; t <= RegisterTypes::LastFundamentalType; ++t) {
+          auto* name = register_type_name(t);
+          if (token.is(name, std::strlen(name))) {
+            type = t;
+            return true;
+          }
+        }
+
+        uint64_t value;
+        if (!parse_number(token, ~RegisterType(0), value))
+          return this->fail("expected a type");
+
+        type = static_cast<RegisterType>(value);
+        return true;
+      }
+
+      bool finish_line(Tokens& tokens) {
+        Token token;
+        if (tokens.next(token))
+          return this->fail("unexpected token");
+        return true;
+      }
+
+      Block make_block(std::size_t begin, std::size_t end) {
+        Block block = this->module.arena.block(end - begin);
+        block.assign(this->pending.begin() + begin, this->pending.begin() + end);
+        return block;
+      }
+
+      void add(Pointer<Statement> stmt) {
+        this->pending.push_back(stmt);
+      }
+
+      bool open_statement(StatementKind kind, Register reg = 0) {
+        auto slot = this->pending.size();
+        this->pending.push_back(nullptr);
+        this->open.push_back({kind, reg, slot, slot + 1, no_second_block});
+        return true;
+      }
+
+      bool open_second(StatementKind kind) {
+        if (this->open.empty())
+          return this->fail("no open statement");
+
+        auto& stmt = this->open.back();
+        if (stmt.kind != kind || stmt.second_begin != no_second_block)
+          return this->fail("mismatched block keyword");
+
+        stmt.second_begin = this->pending.size();
+        return true;
+      }
+
+      void close_statement() {
+        auto stmt = this->open.back();
+        this->open.pop_back();
+
+        auto end = this->pending.size();
+        auto first_end = stmt.second_begin == no_second_block
+          ? end
+          : stmt.second_begin;
+        auto second_begin = stmt.second_begin == no_second_block
+          ? end
+          : stmt.second_begin;
+
+        Block first = this->make_block(stmt.first_begin, first_end);
+        Block second = this->make_block(second_begin, end);
+        this->pending.resize(stmt.first_begin);
+
+        auto& arena = this->module.arena;
+        Pointer<Statement> result = nullptr;
+        using Kind = StatementKind;
+        switch (stmt.kind) {
+          case Kind::If:
+            result = arena.create<IfStatement>(
+              stmt.reg,
+              std::move(first),
+              std::move(second));
+            break;
+          case Kind::Repeat:
+            result = arena.create<RepeatStatement>(std::move(first));
+            break;
+          case Kind::Try:
+            result = arena.create<TryStatement>(
+              stmt.reg,
+              std::move(first),
+              std::move(second));
+            break;
+          case Kind::Finally:
+            result = arena.create<FinallyStatement>(
+              std::move(first),
+              std::move(second));
+            break;
+          default:
+            break;
+        }
+
+        this->pending[stmt.slot] = result;
+      }
+
+      bool parse_call(Tokens& tokens) {
+        Register target;
+        Register interface;
+        uint64_t name;
+        if (
+          !this->read_register(tokens, target) ||
+          !this->read_register(tokens, interface) ||
+          !this->read_number(tokens, static_cast<FuncName>(~0), name))
+        {
+          return false;
+        }
+
+        this->args.clear();
+        Token token;
+        while (tokens.next(token)) {
+          Register arg;
+          if (!this->parse_register(token, arg))
+            return false;
+          this->args.push_back(arg);
+        }
+
+        auto& arena = this->module.arena;
+        ArgList args = arena.args(this->args.size());
+        args.assign(this->args.begin(), this->args.end());
+
+        this->add(arena.create<CallStatement>(
+          target,
+          interface,
+          static_cast<FuncName>(name),
+          std::move(args)));
+        return true;
+      }
+
+      template<typename S>
+      bool parse_register_statement(Tokens& tokens) {
+        Register reg;
+        if (!this->read_register(tokens, reg))
+          return false;
+        this->add(this->module.arena.create<S>(reg));
+        return this->finish_line(tokens);
+      }
+
+      bool parse_statement(const Token& keyword, Tokens& tokens) {
+        auto& arena = this->module.arena;
+        Register reg;
+
+        if (keyword.is("load")) {
+          uint64_t value;
+          if (
+            !this->read_register(tokens, reg) ||
+            !this->read_number(tokens, ~RegisterValue(0), value))
+          {
+            return false;
+          }
+          this->add(arena.create<LoadStatement>(reg, value));
+          return this->finish_line(tokens);
+        }
+
+        if (keyword.is("call"))
+          return this->parse_call(tokens);
+
+        if (keyword.is("if")) {
+          if (!this->read_register(tokens, reg))
+            return false;
+          return this->open_statement(StatementKind::If, reg) && this->finish_line(tokens);
+        }
+
+        if (keyword.is("else"))
+          return this->open_second(StatementKind::If) && this->finish_line(tokens);
+
+        if (keyword.is("repeat"))
+          return this->open_statement(StatementKind::Repeat) && this->finish_line(tokens);
+
+        if (keyword.is("break")) {
+          this->add(arena.create<BreakStatement>());
+          return this->finish_line(tokens);
+        }
+
+        if (keyword.is("try")) {
+          if (!this->read_register(tokens, reg))
+            return false;
+          return this->open_statement(StatementKind::Try, reg) && this->finish_line(tokens);
+        }
+
+        if (keyword.is("catch"))
+          return this->open_second(StatementKind::Try) && this->finish_line(tokens);
+
+        if (keyword.is("finally"))
+          return this->open_statement(StatementKind::Finally) && this->finish_line(tokens);
+
+        if (keyword.is("always"))
+          return this->open_second(StatementKind::Finally) && this->finish_line(tokens);
+
+        if (keyword.is("return"))
+          return this->parse_register_statement<ReturnStatement>(tokens);
+
+        if (keyword.is("yield"))
+          return this->parse_register_statement<YieldStatement>(tokens);
+
+        if (keyword.is("throw"))
+          return this->parse_register_statement<ThrowStatement>(tokens);
+
+        return this->fail("unknown statement");
+      }
+
+      bool parse_func_line(const Token& keyword, Tokens& tokens) {
+        if (keyword.is("end")) {
+          if (!this->open.empty()) {
+            this->close_statement();
+            return this->finish_line(tokens);
+          }
+
+          this->func->block.assign(this->pending.begin(), this->pending.end());
+          this->pending.clear();
+          this->func->registers.assign(
+            this->register_types.begin(),
+            this->register_types.end());
+          this->register_types.clear();
+          this->func = nullptr;
+          return this->finish_line(tokens);
+        }
+
+        if (keyword.is("registers")) {
+          Token token;
+          while (tokens.next(token)) {
+            RegisterType type;
+            if (!this->parse_type(token, type))
+              return false;
+            this->register_types.push_back(type);
+          }
+          return true;
+        }
+
+        return this->parse_statement(keyword, tokens);
+      }
+
+      bool parse_func_header(Tokens& tokens) {
+        uint32_t index;
+        if (!this->read_index(tokens, index))
+          return false;
+
+        this->func = &this->func_at(index);
+        if (this->defined_funcs[index])
+          return this->fail("func defined twice");
+        this->defined_funcs[index] = true;
+
+        Token token;
+        while (tokens.next(token)) {
+          if (token.is("args")) {
+            uint64_t count;
+            if (!this->read_number(tokens, max_register(), count))
+              return false;
+            this->func->arg_count = static_cast<Register>(count);
+          } else if (token.is("returns")) {
+            if (!tokens.next(token))
+              return this->fail("expected a type");
+            if (!this->parse_type(token, this->func->return_type))
+              return false;
+          } else {
+            return this->fail("unexpected token");
+          }
+        }
+
+        return true;
+      }
+
+      bool parse_interface_header(Tokens& tokens) {
+        uint32_t index;
+        if (!this->read_index(tokens, index))
+          return false;
+
+        this->interface = &this->interface_at(index);
+        if (this->defined_interfaces[index])
+          return this->fail("interface defined twice");
+        this->defined_interfaces[index] = true;
+
+        Token token;
+        if (tokens.next(token)) {
+          if (!token.is("global"))
+            return this->fail("unexpected token");
+          if (this->has_global)
+            return this->fail("global interface defined twice");
+
+          this->has_global = true;
+          this->module.global_interface = index;
+        }
+
+        return this->finish_line(tokens);
+      }
+
+      bool parse_interface_line(const Token& keyword, Tokens& tokens) {
+        if (keyword.is("end")) {
+          this->interface = nullptr;
+          return this->finish_line(tokens);
+        }
+
+        if (!keyword.is("method"))
+          return this->fail("expected a method");
+
+        uint64_t name;
+        uint32_t index;
+        if (
+          !this->read_number(tokens, static_cast<FuncName>(~0), name) ||
+          !this->read_index(tokens, index))
+        {
+          return false;
+        }
+
+        this->interface->func_map[static_cast<FuncName>(name)] = &this->func_at(index);
+        return this->finish_line(tokens);
+      }
+
+      bool parse_type_line(Tokens& tokens) {
+        Token token;
+        RegisterType type;
+        uint32_t index;
+        if (
+          !tokens.next(token) ||
+          !this->parse_type(token, type) ||
+          !this->read_index(tokens, index))
+        {
+          return this->fail("expected a type and an interface");
+        }
+
+        this->module.interface_types[type] = &this->interface_at(index);
+        return this->finish_line(tokens);
+      }
+
+      bool parse_line(Tokens& tokens) {
+        Token keyword;
+        if (!tokens.next(keyword))
+          return true;
+
+        if (this->func)
+          return this->parse_func_line(keyword, tokens);
+
+        if (this->interface)
+          return this->parse_interface_line(keyword, tokens);
+
+        if (keyword.is("func"))
+          return this->parse_func_header(tokens);
+
+        if (keyword.is("interface"))
+          return this->parse_interface_header(tokens);
+
+        if (keyword.is("type"))
+          return this->parse_type_line(tokens);
+
+        return this->fail("expected func, interface or type");
+      }
+
+      bool finish() {
+        if (this->func || this->interface)
+          return this->fail("unexpected end of input");
+
+        for (bool defined : this->defined_funcs) {
+          if (!defined)
+            return this->fail("undefined func");
+        }
+
+        for (bool defined : this->defined_interfaces) {
+          if (!defined)
+            return this->fail("undefined interface");
+        }
+
+        if (!this->has_global) {
+          this->module.global_interface = static_cast<uint32_t>(
+            this->module.interfaces.size());
+          this->module.interfaces.emplace_back();
+        }
+
+        return true;
+      }
+
+      bool parse(LineReader& reader) {
+        Tokens tokens;
+        while (reader.next(tokens)) {
+          if (!this->parse_line(tokens)) {
+            this->error.line = reader.line;
+            return false;
+          }
+        }
+
+        if (reader.is_too_long) {
+          this->error.line = reader.line + 1;
+          return this->fail("line too long");
+        }
+
+        if (!this->finish()) {
+          this->error.line = reader.line;
+          return false;
+        }
+
+        return true;
+      }
+    };
+
+    bool parse_with(LineReader& reader, ParsedModule& module, ParseError* error) {
+      Parser parser {module};
+      bool is_parsed = parser.parse(reader);
+      if (!is_parsed && error)
+        *error = parser.error;
+      return is_parsed;
+    }
+
+  }
+
+  bool parse_module(std::istream& in, ParsedModule& module, ParseError* error) {
+    LineReader reader {in};
+    return parse_with(reader, module, error);
+  }
+
+  bool parse_module(
+    const char* data,
+    std::size_t size,
+    ParsedModule& module,
+    ParseError* error)
+  {
+    LineReader reader {data, size};
+    return parse_with(reader, module, error);
+  }
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <istream>
+#include <vector>
+#include "arena.h"
+#include "func.h"
+
+namespace zvm {
+
+  // A module read from text. See printer.h for the syntax. Funcs and
+  // interfaces are numbered by their index in the text, and the deques
+  // keep their addresses stable while the module is parsed.
+  struct ParsedModule {
+    // Statements are small and numerous, so they are bump-allocated in
+    // large chunks
+    static constexpr std::size_t chunk_size = 1024 * 1024;
+
+    ProgramArena arena {chunk_size};
+    std::deque<Func> funcs;
+    std::deque<Interface> interfaces;
+    InterfaceTypeTable interface_types;
+    uint32_t global_interface = 0;
+
+    Interface& global() {
+      return this->interfaces[this->global_interface];
+    }
+
+    std::vector<Pointer<Func>> func_list() {
+      std::vector<Pointer<Func>> list;
+      list.reserve(this->funcs.size());
+      for (auto& func : this->funcs) {
+        list.push_back(&func);
+      }
+      return list;
+    }
+  };
+
+  struct ParseError {
+    std::size_t line = 0;
+    const char* message = nullptr;
+  };
+
+  // The parser reads its input in chunks of this size, and a single
+  // line may not be longer. Apart from the module itself, memory use
+  // is bounded by the chunk and by the nesting of the current func.
+  constexpr std::size_t parser_chunk_size = 64 * 1024;
+
+  // Parses a whole module in a single pass. On failure, returns false
+  // and describes the first error; `module` is then left partially
+  // filled.
+  bool parse_module(
+    std::istream& in,
+    ParsedModule& module,
+    ParseError* error = nullptr);
+
+  bool parse_module(
+    const char* data,
+    std::size_t size,
+    ParsedModule& module,
+    ParseError* error = nullptr);
+
+}
@@ -0,0 +1,271 @@
+#include <algorithm>
+#include <unordered_map>
+#include "printer.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    struct StatementPrinter {
+      std::ostream& out;
+      unsigned depth;
+      StatementAnnotator* annotator = nullptr;
+
+      void indent(const Statement* stmt = nullptr) {
+        if (this->annotator)
+          this->annotator->annotate(this->out, stmt);
+        for (unsigned i = 0; i < this->depth; ++i) {
+          this->out << "  ";
+        }
+      }
+
+      void reg(Register reg) {
+        if (reg == void_register())
+          this->out << '_';
+        else
+          this->out << 'r' << reg;
+      }
+
+      void line(const char* name, const Statement* stmt = nullptr) {
+        this->indent(stmt);
+        this->out << name << '\n';
+      }
+
+      void line(const char* name, Register reg, const Statement* stmt) {
+        this->indent(stmt);
+        this->out << name << ' ';
+        this->reg(reg);
+        this->out << '\n';
+      }
+
+      void block(const Block& block) {
+        ++this->depth;
+        for (auto& stmt : block) {
+          map_statement(*stmt, *this);
+        }
+        --this->depth;
+      }
+
+      void operator()(const LoadStatement& stmt) {
+        this->indent(&stmt);
+        this->out << "load ";
+        this->reg(stmt.target);
+        this->out << ' ' << stmt.value << '\n';
+      }
+
+      void operator()(const CallStatement& stmt) {
+        this->indent(&stmt);
+        this->out << "call ";
+        this->reg(stmt.target);
+        this->out << ' ';
+        this->reg(stmt.interface);
+        this->out << ' ' << stmt.func_name;
+        for (auto arg : stmt.args) {
+          this->out << ' ';
+          this->reg(arg);
+        }
+        this->out << '\n';
+      }
+
+      void operator()(const IfStatement& stmt) {
+        this->line("if", stmt.source, &stmt);
+        this->block(stmt.true_block);
+        if (!stmt.false_block.empty()) {
+          this->line("else");
+          this->block(stmt.false_block);
+        }
+        this->line("end");
+      }
+
+      void operator()(const RepeatStatement& stmt) {
+        this->line("repeat", &stmt);
+        this->block(stmt.block);
+        this->line("end");
+      }
+
+      void operator()(const BreakStatement& stmt) {
+        this->line("break", &stmt);
+      }
+
+      void operator()(const TryStatement& stmt) {
+        this->line("try", stmt.target, &stmt);
+        this->block(stmt.try_block);
+        this->line("catch");
+        this->block(stmt.catch_block);
+        this->line("end");
+      }
+
+      void operator()(const FinallyStatement& stmt) {
+        this->line("finally", &stmt);
+        this->block(stmt.block);
+        this->line("always");
+        this->block(stmt.finally_block);
+        this->line("end");
+      }
+
+      void operator()(const ReturnStatement& stmt) {
+        this->line("return", stmt.source, &stmt);
+      }
+
+      void operator()(const YieldStatement& stmt) {
+        this->line("yield", stmt.source, &stmt);
+      }
+
+      void operator()(const ThrowStatement& stmt) {
+        this->line("throw", stmt.source, &stmt);
+      }
+    };
+
+    void print_type(std::ostream& out, RegisterType type) {
+      if (auto* name = register_type_name(type))
+        out << name;
+      else
+        out << type;
+    }
+
+    struct ModulePrinter {
+      std::vector<const Func*> funcs;
+      std::unordered_map<const Func*, uint32_t> func_indices;
+
+      void add_func(const Func* func) {
+        if (this->func_indices.count(func))
+          return;
+
+        this->func_indices[func] = static_cast<uint32_t>(this->funcs.size());
+        this->funcs.push_back(func);
+      }
+
+      static std::vector<std::pair<FuncName, const Func*>> sorted_methods(
+        const Interface& interface)
+      {
+        std::vector<std::pair<FuncName, const Func*>> methods {
+          interface.func_map.begin(),
+          interface.func_map.end(),
+        };
+        std::sort(methods.begin(), methods.end());
+        return methods;
+      }
+
+      void print_interface(
+        std::ostream& out,
+        const Interface& interface,
+        uint32_t index,
+        bool is_global)
+      {
+        out << "interface " << index;
+        if (is_global)
+          out << " global";
+        out << '\n';
+
+        for (auto& method : sorted_methods(interface)) {
+          out << "  method " << method.first
+            << ' ' << this->func_indices.at(method.second) << '\n';
+        }
+
+        out << "end\n";
+      }
+    };
+
+  }
+
+  const char* register_type_name(RegisterType type) {
+    switch (type) {
+      case RegisterTypes::Void: return "void";
+      case RegisterTypes::Bool: return "bool";
+      case RegisterTypes::Int8: return "i8";
+      case RegisterTypes::Int16: return "i16";
+      case RegisterTypes::Int32: return "i32";
+      case RegisterTypes::Int64: return "i64";
+      case RegisterTypes::UInt8: return "u8";
+      case RegisterTypes::UInt16: return "u16";
+      case RegisterTypes::UInt32: return "u32";
+      case RegisterTypes::UInt64: return "u64";
+      case RegisterTypes::Float32: return "f32";
+      case RegisterTypes::Float64: return "f64";
+    }
+    return nullptr;
+  }
+
+  void print_func(
+    std::ostream& out,
+    const Func& func,
+    uint32_t index,
+    StatementAnnotator* annotator)
+  {
+    if (annotator)
+      annotator->annotate(out, nullptr);
+    out << "func " << index;
+    if (func.arg_count)
+      out << " args " << func.arg_count;
+    if (func.return_type != RegisterTypes::Void) {
+      out << " returns ";
+      print_type(out, func.return_type);
+    }
+    out << '\n';
+
+    if (!func.registers.empty()) {
+      if (annotator)
+        annotator->annotate(out, nullptr);
+      out << "  registers";
+      for (auto type : func.registers) {
+        out << ' ';
+        print_type(out, type);
+      }
+      out << '\n';
+    }
+
+    StatementPrinter printer {out, 0, annotator};
+    printer.block(func.block);
+
+    if (annotator)
+      annotator->annotate(out, nullptr);
+    out << "end\n";
+  }
+
+  void print_module(
+    std::ostream& out,
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types)
+  {
+    ModulePrinter printer;
+
+    for (auto* func : funcs) {
+      printer.add_func(func);
+    }
+
+    std::vector<std::pair<RegisterType, const Interface*>> types {
+      interface_types.begin(),
+      interface_types.end(),
+    };
+    std::sort(types.begin(), types.end());
+
+    std::vector<const Interface*> interfaces {&global};
+    std::unordered_map<const Interface*, uint32_t> interface_indices {{&global, 0}};
+    for (auto& pair : types) {
+      if (interface_indices.emplace(pair.second, interfaces.size()).second)
+        interfaces.push_back(pair.second);
+    }
+
+    for (auto* interface : interfaces) {
+      for (auto& method : ModulePrinter::sorted_methods(*interface)) {
+        printer.add_func(method.second);
+      }
+    }
+
+    for (uint32_t i = 0; i < printer.funcs.size(); ++i) {
+      print_func(out, *printer.funcs[i], i);
+    }
+
+    for (uint32_t i = 0; i < interfaces.size(); ++i) {
+      printer.print_interface(out, *interfaces[i], i, i == 0);
+    }
+
+    for (auto& pair : types) {
+      out << "type " << pair.first
+        << ' ' << interface_indices.at(pair.second) << '\n';
+    }
+  }
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <ostream>
+#include <vector>
+#include "func.h"
+
+namespace zvm {
+
+  // Text form of a module, as read by parse_module:
+  //
+  //   func 0 args 1 returns i32
+  //     registers bool i32 i32
+  //     load r1 7
+  //     call r2 _ 3 r0 r1
+  //     if r0
+  //       return r1
+  //     else
+  //       return r2
+  //     end
+  //   end
+  //   interface 0 global
+  //     method 3 0
+  //   end
+  //   type 257 0
+  //
+  // Statements are one per line. Blocks are closed by `end`; the
+  // second block of If, Try and Finally is opened by `else`, `catch`
+  // and `always` respectively. Registers are written `r<n>`, and the
+  // void register `_`. Call operands are target, interface, func name
+  // and then the arguments. Method lines give the func name and func
+  // index. Comments start with `#`.
+
+  const char* register_type_name(RegisterType type);
+
+  // Writes a prefix before each line of print_func, such as profile
+  // counts. Lines which are not a statement pass nullptr.
+  struct StatementAnnotator {
+    virtual void annotate(std::ostream& out, const Statement* stmt) = 0;
+
+  protected:
+    ~StatementAnnotator() {}
+  };
+
+  void print_func(
+    std::ostream& out,
+    const Func& func,
+    uint32_t index,
+    StatementAnnotator* annotator = nullptr);
+
+  // Funcs are numbered in order: `funcs` first, then the methods of
+  // the global interface and of each interface type, in name order
+  void print_module(
+    std::ostream& out,
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types);
+
+}
@@ -0,0 +1,153 @@
+#include "register_allocator.h"
+#include "liveness.h"
+#include "traverse.h"
+
+namespace zvm {
+
+  namespace {
+
+    // Applies `fn` to every register operand in a block tree
+    template<typename F>
+    struct RegisterRewriter {
+      F& fn;
+
+      void rewrite_block(Block& block) {
+        for (auto& stmt : block) {
+          map_statement(*stmt, *this);
+        }
+      }
+
+      void operator()(LoadStatement& stmt) {
+        this->fn(stmt.target);
+      }
+
+      void operator()(CallStatement& stmt) {
+        this->fn(stmt.target);
+        this->fn(stmt.interface);
+        for (auto& arg : stmt.args) {
+          this->fn(arg);
+        }
+      }
+
+      void operator()(IfStatement& stmt) {
+        this->fn(stmt.source);
+        this->rewrite_block(stmt.true_block);
+        this->rewrite_block(stmt.false_block);
+      }
+
+      void operator()(RepeatStatement& stmt) {
+        this->rewrite_block(stmt.block);
+      }
+
+      void operator()(BreakStatement& stmt) {}
+
+      void operator()(TryStatement& stmt) {
+        this->fn(stmt.target);
+        this->rewrite_block(stmt.try_block);
+        this->rewrite_block(stmt.catch_block);
+      }
+
+      void operator()(FinallyStatement& stmt) {
+        this->rewrite_block(stmt.block);
+        this->rewrite_block(stmt.finally_block);
+      }
+
+      void operator()(ReturnStatement& stmt) {
+        this->fn(stmt.source);
+      }
+
+      void operator()(YieldStatement& stmt) {
+        this->fn(stmt.source);
+      }
+
+      void operator()(ThrowStatement& stmt) {
+        this->fn(stmt.source);
+      }
+    };
+
+    template<typename F>
+    void rewrite_registers(Block& block, F fn) {
+      RegisterRewriter<F> rewriter {fn};
+      rewriter.rewrite_block(block);
+    }
+
+  }
+
+  Register compact_registers(Func& func) {
+    auto register_count = func.registers.size();
+    if (register_count == 0 || contains_fused_statements(func.block))
+      return 0;
+
+    std::vector<bool> referenced(register_count, false);
+    for (Register reg = 0; reg < func.arg_count; ++reg) {
+      referenced[reg] = true;
+    }
+
+    rewrite_registers(func.block, [&](Register& reg) {
+      if (reg != void_register())
+        referenced[reg] = true;
+    });
+
+    auto liveness = analyze_liveness(func, true);
+    auto& interference = liveness.interference;
+    auto& entry_live = liveness.entry;
+
+    // Arguments, and registers read before they are written, are all
+    // defined on entry
+    for (Register reg = 0; reg < func.arg_count; ++reg) {
+      entry_live.insert(reg);
+    }
+    entry_live.for_each([&](Register reg) {
+      entry_live.for_each([&](Register other) {
+        if (other != reg)
+          interference[reg].push_back(other);
+      });
+    });
+
+    // Greedy coloring in register order. Arguments keep their numbers.
+    std::vector<Register> mapping(register_count, void_register());
+    std::vector<RegisterType> types;
+    std::vector<std::size_t> used_by;
+
+    for (Register reg = 0; reg < func.arg_count; ++reg) {
+      mapping[reg] = reg;
+      types.push_back(func.registers[reg]);
+      used_by.push_back(0);
+    }
+
+    for (std::size_t reg = func.arg_count; reg < register_count; ++reg) {
+      if (!referenced[reg])
+        continue;
+
+      // Colors taken by neighbors are stamped with this register
+      auto stamp = reg + 1;
+      for (auto other : interference[reg]) {
+        if (mapping[other] != void_register())
+          used_by[mapping[other]] = stamp;
+      }
+
+      auto type = func.registers[reg];
+      Register color = 0;
+      while (color < types.size() && (types[color] != type || used_by[color] == stamp)) {
+        ++color;
+      }
+
+      if (color == types.size()) {
+        types.push_back(type);
+        used_by.push_back(0);
+      }
+
+      mapping[reg] = color;
+    }
+
+    rewrite_registers(func.block, [&](Register& reg) {
+      if (reg != void_register())
+        reg = mapping[reg];
+    });
+
+    auto removed = static_cast<Register>(register_count - types.size());
+    func.registers = std::move(types);
+    return removed;
+  }
+
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "func.h"
+
+namespace zvm {
+
+  // Renumbers the registers of a valid func so that registers of the
+  // same type whose lifetimes never overlap share one register.
+  // Argument registers keep their numbers, and registers which are
+  // never referenced are dropped. Liveness is computed over the block
+  // tree, including repeat back edges, the edges from calls and throws
+  // into catch blocks, and the exits which run finally blocks. A fused
+  // func is left as it is.
+  //
+  // Returns the number of registers removed.
+  Register compact_registers(Func& func);
+
+}
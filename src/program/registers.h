@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <numeric>
+#include <vector>
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define ZVM_BIG_ENDIAN 1
+#else
+#define ZVM_BIG_ENDIAN 0
+#endif
+
+namespace zvm {
+
+  using Register = uint16_t;
+  using RegisterType = uint32_t;
+  using RegisterValue = uint64_t;
+
+  constexpr Register void_register() { return ~0; }
+  constexpr Register max_register() { return ~0 - 1; }
+
+  namespace RegisterTypes {
+    enum FundamentalTypes : RegisterType {
+      Void = 0,
+      Bool,
+      Int8,
+      Int16,
+      Int32,
+      Int64,
+      UInt8,
+      UInt16,
+      UInt32,
+      UInt64,
+      Float32,
+      Float64,
+
+      LastFundamentalType = Float64,
+      FirstInterfaceType = 0x100,
+    };
+  }
+
+  // Storage size of a register in bytes. Interface values and unknown
+  // types take a full RegisterValue.
+  constexpr uint8_t register_width(RegisterType type) {
+    switch (type) {
+      case RegisterTypes::Void:
+        return 0;
+      case RegisterTypes::Bool:
+      case RegisterTypes::Int8:
+      case RegisterTypes::UInt8:
+        return 1;
+      case RegisterTypes::Int16:
+      case RegisterTypes::UInt16:
+        return 2;
+      case RegisterTypes::Int32:
+      case RegisterTypes::UInt32:
+      case RegisterTypes::Float32:
+        return 4;
+      default:
+        return 8;
+    }
+  }
+
+  // Signed integers are sign-extended when read as a RegisterValue
+  constexpr bool is_signed_register(RegisterType type) {
+    return
+      type == RegisterTypes::Int8 ||
+      type == RegisterTypes::Int16 ||
+      type == RegisterTypes::Int32;
+  }
+
+  struct RegisterSlot {
+    uint32_t offset;
+    uint8_t width;
+    bool is_signed;
+    // Bit position of the register within the aligned 8 byte word
+    // which holds it
+    uint8_t shift;
+  };
+
+  // The declared register types of a func, and the frame layout
+  // derived from them. Registers are packed by natural width, widest
+  // first, so every register is naturally aligned and the frame has
+  // no padding. The layout is recomputed whenever the list is
+  // assigned, so it costs nothing when a frame is entered.
+  struct RegisterList {
+    // Frames are aligned to, and sized in multiples of, this many bytes
+    static constexpr uint32_t frame_alignment = 8;
+
+    std::vector<RegisterType> types;
+    std::vector<RegisterSlot> slots;
+    uint32_t frame_size = 0;
+
+    RegisterList() {}
+
+    RegisterList(std::initializer_list<RegisterType> init) :
+      types {init}
+    {
+      this->layout();
+    }
+
+    RegisterList& operator=(std::initializer_list<RegisterType> init) {
+      this->types = init;
+      this->layout();
+      return *this;
+    }
+
+    RegisterList& operator=(std::vector<RegisterType>&& types) {
+      this->types = std::move(types);
+      this->layout();
+      return *this;
+    }
+
+    template<typename I>
+    void assign(I begin, I end) {
+      this->types.assign(begin, end);
+      this->layout();
+    }
+
+    std::size_t size() const {
+      return this->types.size();
+    }
+
+    bool empty() const {
+      return this->types.empty();
+    }
+
+    RegisterType operator[](std::size_t index) const {
+      return this->types[index];
+    }
+
+    std::vector<RegisterType>::const_iterator begin() const {
+      return this->types.begin();
+    }
+
+    std::vector<RegisterType>::const_iterator end() const {
+      return this->types.end();
+    }
+
+    void layout() {
+      std::vector<Register> order(this->types.size());
+      std::iota(order.begin(), order.end(), Register(0));
+      std::stable_sort(order.begin(), order.end(), [&](Register a, Register b) {
+        return register_width(this->types[a]) > register_width(this->types[b]);
+      });
+
+      this->slots.resize(this->types.size());
+      uint32_t offset = 0;
+      for (auto reg : order) {
+        auto type = this->types[reg];
+        auto width = register_width(type);
+        // Void registers take no space, and are placed at the start
+        // of the frame so that their word is in bounds of the window
+        uint32_t slot_offset = width ? offset : 0;
+        uint32_t byte = ZVM_BIG_ENDIAN ? 8 - slot_offset % 8 - width : slot_offset % 8;
+        this->slots[reg] = {
+          slot_offset,
+          width,
+          is_signed_register(type),
+          static_cast<uint8_t>(width ? byte * 8 : 0),
+        };
+        offset += width;
+      }
+
+      // A frame with only void registers still has a word for them
+      if (offset == 0 && !this->types.empty())
+        offset = 1;
+      this->frame_size = (offset + frame_alignment - 1) & ~(frame_alignment - 1);
+    }
+  };
+
+}
@@ -0,0 +1,175 @@
+#include <algorithm>
+#include "revalidation.h"
+
+namespace zvm {
+
+  void IncrementalValidator::add(Func& func) {
+    if (this->funcs.emplace(&func, Entry {}).second)
+      this->dirty.push_back(&func);
+  }
+
+  void IncrementalValidator::remove(Func& func) {
+    auto iter = this->funcs.find(&func);
+    if (iter == this->funcs.end())
+      return;
+
+    auto& entry = iter->second;
+    this->forget_dependencies(&func, entry.dependencies);
+    if (entry.dirty) {
+      this->dirty.erase(std::remove(this->dirty.begin(), this->dirty.end(), &func), this->dirty.end());
+    } else if (!entry.valid) {
+      --this->invalid_count;
+    }
+    this->funcs.erase(iter);
+  }
+
+  void IncrementalValidator::global_changed(FuncName name) {
+    auto iter = this->global_dependents.find(name);
+    if (iter == this->global_dependents.end())
+      return;
+
+    for (auto* func : iter->second) {
+      this->mark_dirty(func);
+    }
+  }
+
+  void IncrementalValidator::interface_changed(RegisterType type) {
+    this->changed_types.push_back(type);
+  }
+
+  void IncrementalValidator::func_changed(Func& func, bool signature_changed) {
+    if (this->funcs.count(&func))
+      this->mark_dirty(&func);
+
+    if (!signature_changed)
+      return;
+
+    for (auto& pair : this->global.func_map) {
+      if (pair.second == &func)
+        this->global_changed(pair.first);
+    }
+
+    for (auto& pair : this->interface_types) {
+      for (auto& method : pair.second->func_map) {
+        if (method.second == &func) {
+          this->interface_changed(pair.first);
+          break;
+        }
+      }
+    }
+  }
+
+  std::size_t IncrementalValidator::revalidate() {
+    this->mark_type_dependents();
+
+    std::vector<Func*> funcs;
+    std::swap(funcs, this->dirty);
+
+    for (auto* func : funcs) {
+      auto& entry = this->funcs.at(func);
+      this->forget_dependencies(func, entry.dependencies);
+
+      entry.valid = validate_func(
+        *func,
+        this->global,
+        this->interface_types,
+        entry.dependencies,
+        this->validation_token,
+        &this->subtype_cache);
+      entry.dirty = false;
+      if (!entry.valid)
+        ++this->invalid_count;
+
+      for (auto name : entry.dependencies.global_funcs) {
+        this->global_dependents[name].insert(func);
+      }
+      for (auto type : entry.dependencies.interface_types) {
+        this->type_dependents[type].insert(func);
+      }
+    }
+
+    return funcs.size();
+  }
+
+  void IncrementalValidator::mark_dirty(Func* func) {
+    auto& entry = this->funcs.at(func);
+    if (entry.dirty)
+      return;
+
+    if (!entry.valid)
+      --this->invalid_count;
+    entry.dirty = true;
+    this->dirty.push_back(func);
+    func->validation_token.store(0, std::memory_order_release);
+  }
+
+  void IncrementalValidator::mark_type_dependents() {
+    if (this->changed_types.empty())
+      return;
+
+    // Subtype results involving the changed types are stale, and the
+    // cache cannot drop them selectively
+    this->subtype_cache.invalidate();
+
+    // A subtype check between two types walks the method signatures
+    // reachable from them, so every type which reaches a changed type
+    // is affected
+    std::unordered_map<RegisterType, std::vector<RegisterType>> referenced_by;
+    auto reference = [&](RegisterType from, RegisterType to) {
+      if (to > RegisterTypes::FirstInterfaceType && to != from)
+        referenced_by[to].push_back(from);
+    };
+
+    for (auto& pair : this->interface_types) {
+      for (auto& method : pair.second->func_map) {
+        const Func& signature = *method.second;
+        reference(pair.first, signature.return_type);
+        for (Register reg = 0; reg < signature.arg_count && reg < signature.registers.size(); ++reg) {
+          reference(pair.first, signature.registers[reg]);
+        }
+      }
+    }
+
+    std::unordered_set<RegisterType> affected;
+    std::vector<RegisterType> work;
+    std::swap(work, this->changed_types);
+    while (!work.empty()) {
+      auto type = work.back();
+      work.pop_back();
+      if (!affected.insert(type).second)
+        continue;
+
+      auto iter = referenced_by.find(type);
+      if (iter != referenced_by.end())
+        work.insert(work.end(), iter->second.begin(), iter->second.end());
+    }
+
+    for (auto type : affected) {
+      auto iter = this->type_dependents.find(type);
+      if (iter == this->type_dependents.end())
+        continue;
+
+      for (auto* func : iter->second) {
+        this->mark_dirty(func);
+      }
+    }
+  }
+
+  void IncrementalValidator::forget_dependencies(
+    Func* func,
+    const ValidationDependencies& dependencies)
+  {
+    for (auto name : dependencies.global_funcs) {
+      auto iter = this->global_dependents.find(name);
+      if (iter != this->global_dependents.end() && iter->second.erase(func) && iter->second.empty())
+        this->global_dependents.erase(iter);
+    }
+
+    for (auto type : dependencies.interface_types) {
+      auto iter = this->type_dependents.find(type);
+      if (iter != this->type_dependents.end() && iter->second.erase(func) && iter->second.empty())
+        this->type_dependents.erase(iter);
+    }
+  }
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "func.h"
+#include "validator.h"
+
+namespace zvm {
+
+  // Keeps a module validated across edits. Each func's validation
+  // records which global funcs and interface types it looked up, so
+  // an edit only revalidates the funcs which depended on what changed.
+  //
+  // Report each edit, then call revalidate:
+  // - global_changed after adding, removing or replacing a global func
+  // - interface_changed after adding, removing or replacing an
+  //   interface type, or editing the methods of its interface
+  // - func_changed after editing a func in place
+  //
+  // A changed interface type also affects the types whose method
+  // signatures reach it, since subtype checks walk those signatures.
+  // Funcs are revalidated as a whole: results are not kept per
+  // statement.
+  struct IncrementalValidator {
+    struct Entry {
+      ValidationDependencies dependencies;
+      bool valid = false;
+      bool dirty = true;
+    };
+
+    const Interface& global;
+    const InterfaceTypeTable& interface_types;
+    // Published to each func which is valid, and cleared from funcs
+    // which become dirty
+    ValidationToken validation_token;
+    SubtypeCache subtype_cache;
+
+    std::unordered_map<Func*, Entry> funcs;
+    std::unordered_map<FuncName, std::unordered_set<Func*>> global_dependents;
+    std::unordered_map<RegisterType, std::unordered_set<Func*>> type_dependents;
+    std::vector<Func*> dirty;
+    // Interface types changed since the last revalidate
+    std::vector<RegisterType> changed_types;
+    std::size_t invalid_count = 0;
+
+    IncrementalValidator(
+      const Interface& global,
+      const InterfaceTypeTable& interface_types,
+      ValidationToken validation_token) :
+        global {global},
+        interface_types {interface_types},
+        validation_token {validation_token} {}
+
+    IncrementalValidator(const IncrementalValidator& other) = delete;
+    IncrementalValidator& operator=(const IncrementalValidator& other) = delete;
+
+    // Tracks a func, which is validated by the next revalidate
+    void add(Func& func);
+    void remove(Func& func);
+
+    void global_changed(FuncName name);
+    void interface_changed(RegisterType type);
+    // Also reports the global names and interface types which refer to
+    // `func` if its signature changed
+    void func_changed(Func& func, bool signature_changed = true);
+
+    // Validates every dirty func. Returns the number validated.
+    std::size_t revalidate();
+
+    bool is_valid(const Func& func) const {
+      auto iter = this->funcs.find(const_cast<Func*>(&func));
+      return iter != this->funcs.end() && !iter->second.dirty && iter->second.valid;
+    }
+
+    bool is_valid() const {
+      return this->dirty.empty() && this->changed_types.empty() && this->invalid_count == 0;
+    }
+
+    void mark_dirty(Func* func);
+    void mark_type_dependents();
+    void forget_dependencies(Func* func, const ValidationDependencies& dependencies);
+  };
+
+}
@@ -1,66 +1,19 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdlib>
+#include <type_traits>
+#include <vector>
 #include "func.h"
 
 namespace zvm {
 
-  namespace {
-
-    template<typename T>
-    struct TraversalMapper {
-      T& visitor;
-
-      explicit TraversalMapper(T& visitor) : visitor {visitor} {}
-
-      template<typename S, typename F>
-      void visit(S& stmt, F fn) {
-        this->visitor.enter_statement(stmt);
-        fn();
-        this->visitor.leave_statement(stmt);
-      }
-
-      void visit_block(const Block& block) {
-        traverse_block(block, this->visitor);
-      }
-
-      template<typename S>
-      void operator()(const S& stmt) {
-        this->visit(stmt, []() {});
-      }
-
-      template<>
-      void operator()(const IfStatement& stmt) {
-        this->visit(stmt, [&]() {
-          this->visit_block(stmt.true_block);
-          this->visit_block(stmt.false_block);
-        });
-      }
-
-      template<>
-      void operator()(const RepeatStatement& stmt) {
-        this->visit(stmt, [&]() {
-          this->visit_block(stmt.block);
-        });
-      }
-
-      template<>
-      void operator()(const TryStatement& stmt) {
-        this->visit(stmt, [&]() {
-          this->visit_block(stmt.try_block);
-          this->visit_block(stmt.catch_block);
-        });
-      }
-
-      template<>
-      void operator()(const FinallyStatement& stmt) {
-        this->visit(stmt, [&]() {
-          this->visit_block(stmt.block);
-          this->visit_block(stmt.finally_block);
-        });
-      }
-
-    };
-
+  // Statement kinds past Throw are the interpreter's superinstructions,
+  // formed by fuse_statements. map_statement does not know them, so
+  // passes over the tree check contains_fused_statements first and
+  // decline fused funcs.
+  inline bool is_fused_statement(const Statement& stmt) {
+    return stmt.kind > StatementKind::Throw;
   }
 
   template<typename S, typename F>
@@ -87,15 +40,274 @@ namespace zvm {
         return fn(cast_statement<YieldStatement>(stmt));
       case Kind::Throw:
         return fn(cast_statement<ThrowStatement>(stmt));
+      default:
+        // Fused statements, which callers must not pass
+        std::abort();
+    }
+  }
+
+  // What a traversal does after a visitor's enter_statement. Visitors
+  // whose enter_statement returns void always continue.
+  enum class TraversalAction {
+    // Walk the statement's nested blocks, then leave it
+    Continue,
+    // Leave the statement without walking its nested blocks
+    Skip,
+    // End the traversal. No further statements are entered or left.
+    Stop,
+  };
+
+  // A statement whose nested blocks are being walked, or the
+  // statements a traversal started from if `owner` is null
+  struct TraversalFrame {
+    Pointer<Statement> const* next;
+    Pointer<Statement> const* end;
+    Pointer<Statement> owner;
+    uint8_t child;
+  };
+
+  // The explicit stack of a traversal, so that the depth of a program
+  // is bounded by memory rather than by the native stack. A stack can
+  // be shared by nested traversals, which only use the frames above
+  // those they find, and keeps its capacity between traversals.
+  struct TraversalStack {
+    std::vector<TraversalFrame> frames;
+  };
+
+  // The stack used by traversals on this thread when none is given
+  inline TraversalStack& traversal_stack() {
+    static thread_local TraversalStack stack;
+    return stack;
+  }
+
+  // Returns the nested block of `stmt` at `index`, in the order they
+  // are walked, or nullptr past the last one
+  inline Block* nested_block(Statement& stmt, uint8_t index) {
+    using Kind = StatementKind;
+    switch (stmt.kind) {
+      case Kind::If: {
+        auto& typed = cast_statement<IfStatement>(stmt);
+        return index == 0 ? &typed.true_block : index == 1 ? &typed.false_block : nullptr;
+      }
+      case Kind::Repeat: {
+        auto& typed = cast_statement<RepeatStatement>(stmt);
+        return index == 0 ? &typed.block : nullptr;
+      }
+      case Kind::Try: {
+        auto& typed = cast_statement<TryStatement>(stmt);
+        return index == 0 ? &typed.try_block : index == 1 ? &typed.catch_block : nullptr;
+      }
+      case Kind::Finally: {
+        auto& typed = cast_statement<FinallyStatement>(stmt);
+        return index == 0 ? &typed.block : index == 1 ? &typed.finally_block : nullptr;
+      }
+      default:
+        return nullptr;
     }
   }
 
+  // Advances `index` to the next nested block of `stmt` which is not
+  // empty and returns it, or nullptr if there is none
+  inline Block* next_nested_block(Statement& stmt, uint8_t& index) {
+    Block* block;
+    while ((block = nested_block(stmt, index)) && block->empty()) {
+      ++index;
+    }
+    return block;
+  }
+
+  // Returns true if `block`, or a block nested in it, holds a fused
+  // statement. Nested blocks of fused statements are not searched.
+  inline bool contains_fused_statements(
+    const Block& block,
+    TraversalStack& stack = traversal_stack())
+  {
+    auto& frames = stack.frames;
+    const std::size_t base = frames.size();
+    frames.push_back({block.data(), block.data() + block.size(), nullptr, 0});
+
+    while (frames.size() > base) {
+      auto& frame = frames.back();
+
+      if (frame.next != frame.end) {
+        Statement& stmt = **frame.next++;
+        if (is_fused_statement(stmt)) {
+          frames.resize(base);
+          return true;
+        }
+
+        uint8_t child = 0;
+        if (Block* nested = next_nested_block(stmt, child))
+          frames.push_back({nested->data(), nested->data() + nested->size(), &stmt, child});
+        continue;
+      }
+
+      if (Statement* owner = frame.owner) {
+        ++frame.child;
+        if (Block* nested = next_nested_block(*owner, frame.child)) {
+          frame.next = nested->data();
+          frame.end = nested->data() + nested->size();
+          continue;
+        }
+      }
+
+      frames.pop_back();
+    }
+
+    return false;
+  }
+
+  template<typename V, typename S>
+  TraversalAction enter_statement(V& visitor, S& stmt) {
+    if constexpr (std::is_void_v<decltype(visitor.enter_statement(stmt))>) {
+      visitor.enter_statement(stmt);
+      return TraversalAction::Continue;
+    } else {
+      return visitor.enter_statement(stmt);
+    }
+  }
+
+  // Walks the statements in [begin, end) and everything nested in
+  // them, calling the visitor's enter_statement before a statement's
+  // nested blocks and leave_statement after them. Returns false if the
+  // visitor stopped the traversal.
+  //
+  // A mutable traversal passes non-const statements. In
+  // enter_statement, a visitor may rewrite the statement's nested
+  // blocks, which are then walked as rewritten, or replace statements
+  // in blocks that are not being walked.
+  template<bool is_mutable, typename V>
+  bool traverse_range(
+    Pointer<Statement> const* begin,
+    Pointer<Statement> const* end,
+    V& visitor,
+    TraversalStack& stack)
+  {
+    using Visited = std::conditional_t<is_mutable, Statement, const Statement>;
+    auto& frames = stack.frames;
+    const std::size_t base = frames.size();
+    frames.push_back({begin, end, nullptr, 0});
+
+    auto enter = [&](auto& typed) {
+      return enter_statement(visitor, typed);
+    };
+    auto leave = [&](auto& typed) {
+      visitor.leave_statement(typed);
+    };
+
+    while (frames.size() > base) {
+      auto& frame = frames.back();
+
+      if (frame.next != frame.end) {
+        Statement& stmt = **frame.next++;
+        auto action = map_statement(static_cast<Visited&>(stmt), enter);
+        if (action == TraversalAction::Stop) {
+          frames.resize(base);
+          return false;
+        }
+
+        uint8_t child = 0;
+        Block* block = action == TraversalAction::Continue
+          ? next_nested_block(stmt, child)
+          : nullptr;
+        if (block)
+          frames.push_back({block->data(), block->data() + block->size(), &stmt, child});
+        else
+          map_statement(static_cast<Visited&>(stmt), leave);
+        continue;
+      }
+
+      Statement* owner = frame.owner;
+      if (owner) {
+        ++frame.child;
+        if (Block* block = next_nested_block(*owner, frame.child)) {
+          frame.next = block->data();
+          frame.end = block->data() + block->size();
+          continue;
+        }
+      }
+
+      frames.pop_back();
+      if (owner)
+        map_statement(static_cast<Visited&>(*owner), leave);
+    }
+
+    return true;
+  }
+
+  template<typename V>
+  bool traverse_block(
+    const Block& block,
+    V& visitor,
+    TraversalStack& stack = traversal_stack())
+  {
+    return traverse_range<false>(block.data(), block.data() + block.size(), visitor, stack);
+  }
+
+  // Walks a run of statements within a block
+  template<typename V>
+  bool traverse_statements(
+    Block::const_iterator begin,
+    Block::const_iterator end,
+    V& visitor,
+    TraversalStack& stack = traversal_stack())
+  {
+    auto* first = begin == end ? nullptr : &*begin;
+    return traverse_range<false>(first, first + (end - begin), visitor, stack);
+  }
+
+  template<typename V>
+  bool traverse_mutable_block(
+    Block& block,
+    V& visitor,
+    TraversalStack& stack = traversal_stack())
+  {
+    return traverse_range<true>(block.data(), block.data() + block.size(), visitor, stack);
+  }
+
+  // Type-erased enter/leave events, for statements which do not live
+  // in a Block tree (for example, records in a mapped module image).
+  // A source calls enter for each statement, then walks its nested
+  // blocks unless enter returned Skip, then calls leave. If enter
+  // returns Stop, the walk ends without further events.
+  struct StatementEvents {
+    virtual TraversalAction enter(const Statement& stmt) = 0;
+    virtual void leave(const Statement& stmt) = 0;
+
+  protected:
+    ~StatementEvents() {}
+  };
+
+  struct StatementSource {
+    // Returns false if the events stopped the walk
+    virtual bool walk(StatementEvents& events) const = 0;
+
+  protected:
+    ~StatementSource() {}
+  };
+
+  // Forwards statement events to a traversal visitor
   template<typename V>
-  void traverse_block(const Block& block, V& visitor) {
-    TraversalMapper<V> mapper {visitor};
-    for (auto& stmt : block) {
-      map_statement(*stmt, mapper);
+  struct VisitorEvents : public StatementEvents {
+    V& visitor;
+
+    explicit VisitorEvents(V& visitor) : visitor {visitor} {}
+
+    TraversalAction enter(const Statement& stmt) override {
+      auto fn = [&](auto& typed) { return enter_statement(this->visitor, typed); };
+      return map_statement(stmt, fn);
+    }
+
+    void leave(const Statement& stmt) override {
+      auto fn = [&](auto& typed) { this->visitor.leave_statement(typed); };
+      map_statement(stmt, fn);
     }
+  };
+
+  template<typename V>
+  bool traverse_source(const StatementSource& source, V& visitor) {
+    VisitorEvents<V> events {visitor};
+    return source.walk(events);
   }
 
 }
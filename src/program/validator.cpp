@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 #include "validator.h"
 #include "traverse.h"
 
@@ -5,15 +9,33 @@ namespace zvm {
 
   namespace {
 
+    // Interface types may be recursive, so subtyping is checked
+    // coinductively: a pair that is already being checked is assumed
+    // to hold. Negative results never depend on such assumptions and
+    // are cached immediately. Positive results are held until the
+    // outermost check succeeds, since every check is a conjunction and
+    // any failure fails the outermost check.
     struct TypeChecker {
       const InterfaceTypeTable& interface_types;
-
-      explicit TypeChecker(const InterfaceTypeTable& interface_types) :
-        interface_types {interface_types} {}
+      SubtypeCache& cache;
+      std::unordered_set<uint64_t> assumed;
+      std::vector<uint64_t> pending;
+      // Interface types compared, if recording
+      ValidationDependencies* dependencies = nullptr;
+
+      TypeChecker(
+        const InterfaceTypeTable& interface_types,
+        SubtypeCache& cache) :
+          interface_types {interface_types},
+          cache {cache}
+      {
+        this->cache.bind(interface_types);
+      }
 
       bool can_assign_to(RegisterType source, RegisterType target);
       bool can_assign_to(const Interface& source, const Interface& target);
       bool can_assign_to(const Func& source, const Func& target);
+      bool check_interfaces(RegisterType source, RegisterType target);
     };
 
     bool TypeChecker::can_assign_to(
@@ -29,6 +51,45 @@ namespace zvm {
       if (target <= RegisterTypes::FirstInterfaceType)
         return false;
 
+      if (this->dependencies) {
+        this->dependencies->interface_types.push_back(source);
+        this->dependencies->interface_types.push_back(target);
+      }
+
+      auto key = SubtypeCache::key(source, target);
+
+      auto cached = this->cache.results.find(key);
+      if (cached != this->cache.results.end())
+        return cached->second;
+
+      if (!this->assumed.insert(key).second)
+        return true;
+
+      bool outermost = this->assumed.size() == 1;
+      bool result = this->check_interfaces(source, target);
+      this->assumed.erase(key);
+
+      if (!result) {
+        this->cache.results[key] = false;
+        this->pending.clear();
+        return false;
+      }
+
+      this->pending.push_back(key);
+      if (outermost) {
+        for (auto pending_key : this->pending) {
+          this->cache.results[pending_key] = true;
+        }
+        this->pending.clear();
+      }
+
+      return true;
+    }
+
+    bool TypeChecker::check_interfaces(
+      RegisterType source,
+      RegisterType target)
+    {
       auto iter_source = this->interface_types.find(source);
       if (iter_source == this->interface_types.end()) {
         // TODO: assert
@@ -99,6 +160,7 @@ namespace zvm {
       const char InterfaceFuncNotFound[] = "interface func not found";
       const char WrongArgumentCount[] = "wrong number of arguments";
       const char NonMatchingCall[] = "call does not match target";
+      const char FusedStatement[] = "fused statements are not validated";
     }
 
     struct Validator {
@@ -112,11 +174,12 @@ namespace zvm {
       Validator(
         const Func& func,
         const Interface& global,
-        const InterfaceTypeTable& interface_types) :
+        const InterfaceTypeTable& interface_types,
+        SubtypeCache& subtype_cache) :
           func {func},
           global {global},
           interface_types {interface_types},
-          type_checker {interface_types} {}
+          type_checker {interface_types, subtype_cache} {}
 
       // ## TODO
       // - All paths must return matching types
@@ -133,6 +196,9 @@ namespace zvm {
       }
 
       RegisterType reg_type(Register reg) {
+        if (reg == void_register())
+          return RegisterTypes::Void;
+
         if (reg >= this->func.registers.size()) {
           this->fail(Error::RegisterNotFound);
           return RegisterTypes::Void;
@@ -140,14 +206,26 @@ namespace zvm {
         return this->func.registers[reg];
       }
 
-      bool validate() {
+      void validate_signature() {
         if (this->func.arg_count > this->func.registers.size())
           this->fail(Error::MoreArgsThanRegisters);
 
         if (this->func.registers.size() > max_register())
           this->fail(Error::TooManyRegisters);
+      }
+
+      bool validate() {
+        this->validate_signature();
+        if (contains_fused_statements(this->func.block))
+          this->fail(Error::FusedStatement);
+        else
+          traverse_block(this->func.block, *this);
+        return this->is_valid;
+      }
 
-        traverse_block(this->func.block, *this);
+      bool validate(const StatementSource& source) {
+        this->validate_signature();
+        traverse_source(source, *this);
         return this->is_valid;
       }
 
@@ -177,7 +255,7 @@ namespace zvm {
       void validate_call(
         const Func& func,
         Register target,
-        const std::vector<Register> args);
+        const ArgList& args);
 
       template<typename S>
       void leave_statement(const S& stmt) {}
@@ -187,7 +265,11 @@ namespace zvm {
       }
 
       void enter_statement(const CallStatement& stmt) {
+        auto* dependencies = this->type_checker.dependencies;
         if (stmt.interface == void_register()) {
+          if (dependencies)
+            dependencies->global_funcs.push_back(stmt.func_name);
+
           auto iter = this->global.func_map.find(stmt.func_name);
           if (iter == this->global.func_map.end())
             return this->fail(Error::GlobalFuncNotFound);
@@ -195,7 +277,11 @@ namespace zvm {
           return this->validate_call(*iter->second, stmt.target, stmt.args);
         }
 
-        auto iter = this->interface_types.find(this->reg_type(stmt.interface));
+        auto type = this->reg_type(stmt.interface);
+        if (dependencies)
+          dependencies->interface_types.push_back(type);
+
+        auto iter = this->interface_types.find(type);
         if (iter == this->interface_types.end())
           return this->fail(Error::InterfaceTypeNotFound);
 
@@ -216,7 +302,6 @@ namespace zvm {
         this->in_repeat = true;
       }
 
-      template<>
       void leave_statement(const RepeatStatement& stmt) {
         this->in_repeat = false;
       }
@@ -248,7 +333,7 @@ namespace zvm {
     void Validator::validate_call(
       const Func& func,
       Register target,
-      const std::vector<Register> args)
+      const ArgList& args)
     {
       if (args.size() != func.arg_count)
         return this->fail(Error::WrongArgumentCount);
@@ -256,38 +341,250 @@ namespace zvm {
       std::vector<RegisterType> arg_types;
       arg_types.reserve(args.size());
       for (auto& reg : args) {
+        if (reg == void_register())
+          return this->fail(Error::RegisterNotFound);
         arg_types.push_back(this->reg_type(reg));
       }
 
       Func expected;
       expected.arg_count = static_cast<Register>(args.size());
       expected.registers = std::move(arg_types);
-      expected.return_type = this->reg_type(target);
+      // Calls targeting the void register discard the return value
+      expected.return_type = target == void_register()
+        ? func.return_type
+        : this->reg_type(target);
 
       if (!this->type_checker.can_assign_to(func, expected)) {
         this->fail(Error::NonMatchingCall);
       }
     }
 
+    // Don't start a thread for fewer than this many funcs
+    constexpr std::size_t min_funcs_per_thread = 64;
+
+    // A range of func indices owned by one worker. The owner takes
+    // from the front and thieves split off the back half; both update
+    // the packed [begin, end) pair with a single CAS.
+    struct WorkRange {
+      std::atomic<uint64_t> range {0};
+
+      static uint64_t pack(uint32_t begin, uint32_t end) {
+        return (static_cast<uint64_t>(end) << 32) | begin;
+      }
+
+      void assign(uint32_t begin, uint32_t end) {
+        this->range.store(pack(begin, end), std::memory_order_release);
+      }
+
+      bool take(uint32_t& index) {
+        auto current = this->range.load(std::memory_order_acquire);
+        while (true) {
+          auto begin = static_cast<uint32_t>(current);
+          auto end = static_cast<uint32_t>(current >> 32);
+          if (begin >= end)
+            return false;
+
+          if (this->range.compare_exchange_weak(current, pack(begin + 1, end))) {
+            index = begin;
+            return true;
+          }
+        }
+      }
+
+      bool steal(WorkRange& thief) {
+        auto current = this->range.load(std::memory_order_acquire);
+        while (true) {
+          auto begin = static_cast<uint32_t>(current);
+          auto end = static_cast<uint32_t>(current >> 32);
+          if (begin >= end)
+            return false;
+
+          auto middle = begin + (end - begin) / 2;
+          if (this->range.compare_exchange_weak(current, pack(begin, middle))) {
+            thief.assign(middle, end);
+            return true;
+          }
+        }
+      }
+    };
+
+  }
+
+  namespace {
+
+    bool validate_func_with(
+      Func& func,
+      const Interface& global,
+      const InterfaceTypeTable& interface_types,
+      const StatementSource* source,
+      ValidationToken validation_token,
+      SubtypeCache* subtype_cache,
+      ValidationDependencies* dependencies = nullptr)
+    {
+      if (
+        !dependencies &&
+        validation_token &&
+        func.validation_token.load(std::memory_order_acquire) == validation_token)
+      {
+        return true;
+      }
+
+      SubtypeCache local_cache;
+      Validator validator {
+        func,
+        global,
+        interface_types,
+        subtype_cache ? *subtype_cache : local_cache,
+      };
+
+      if (dependencies) {
+        dependencies->clear();
+        validator.type_checker.dependencies = dependencies;
+      }
+
+      bool valid = source
+        ? validator.validate(*source)
+        : validator.validate();
+
+      if (dependencies)
+        dependencies->normalize();
+
+      if (valid) {
+        func.validation_token.store(validation_token, std::memory_order_release);
+        return true;
+      }
+
+      return false;
+    }
+
   }
 
   bool validate_func(
     Func& func,
     const Interface& global,
     const InterfaceTypeTable& interface_types,
-    ValidationToken validation_token)
+    ValidationToken validation_token,
+    SubtypeCache* subtype_cache)
   {
-    if (validation_token && func.validation_token == validation_token) {
-      return true;
+    return validate_func_with(
+      func,
+      global,
+      interface_types,
+      nullptr,
+      validation_token,
+      subtype_cache);
+  }
+
+  bool validate_func(
+    Func& func,
+    const StatementSource& source,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    ValidationToken validation_token,
+    SubtypeCache* subtype_cache)
+  {
+    return validate_func_with(
+      func,
+      global,
+      interface_types,
+      &source,
+      validation_token,
+      subtype_cache);
+  }
+
+  bool validate_func(
+    Func& func,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    ValidationDependencies& dependencies,
+    ValidationToken validation_token,
+    SubtypeCache* subtype_cache)
+  {
+    return validate_func_with(
+      func,
+      global,
+      interface_types,
+      nullptr,
+      validation_token,
+      subtype_cache,
+      &dependencies);
+  }
+
+  ModuleValidation validate_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    ValidationToken validation_token,
+    unsigned thread_count)
+  {
+    ModuleValidation result;
+    result.results.resize(funcs.size());
+
+    if (thread_count == 0)
+      thread_count = std::max(1u, std::thread::hardware_concurrency());
+
+    thread_count = static_cast<unsigned>(std::min<std::size_t>(
+      thread_count,
+      std::max<std::size_t>(1, funcs.size() / min_funcs_per_thread)));
+
+    // Each worker starts with an even share of the funcs and steals
+    // half of another worker's remaining range when it runs out
+    std::vector<WorkRange> ranges(thread_count);
+    for (unsigned i = 0; i < thread_count; ++i) {
+      ranges[i].assign(
+        static_cast<uint32_t>(funcs.size() * i / thread_count),
+        static_cast<uint32_t>(funcs.size() * (i + 1) / thread_count));
     }
 
-    Validator validator {func, global, interface_types};
-    if (validator.validate()) {
-      func.validation_token = validation_token;
-      return true;
+    std::atomic<std::size_t> invalid_count {0};
+
+    auto work = [&](unsigned worker) {
+      // Subtype results depend only on the interface table, so each
+      // worker keeps its own cache and never synchronizes on it
+      SubtypeCache subtype_cache;
+      std::size_t invalid = 0;
+      uint32_t index;
+
+      while (true) {
+        while (ranges[worker].take(index)) {
+          bool valid = validate_func(
+            *funcs[index],
+            global,
+            interface_types,
+            validation_token,
+            &subtype_cache);
+
+          result.results[index] = valid;
+          if (!valid)
+            ++invalid;
+        }
+
+        bool stolen = false;
+        for (unsigned i = 1; i < thread_count && !stolen; ++i) {
+          stolen = ranges[(worker + i) % thread_count].steal(ranges[worker]);
+        }
+
+        if (!stolen)
+          break;
+      }
+
+      invalid_count.fetch_add(invalid, std::memory_order_relaxed);
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count - 1);
+    for (unsigned i = 1; i < thread_count; ++i) {
+      threads.emplace_back(work, i);
+    }
+
+    work(0);
+
+    for (auto& thread : threads) {
+      thread.join();
     }
 
-    return false;
+    result.invalid_count = invalid_count.load();
+    return result;
   }
 
 }
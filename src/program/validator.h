@@ -1,13 +1,120 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
 #include "func.h"
 
 namespace zvm {
 
+  struct StatementSource;
+
+  // Remembers the results of structural subtype checks between
+  // interface types so that they can be shared across validate_func
+  // calls. The cache is bound to one InterfaceTypeTable and is cleared
+  // when used with a different table, or when the table's generation
+  // or size changes. Call invalidate() after editing the func_map of
+  // an Interface in place without calling changed() on the table.
+  struct SubtypeCache {
+    const InterfaceTypeTable* interface_types = nullptr;
+    uint32_t generation = 0;
+    std::size_t interface_count = 0;
+    std::unordered_map<uint64_t, bool> results;
+
+    static uint64_t key(RegisterType source, RegisterType target) {
+      return (static_cast<uint64_t>(source) << 32) | target;
+    }
+
+    void bind(const InterfaceTypeTable& interface_types) {
+      if (
+        this->interface_types != &interface_types ||
+        this->generation != interface_types.generation ||
+        this->interface_count != interface_types.size())
+      {
+        this->invalidate();
+        this->interface_types = &interface_types;
+        this->generation = interface_types.generation;
+        this->interface_count = interface_types.size();
+      }
+    }
+
+    void invalidate() {
+      this->results.clear();
+    }
+  };
+
+  // What the validation of a func looked up: the global funcs its
+  // calls name, and the interface types it called through or compared.
+  // Types reached only through the methods of these interfaces are not
+  // listed.
+  struct ValidationDependencies {
+    std::vector<FuncName> global_funcs;
+    std::vector<RegisterType> interface_types;
+
+    void clear() {
+      this->global_funcs.clear();
+      this->interface_types.clear();
+    }
+
+    // Sorts and removes duplicates
+    void normalize() {
+      std::sort(this->global_funcs.begin(), this->global_funcs.end());
+      this->global_funcs.erase(
+        std::unique(this->global_funcs.begin(), this->global_funcs.end()),
+        this->global_funcs.end());
+      std::sort(this->interface_types.begin(), this->interface_types.end());
+      this->interface_types.erase(
+        std::unique(this->interface_types.begin(), this->interface_types.end()),
+        this->interface_types.end());
+    }
+  };
+
   bool validate_func(
     Func& func,
     const Interface& global,
     const InterfaceTypeTable& interface_types,
-    ValidationToken validation_token = 0);
+    ValidationToken validation_token = 0,
+    SubtypeCache* subtype_cache = nullptr);
+
+  // Validates `func` in full, ignoring its validation token, and
+  // records what the result depends on into `dependencies`
+  bool validate_func(
+    Func& func,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    ValidationDependencies& dependencies,
+    ValidationToken validation_token = 0,
+    SubtypeCache* subtype_cache = nullptr);
+
+  // Validates `func` against statements supplied by `source` instead
+  // of func.block. Only the signature of `func` is used.
+  bool validate_func(
+    Func& func,
+    const StatementSource& source,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    ValidationToken validation_token = 0,
+    SubtypeCache* subtype_cache = nullptr);
+
+  struct ModuleValidation {
+    // One entry per func: 1 if valid, 0 otherwise
+    std::vector<uint8_t> results;
+    std::size_t invalid_count = 0;
+
+    bool is_valid() const {
+      return this->invalid_count == 0;
+    }
+  };
+
+  // Validates every func in `funcs` across `thread_count` threads, or
+  // one per core if zero. The interface tables are only read, and each
+  // func's validation token is published atomically.
+  ModuleValidation validate_module(
+    const std::vector<Pointer<Func>>& funcs,
+    const Interface& global,
+    const InterfaceTypeTable& interface_types,
+    ValidationToken validation_token = 0,
+    unsigned thread_count = 0);
 
 }
@@ -1,84 +1,1041 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
 #include <string>
 #include <iostream>
 
-#include <unordered_set>
-
+#include "program/arena.h"
 #include "program/func.h"
+#include "program/linker.h"
+#include "program/parser.h"
+#include "program/validator.h"
+#include "interpreter/aot.h"
 #include "interpreter/interpreter.h"
+#include "interpreter/code_frame.h"
+#include "interpreter/executor.h"
+#include "interpreter/generator.h"
+#include "interpreter/jit.h"
+#include "interpreter/lower.h"
+#include "interpreter/profile.h"
+#include "interpreter/superinstructions.h"
+#include "interpreter/tiering.h"
+#include "interpreter/trace.h"
 
 using namespace zvm;
 
-template<typename T>
-struct Allocator {
-  std::unordered_set<T*> pointers;
+void test_interpreter() {
+  ProgramArena arena;
+  Func func {arena.resource()};
 
-  Allocator() {}
+  func.arg_count = 1;
 
-  Allocator(const Allocator& other) = delete;
-  Allocator& operator=(const Allocator& other) = delete;
+  func.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+    RegisterTypes::UInt64,
+  };
 
-  ~Allocator() {
-    for (T* ptr : pointers) {
-      delete ptr;
-    }
+  func.return_type = RegisterTypes::Bool;
+
+  func.block = arena.block({
+    arena.create<LoadStatement>(1, 123),
+    arena.create<LoadStatement>(2, 456),
+    arena.create<IfStatement>(0, arena.block({
+      arena.create<ReturnStatement>(1),
+    }), arena.block({
+      arena.create<ReturnStatement>(2),
+    })),
+  });
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+
+  Interpreter<TraceTraits> interpreter {global, interface_types};
+  InterpreterFrame<TraceTraits> frame {interpreter, func};
+  auto exit = frame.execute();
+
+  std::cout
+    << "result: " << static_cast<int>(exit)
+    << "/" << frame.get_reg(frame.return_register)
+    << "\n";
+}
+
+void test_lowered() {
+  ProgramArena arena;
+  Func func {arena.resource()};
+
+  func.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+
+  func.return_type = RegisterTypes::Int32;
+
+  func.block = arena.block({
+    arena.create<LoadStatement>(1, 7),
+    arena.create<RepeatStatement>(arena.block({
+      arena.create<IfStatement>(0, arena.block({
+        arena.create<BreakStatement>(),
+      })),
+      arena.create<FinallyStatement>(arena.block({
+        arena.create<LoadStatement>(0, 1),
+      }), arena.block({
+        arena.create<LoadStatement>(1, 8),
+      })),
+    })),
+    arena.create<ReturnStatement>(1),
+  });
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+
+  Interpreter<DefaultTraits> interpreter {global, interface_types};
+  InterpreterFrame<DefaultTraits> tree_frame {interpreter, func};
+  auto tree_exit = tree_frame.execute();
+
+  Code code = lower_func(func);
+  CodeFrame<DefaultTraits> code_frame {code};
+  auto code_exit = code_frame.execute();
+
+  std::cout
+    << "tree: " << static_cast<int>(tree_exit)
+    << "/" << tree_frame.get_reg(tree_frame.return_register)
+    << ", lowered: " << static_cast<int>(code_exit)
+    << "/" << code_frame.get_reg(code_frame.return_register)
+    << " (" << code.instructions.size() << " instructions)"
+    << "\n";
+}
+
+void test_threaded() {
+  ProgramArena arena;
+  Func func {arena.resource()};
+
+  func.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+  };
+
+  func.return_type = RegisterTypes::Int32;
+
+  func.block = arena.block({
+    arena.create<LoadStatement>(0, 1),
+    arena.create<IfStatement>(0, arena.block({
+      arena.create<LoadStatement>(1, 42),
+    }), arena.block({
+      arena.create<LoadStatement>(1, 43),
+    })),
+    arena.create<ReturnStatement>(1),
+  });
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+
+  Interpreter<ThreadedTraits> interpreter {global, interface_types};
+  InterpreterFrame<ThreadedTraits> tree_frame {interpreter, func};
+  auto tree_exit = tree_frame.execute();
+
+  Code code = lower_func(func);
+  CodeFrame<ThreadedTraits> code_frame {code};
+  auto code_exit = code_frame.execute();
+
+  std::cout
+    << "threaded tree: " << static_cast<int>(tree_exit)
+    << "/" << tree_frame.get_reg(tree_frame.return_register)
+    << ", threaded lowered: " << static_cast<int>(code_exit)
+    << "/" << code_frame.get_reg(code_frame.return_register)
+    << "\n";
+}
+
+template<typename Traits>
+void test_calls(const char* name) {
+  ProgramArena arena;
+
+  // select(flag, value): returns value if flag is set, otherwise 99
+  Func select {arena.resource()};
+  select.arg_count = 2;
+  select.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+  select.return_type = RegisterTypes::Int32;
+  select.block = arena.block({
+    arena.create<IfStatement>(0, arena.block({
+      arena.create<ReturnStatement>(1),
+    })),
+    arena.create<LoadStatement>(2, 99),
+    arena.create<ReturnStatement>(2),
+  });
+
+  Interface global;
+  global.func_map[1] = &select;
+
+  const RegisterType selector_type = RegisterTypes::FirstInterfaceType + 1;
+  Interface selector;
+  selector.func_map[7] = &select;
+
+  InterfaceTypeTable interface_types;
+  interface_types[selector_type] = &selector;
+
+  // main(obj): select(0, 5) via obj, then select(1, 6) globally
+  Func func {arena.resource()};
+  func.arg_count = 1;
+  func.registers = {
+    selector_type,
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+  func.return_type = RegisterTypes::Int32;
+  func.block = arena.block({
+    arena.create<LoadStatement>(1, 0),
+    arena.create<LoadStatement>(2, 5),
+    arena.create<CallStatement>(3, 0, 7, arena.args({1, 2})),
+    arena.create<LoadStatement>(1, 1),
+    arena.create<LoadStatement>(2, 6),
+    arena.create<CallStatement>(4, void_register(), 1, arena.args({1, 2})),
+    arena.create<ReturnStatement>(3),
+  });
+
+  Interpreter<Traits> interpreter {global, interface_types};
+  InterpreterFrame<Traits> frame {interpreter, func};
+  frame.set_reg(0, make_interface_value(selector_type));
+  auto exit = frame.execute();
+
+  std::cout
+    << name << " calls: " << static_cast<int>(exit)
+    << "/" << frame.return_value()
+    << "/" << frame.get_reg(4)
+    << " (" << interpreter.frames.size() << " pooled frames, "
+    << interpreter.registers.top << " register bytes in use)"
+    << "\n";
+
+  LoweredModule lowered;
+  lower_module({&func}, global, interface_types, lowered);
+  CodeFrame<Traits> code_frame {*lowered.find(func), &lowered};
+  code_frame.set_reg(0, make_interface_value(selector_type));
+  exit = code_frame.execute();
+
+  std::cout
+    << name << " lowered calls: " << static_cast<int>(exit)
+    << "/" << code_frame.return_value()
+    << "/" << code_frame.get_reg(4)
+    << " (" << code_frame.callees.size() << " pooled frames)"
+    << "\n";
+
+  Linkage linkage;
+  bool linked = link_module({&func}, global, interface_types, linkage);
+
+  Interpreter<Traits> linked_interpreter {global, interface_types, &linkage};
+  InterpreterFrame<Traits> linked_frame {linked_interpreter, func};
+  linked_frame.set_reg(0, make_interface_value(selector_type));
+  exit = linked_frame.execute();
+
+  std::cout
+    << name << " linked calls: " << linked
+    << "/" << static_cast<int>(exit)
+    << "/" << linked_frame.return_value()
+    << "/" << linked_frame.get_reg(4)
+    << "\n";
+}
+
+void test_inline_caches() {
+  ProgramArena arena;
+
+  Func one {arena.resource()};
+  one.registers = {RegisterTypes::Int32};
+  one.return_type = RegisterTypes::Int32;
+  one.block = arena.block({
+    arena.create<LoadStatement>(0, 1),
+    arena.create<ReturnStatement>(0),
+  });
+
+  Func two {arena.resource()};
+  two.registers = {RegisterTypes::Int32};
+  two.return_type = RegisterTypes::Int32;
+  two.block = arena.block({
+    arena.create<LoadStatement>(0, 2),
+    arena.create<ReturnStatement>(0),
+  });
+
+  const RegisterType base_type = RegisterTypes::FirstInterfaceType + 1;
+  const RegisterType one_type = RegisterTypes::FirstInterfaceType + 2;
+  const RegisterType two_type = RegisterTypes::FirstInterfaceType + 3;
+
+  Interface base;
+  base.func_map[1] = &one;
+  Interface one_impl;
+  one_impl.func_map[1] = &one;
+  Interface two_impl;
+  two_impl.func_map[1] = &two;
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+  interface_types[base_type] = &base;
+  interface_types[one_type] = &one_impl;
+  interface_types[two_type] = &two_impl;
+
+  Func func {arena.resource()};
+  func.arg_count = 1;
+  func.registers = {base_type, RegisterTypes::Int32};
+  func.return_type = RegisterTypes::Int32;
+  func.block = arena.block({
+    arena.create<CallStatement>(1, 0, 1),
+    arena.create<ReturnStatement>(1),
+  });
+
+  using Traits = InlineCacheCountingTraits;
+  Interpreter<Traits> interpreter {global, interface_types};
+
+  std::cout << "inline cache results:";
+  for (auto type : {one_type, one_type, two_type, two_type}) {
+    InterpreterFrame<Traits> frame {interpreter, func};
+    frame.set_reg(0, make_interface_value(type));
+    frame.execute();
+    std::cout << " " << frame.return_value();
   }
 
-  template<typename U, typename ...Args>
-  U* create(Args ...args) {
-    auto* ptr = new U(std::forward<Args>(args)...);
-    pointers.insert(ptr);
-    return ptr;
+  auto stats = inline_cache_stats(func, interface_types.generation);
+  std::cout
+    << " (sites " << stats.sites
+    << ", polymorphic " << stats.polymorphic_sites
+    << ", hits " << stats.hits
+    << ", misses " << stats.misses << ")";
+
+  // Cached targets are not used with another table, or with the same
+  // table once it has changed
+  auto call = [&](Interpreter<Traits>& interpreter, RegisterType type) {
+    InterpreterFrame<Traits> frame {interpreter, func};
+    frame.set_reg(0, make_interface_value(type));
+    frame.execute();
+    return frame.return_value();
+  };
+
+  InterfaceTypeTable swapped = interface_types;
+  swapped[one_type] = &two_impl;
+  swapped.changed();
+  Interpreter<Traits> swapped_interpreter {global, swapped};
+  std::cout << ", other table " << call(swapped_interpreter, one_type);
+
+  interface_types[two_type] = &one_impl;
+  interface_types.changed();
+  std::cout << ", changed table " << call(interpreter, two_type);
+
+  // A cache which filled up stops being megamorphic in a later
+  // generation
+  InlineCache full;
+  auto generation = interface_types.generation;
+  for (uint32_t type = 0; type <= InlineCache::entry_count; ++type) {
+    full.insert(generation, type, &one);
   }
+  interface_types.changed();
+  std::cout
+    << ", megamorphic " << full.is_megamorphic(generation)
+    << " " << full.is_megamorphic(interface_types.generation)
+    << "\n";
+}
+
+void test_generators() {
+  ProgramArena arena;
 
-  template<typename U>
-  U* insert(U* ptr) {
-    pointers.insert(ptr);
-    return ptr;
+  // helper(): yields 2 and 3
+  Func helper {arena.resource()};
+  helper.registers = {RegisterTypes::Int32};
+  helper.return_type = RegisterTypes::Int32;
+  helper.block = arena.block({
+    arena.create<LoadStatement>(0, 2),
+    arena.create<YieldStatement>(0),
+    arena.create<LoadStatement>(0, 3),
+    arena.create<YieldStatement>(0),
+  });
+
+  Interface global;
+  global.func_map[1] = &helper;
+  InterfaceTypeTable interface_types;
+
+  // gen(): yields 1, then everything helper yields, then 4
+  Func func {arena.resource()};
+  func.registers = {RegisterTypes::Int32};
+  func.return_type = RegisterTypes::Int32;
+  func.block = arena.block({
+    arena.create<LoadStatement>(0, 1),
+    arena.create<YieldStatement>(0),
+    arena.create<CallStatement>(void_register(), void_register(), 1),
+    arena.create<LoadStatement>(0, 4),
+    arena.create<YieldStatement>(0),
+    arena.create<ReturnStatement>(0),
+  });
+
+  Generator<DefaultTraits> first {func, global, interface_types};
+  Generator<ThreadedTraits> second {func, global, interface_types};
+
+  // Interleave two generators to show that they are independent
+  std::cout << "generators:";
+  RegisterValue a;
+  RegisterValue b;
+  while (true) {
+    bool has_a = first.next(a);
+    bool has_b = second.next(b);
+    if (!has_a || !has_b)
+      break;
+    std::cout << " " << a << b;
   }
 
-  void destroy(T* ptr) {
-    if (auto erased = pointers.erase(ptr); erased > 0) {
-      delete ptr;
-    }
+  LoweredModule lowered;
+  lower_module({&func}, global, interface_types, lowered);
+  CodeFrame<DefaultTraits> code_frame {*lowered.find(func), &lowered};
+  std::cout << ", lowered:";
+  for (auto exit = code_frame.execute(); exit == ExitKind::Yield; exit = code_frame.resume()) {
+    std::cout << " " << code_frame.yielded_value();
   }
-};
 
-struct InterpreterTraits {};
+  std::cout
+    << " (" << static_cast<int>(first.exit)
+    << "/" << first.frame.return_value()
+    << ", " << first.interpreter.frames.size() << " pooled frames)"
+    << "\n";
+}
 
-int main() {
-  Allocator<Statement> allocator;
-  Func func;
+void test_executor() {
+  ProgramArena arena;
 
+  // echo(value): yields value twice, then returns it
+  Func func {arena.resource()};
   func.arg_count = 1;
+  func.registers = {RegisterTypes::Int32};
+  func.return_type = RegisterTypes::Int32;
+  func.block = arena.block({
+    arena.create<YieldStatement>(0),
+    arena.create<YieldStatement>(0),
+    arena.create<ReturnStatement>(0),
+  });
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+
+  Executor<DefaultTraits> executor {global, interface_types};
+  for (RegisterValue i = 0; i < 1000; ++i) {
+    executor.submit(func, {i});
+  }
+  // echo takes one argument
+  bool rejected = executor.submit(func, {0, 1}) == nullptr;
+  executor.run(4);
+
+  uint32_t yields = 0;
+  bool correct = true;
+  for (RegisterValue i = 0; i < executor.tasks.size(); ++i) {
+    auto& task = *executor.tasks[i];
+    yields += task.yield_count;
+    correct = correct
+      && task.exit() == ExitKind::Return
+      && task.result == i
+      && task.last_yielded == i;
+  }
+
+  std::cout
+    << "executor: " << executor.tasks.size()
+    << " tasks, " << yields
+    << " yields, " << correct
+    << ", rejected " << rejected
+    << "\n";
+}
 
+void test_exceptions() {
+  ProgramArena arena;
+
+  Func func {arena.resource()};
   func.registers = {
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
     RegisterTypes::Bool,
     RegisterTypes::Int32,
+  };
+  func.return_type = RegisterTypes::Int32;
+  func.block = arena.block({
+    // The finally block runs while the throw unwinds to the catch
+    arena.create<TryStatement>(1, arena.block({
+      arena.create<FinallyStatement>(arena.block({
+        arena.create<LoadStatement>(0, 7),
+        arena.create<ThrowStatement>(0),
+      }), arena.block({
+        arena.create<LoadStatement>(3, 10),
+      })),
+    })),
+    // ... and on break
+    arena.create<RepeatStatement>(arena.block({
+      arena.create<FinallyStatement>(arena.block({
+        arena.create<BreakStatement>(),
+      }), arena.block({
+        arena.create<LoadStatement>(0, 20),
+      })),
+    })),
+    // ... and on return
+    arena.create<FinallyStatement>(arena.block({
+      arena.create<ReturnStatement>(1),
+    }), arena.block({
+      arena.create<LoadStatement>(2, 1),
+    })),
+  });
+
+  // thrower(): throws 9
+  Func thrower {arena.resource()};
+  thrower.registers = {RegisterTypes::Int32};
+  thrower.block = arena.block({
+    arena.create<LoadStatement>(0, 9),
+    arena.create<ThrowStatement>(0),
+  });
+
+  Interface global;
+  global.func_map[1] = &thrower;
+  InterfaceTypeTable interface_types;
+
+  // Throws propagate through callers until caught
+  Func uncaught {arena.resource()};
+  uncaught.block = arena.block({
+    arena.create<CallStatement>(void_register(), void_register(), 1),
+  });
+
+  Func caught {arena.resource()};
+  caught.registers = {RegisterTypes::Int32};
+  caught.return_type = RegisterTypes::Int32;
+  caught.block = arena.block({
+    arena.create<TryStatement>(0, arena.block({
+      arena.create<CallStatement>(void_register(), void_register(), 1),
+    })),
+    arena.create<ReturnStatement>(0),
+  });
+
+  Interpreter<DefaultTraits> interpreter {global, interface_types};
+  InterpreterFrame<DefaultTraits> tree_frame {interpreter, func};
+  auto tree_exit = tree_frame.execute();
+
+  Code code = lower_func(func);
+  CodeFrame<ThreadedTraits> code_frame {code};
+  auto code_exit = code_frame.execute();
+
+  InterpreterFrame<DefaultTraits> uncaught_frame {interpreter, uncaught};
+  auto uncaught_exit = uncaught_frame.execute();
+  InterpreterFrame<DefaultTraits> caught_frame {interpreter, caught};
+  auto caught_exit = caught_frame.execute();
+
+  std::cout
+    << "exceptions: tree " << static_cast<int>(tree_exit)
+    << "/" << tree_frame.return_value()
+    << " (" << tree_frame.get_reg(0)
+    << " " << tree_frame.get_reg(3)
+    << " " << tree_frame.get_reg(2)
+    << "), lowered " << static_cast<int>(code_exit)
+    << "/" << code_frame.get_reg(code_frame.return_register)
+    << " (" << code_frame.get_reg(0)
+    << " " << code_frame.get_reg(3)
+    << " " << code_frame.get_reg(2)
+    << ", " << code.handlers.size() << " handlers)"
+    << ", uncaught " << static_cast<int>(uncaught_exit)
+    << "/" << uncaught_frame.thrown_value
+    << ", caught " << static_cast<int>(caught_exit)
+    << "/" << caught_frame.return_value()
+    << "\n";
+}
+
+void test_packed_registers() {
+  ProgramArena arena;
+  Func func {arena.resource()};
+
+  func.registers = {
+    RegisterTypes::Bool,
     RegisterTypes::Int32,
+    RegisterTypes::Int8,
     RegisterTypes::UInt64,
+    RegisterTypes::Int16,
   };
 
-  func.return_type = RegisterTypes::Bool;
+  func.block = arena.block({
+    arena.create<LoadStatement>(0, 1),
+    arena.create<LoadStatement>(1, ~RegisterValue(0)),
+    arena.create<LoadStatement>(2, 0x17f),
+    arena.create<LoadStatement>(3, ~RegisterValue(0)),
+    // Shares a word with registers 0 and 2, which keep their values
+    arena.create<LoadStatement>(4, 0x18000),
+  });
+
+  Interface global;
+  InterfaceTypeTable interface_types;
 
-  func.block = make_block({
-    allocator.create<LoadStatement>(1, 123),
-    allocator.create<LoadStatement>(2, 456),
-    allocator.create<IfStatement>(0, make_block({
-      allocator.create<ReturnStatement>(1),
-    }), make_block({
-      allocator.create<ReturnStatement>(2),
+  Interpreter<CheckedTraits> interpreter {global, interface_types};
+  InterpreterFrame<CheckedTraits> frame {interpreter, func};
+  frame.execute();
+
+  std::cout
+    << "packed registers: " << func.registers.frame_size
+    << " bytes, " << static_cast<int>(frame.get<uint8_t>(0))
+    << " " << frame.get<int32_t>(1)
+    << " " << static_cast<int64_t>(frame.get_reg(1))
+    << " " << frame.get_reg(2)
+    << " " << (frame.get<uint64_t>(3) == ~RegisterValue(0))
+    << " " << static_cast<int64_t>(frame.get_reg(4))
+    << "\n";
+}
+
+void test_jit() {
+  ProgramArena arena;
+
+  // select(flag, value): returns value if flag is set, otherwise 99
+  Func select {arena.resource()};
+  select.arg_count = 2;
+  select.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+  select.return_type = RegisterTypes::Int32;
+  select.block = arena.block({
+    arena.create<IfStatement>(0, arena.block({
+      arena.create<ReturnStatement>(1),
+    })),
+    arena.create<LoadStatement>(2, 99),
+    arena.create<ReturnStatement>(2),
+  });
+
+  // thrower(value): interpreted
+  Func thrower {arena.resource()};
+  thrower.arg_count = 1;
+  thrower.registers = {RegisterTypes::Int32};
+  thrower.block = arena.block({
+    arena.create<ThrowStatement>(0),
+  });
+
+  const RegisterType selector_type = RegisterTypes::FirstInterfaceType + 1;
+  Interface selector;
+  selector.func_map[7] = &select;
+
+  InterfaceTypeTable interface_types;
+  interface_types[selector_type] = &selector;
+
+  // outer(obj): select(1, 7) via obj, then globally in a loop, then
+  // catches the result thrown back by thrower
+  Func outer {arena.resource()};
+  outer.arg_count = 1;
+  outer.registers = {
+    selector_type,
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+  outer.return_type = RegisterTypes::Int32;
+  outer.block = arena.block({
+    arena.create<LoadStatement>(1, 1),
+    arena.create<LoadStatement>(2, 7),
+    arena.create<CallStatement>(3, 0, 7, arena.args({1, 2})),
+    arena.create<RepeatStatement>(arena.block({
+      arena.create<CallStatement>(4, void_register(), 1, arena.args({1, 3})),
+      arena.create<IfStatement>(1, arena.block({
+        arena.create<BreakStatement>(),
+      })),
     })),
+    arena.create<TryStatement>(5, arena.block({
+      arena.create<CallStatement>(void_register(), void_register(), 2, arena.args({4})),
+    })),
+    arena.create<ReturnStatement>(5),
+  });
+
+  Func rethrow {arena.resource()};
+  rethrow.arg_count = 1;
+  rethrow.registers = {RegisterTypes::Int32};
+  rethrow.block = arena.block({
+    arena.create<ThrowStatement>(0),
+  });
+
+  Func narrow {arena.resource()};
+  narrow.registers = {RegisterTypes::Int8};
+  narrow.return_type = RegisterTypes::Int8;
+  narrow.block = arena.block({
+    arena.create<LoadStatement>(0, 0xff),
+    arena.create<ReturnStatement>(0),
+  });
+
+  Func generator {arena.resource()};
+  generator.registers = {RegisterTypes::Int32};
+  generator.block = arena.block({
+    arena.create<YieldStatement>(0),
   });
 
   Interface global;
+  global.func_map[1] = &select;
+  global.func_map[2] = &thrower;
+  global.func_map[3] = &outer;
+  global.func_map[4] = &rethrow;
+  global.func_map[5] = &narrow;
+
+  // Interpreted caller of the compiled funcs
+  Func root {arena.resource()};
+  root.arg_count = 1;
+  root.registers = {
+    selector_type,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+  root.return_type = RegisterTypes::Int32;
+  root.block = arena.block({
+    arena.create<CallStatement>(1, void_register(), 3, arena.args({0})),
+    arena.create<LoadStatement>(2, 5),
+    arena.create<TryStatement>(3, arena.block({
+      arena.create<CallStatement>(void_register(), void_register(), 4, arena.args({2})),
+    })),
+    arena.create<CallStatement>(4, void_register(), 5),
+    arena.create<ReturnStatement>(1),
+  });
 
-  InterpreterFrame<InterpreterTraits> frame {func};
+  Jit jit;
+  std::cout
+    << "jit: compiled " << jit.compile(select)
+    << jit.compile(outer)
+    << jit.compile(rethrow)
+    << jit.compile(narrow)
+    << ", generator " << jit.compile(generator);
+
+  Interpreter<DefaultTraits> interpreter {global, interface_types};
+  interpreter.jit = &jit;
+  InterpreterFrame<DefaultTraits> frame {interpreter, root};
+  frame.set_reg(0, make_interface_value(selector_type));
   auto exit = frame.execute();
 
   std::cout
-    << "result: " << static_cast<int>(exit)
-    << "/" << frame.get_reg(frame.return_register)
+    << ", " << static_cast<int>(exit)
+    << "/" << frame.return_value()
+    << " " << frame.get_reg(3)
+    << " " << static_cast<int64_t>(frame.get_reg(4))
+    << " (" << interpreter.registers.top << " register bytes in use)";
+
+  // A second Jit keeps its code for the same func in its own table
+  {
+    Jit other;
+    other.compile(select);
+    std::cout
+      << ", second jit " << (other.entry(select) && other.entry(select) != jit.entry(select));
+  }
+  std::cout << ", first jit " << (jit.entry(select) != nullptr) << "\n";
+}
+
+void test_aot() {
+  ParsedModule module;
+  std::ifstream in {ZVM_TEST_AOT_MODULE};
+  parse_module(in, module);
+
+  auto funcs = module.func_list();
+  auto& root = *funcs[5];
+  // Recurses without end through a window of 200 registers
+  auto& deep = *funcs[6];
+
+  // The same module is run by the interpreter alone, then with the
+  // library built from it by zvm_add_aot_module
+  auto run = [&](const Jit* natives) {
+    Interpreter<DefaultTraits> interpreter {module.global(), module.interface_types};
+    interpreter.jit = natives;
+    InterpreterFrame<DefaultTraits> frame {interpreter, root};
+    frame.set_reg(0, make_interface_value(RegisterTypes::FirstInterfaceType + 1));
+    auto exit = frame.execute();
+
+    std::cout
+      << static_cast<int>(exit)
+      << "/" << frame.return_value()
+      << " " << frame.get_reg(3)
+      << " " << frame.get_reg(4);
+  };
+
+  AotLibrary library;
+  Jit natives;
+  bool loaded = load_aot_module(ZVM_TEST_AOT_LIBRARY, funcs, library, natives);
+
+  std::cout << "aot: " << loaded << " " << natives.funcs.size() << " native, interpreted ";
+  run(nullptr);
+  std::cout << ", native ";
+  run(&natives);
+
+  // Every engine throws once the recursion runs out of room, rather
+  // than overflowing the machine stack
+  auto run_deep = [&](const Jit* natives) {
+    Interpreter<DefaultTraits> interpreter {module.global(), module.interface_types};
+    interpreter.jit = natives;
+    InterpreterFrame<DefaultTraits> frame {interpreter, deep};
+    return static_cast<int>(frame.execute());
+  };
+
+  Jit jit;
+  jit.compile(deep);
+  std::cout
+    << ", deep recursion " << run_deep(nullptr)
+    << " " << run_deep(&jit)
+    << " " << run_deep(&natives)
     << "\n";
+}
+
+void test_superinstructions() {
+  ProgramArena arena;
+  Func func {arena.resource()};
+
+  func.registers = {
+    RegisterTypes::Int64,
+    RegisterTypes::Int64,
+    RegisterTypes::Int64,
+    RegisterTypes::Int64,
+    RegisterTypes::Bool,
+  };
+
+  func.block = arena.block({
+    arena.create<LoadStatement>(0, 1),
+    arena.create<LoadStatement>(1, 2),
+    arena.create<LoadStatement>(2, 3),
+    arena.create<LoadStatement>(3, 4),
+    arena.create<LoadStatement>(4, 1),
+    arena.create<IfStatement>(4, arena.block({
+      arena.create<LoadStatement>(0, 10),
+      arena.create<LoadStatement>(1, 20),
+      arena.create<ReturnStatement>(1),
+    }), arena.block({
+      arena.create<ReturnStatement>(0),
+    })),
+  });
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+
+  // Returns the number of dispatches
+  auto run = [&](ExecutionProfile& profile) {
+    ProfilingTraits::current() = &profile;
+    Interpreter<ProfilingTraits> interpreter {global, interface_types};
+    InterpreterFrame<ProfilingTraits> frame {interpreter, func};
+    auto exit = frame.execute();
+    ProfilingTraits::current() = nullptr;
+
+    uint64_t dispatches = 0;
+    for (auto& entry : profile.statements) {
+      dispatches += entry.second.executions;
+    }
+    std::cout << static_cast<int>(exit) << "/" << frame.return_value() << " ";
+    return dispatches;
+  };
+
+  std::cout << "superinstructions: ";
+  ExecutionProfile profile;
+  auto before = run(profile);
+
+  auto ranking = rank_statement_sequences({&func}, profile);
+  auto set = select_superinstructions(ranking, profile);
+  auto fused = fuse_statements(func, arena, set);
+
+  FusedKind top;
+  superinstruction_kind(ranking.front(), top);
+
+  ExecutionProfile fused_profile;
+  auto after = run(fused_profile);
+
+  Interpreter<ThreadedTraits> interpreter {global, interface_types};
+  InterpreterFrame<ThreadedTraits> frame {interpreter, func};
+  frame.execute();
+
+  // Lowering expands the fused statements; the other passes decline
+  Code code = lower_func(func);
+  CodeFrame<DefaultTraits> code_frame {code};
+  auto code_exit = code_frame.execute();
+
+  Jit jit;
+  std::ostringstream aot;
+  emit_aot_module(aot, {&func}, global, interface_types);
+
+  std::cout
+    << fused_kind_name(top)
+    << " " << fused << " fused, "
+    << before << " -> " << after << " dispatches, threaded "
+    << frame.return_value()
+    << ", lowered " << static_cast<int>(code_exit)
+    << "/" << code_frame.get_reg(code_frame.return_register)
+    << ", compiled " << jit.compile(func)
+    << ", aot " << (aot.str().find("static int f0") != std::string::npos)
+    << ", valid " << validate_func(func, global, interface_types)
+    << "\n";
+}
 
+void test_profile() {
+  const char source[] =
+    "func 0 args 2 returns i32\n"
+    "  registers bool i32 i32\n"
+    "  if r0\n"
+    "    return r1\n"
+    "  end\n"
+    "  load r2 99\n"
+    "  return r2\n"
+    "end\n"
+    "func 1 args 1 returns i32\n"
+    "  registers 257 bool i32 i32 i32\n"
+    "  load r1 0\n"
+    "  load r2 5\n"
+    "  call r3 r0 7 r1 r2\n"
+    "  load r1 1\n"
+    "  call r4 _ 0 r1 r2\n"
+    "  return r3\n"
+    "end\n"
+    "interface 0 global\n"
+    "  method 0 0\n"
+    "end\n"
+    "interface 1\n"
+    "  method 7 0\n"
+    "end\n"
+    "type 257 1\n";
+
+  ParsedModule module;
+  parse_module(source, sizeof(source) - 1, module);
+  auto funcs = module.func_list();
+
+  auto run = [&](auto traits, ExecutionProfile& profile) {
+    using Traits = decltype(traits);
+    Traits::current() = &profile;
+    Interpreter<Traits> interpreter {module.global(), module.interface_types};
+    InterpreterFrame<Traits> frame {interpreter, *funcs[1]};
+    frame.set_reg(0, make_interface_value(RegisterTypes::FirstInterfaceType + 1));
+    frame.execute();
+    profile.finish();
+    Traits::current() = nullptr;
+    return frame.return_value();
+  };
+
+  ExecutionProfile profile;
+  auto result = run(ProfilingTraits {}, profile);
+
+  ExecutionProfile timed;
+  run(TimedProfilingTraits {}, timed);
+
+  std::ostringstream report;
+  print_profile(report, profile, funcs);
+  std::string report_text = report.str();
+
+  auto& select = profile.funcs[funcs[0]];
+  auto& main = profile.funcs[funcs[1]];
+  std::cout
+    << "profile: " << result
+    << ", calls " << select.calls << " " << main.calls
+    << ", statements " << select.statements << " " << main.statements
+    << ", methods " << profile.methods.size()
+    << "/" << profile.methods[{RegisterTypes::FirstInterfaceType + 1, 7}]
+    << ", cycles " << (select.cycles == 0) << (timed.funcs[funcs[0]].cycles > 0)
+    << ", report " << std::count(report_text.begin(), report_text.end(), '\n')
+    << "\n";
+}
+
+unsigned tiering_ticks = 0;
+
+// Native code for a func which returns true every 1000th call
+ExitKind tick(JitRuntime& runtime, unsigned char* registers) {
+  runtime.return_value = ++tiering_ticks % 1000 == 0;
+  return ExitKind::Return;
+}
+
+void test_tiering() {
+  ProgramArena arena;
+
+  Func ticker {arena.resource()};
+  ticker.return_type = RegisterTypes::Bool;
+
+  Func leaf {arena.resource()};
+  leaf.registers = {RegisterTypes::Int32};
+  leaf.return_type = RegisterTypes::Int32;
+  leaf.block = arena.block({
+    arena.create<LoadStatement>(0, 5),
+    arena.create<ReturnStatement>(0),
+  });
+  // Fused, so it stays interpreted
+  auto leaf_fused = fuse_statements(leaf, arena, SuperinstructionSet::all());
+
+  // Calls leaf until the ticker returns true
+  Func spin {arena.resource()};
+  spin.registers = {RegisterTypes::Bool, RegisterTypes::Int32};
+  spin.return_type = RegisterTypes::Int32;
+  spin.block = arena.block({
+    arena.create<RepeatStatement>(arena.block({
+      arena.create<CallStatement>(0, void_register(), 1),
+      arena.create<CallStatement>(1, void_register(), 2),
+      arena.create<IfStatement>(0, arena.block({
+        arena.create<BreakStatement>(),
+      })),
+    })),
+    arena.create<ReturnStatement>(1),
+  });
+
+  // Throws out of its loop once the ticker returns true
+  Func catcher {arena.resource()};
+  catcher.registers = {RegisterTypes::Bool, RegisterTypes::Int32};
+  catcher.return_type = RegisterTypes::Int32;
+  catcher.block = arena.block({
+    arena.create<TryStatement>(1, arena.block({
+      arena.create<RepeatStatement>(arena.block({
+        arena.create<CallStatement>(0, void_register(), 1),
+        arena.create<IfStatement>(0, arena.block({
+          arena.create<ThrowStatement>(0),
+        })),
+      })),
+    })),
+    arena.create<ReturnStatement>(1),
+  });
+
+  Func root {arena.resource()};
+  root.registers = {RegisterTypes::Int32, RegisterTypes::Int32};
+  root.return_type = RegisterTypes::Int32;
+  root.block = arena.block({
+    arena.create<CallStatement>(0, void_register(), 3),
+    arena.create<CallStatement>(1, void_register(), 4),
+    arena.create<ReturnStatement>(0),
+  });
+
+  Interface global;
+  global.func_map[1] = &ticker;
+  global.func_map[2] = &leaf;
+  global.func_map[3] = &spin;
+  global.func_map[4] = &catcher;
+  InterfaceTypeTable interface_types;
+
+  Tiering tiering {10, 100};
+  tiering.jit.add(ticker, &tick);
+
+  Interpreter<TieringTraits> interpreter {global, interface_types};
+  interpreter.enable_tiering(tiering);
+  InterpreterFrame<TieringTraits> frame {interpreter, root};
+  auto exit = frame.execute();
+
+  std::cout
+    << "tiering: " << static_cast<int>(exit)
+    << "/" << frame.return_value()
+    << " " << frame.get_reg(1)
+    << " " << tiering_ticks
+    << ", compiled " << tiering.compiled_count
+    << ", loop entries " << tiering.loop_entry_count
+    << ", counted " << tiering.counters[&leaf].calls
+    << " " << tiering.counters[&spin].back_edges
+    << " " << tiering.counters[&catcher].back_edges
+    << ", fused leaf " << leaf_fused << " " << tiering.counters[&leaf].failed
+    << "\n";
+}
+
+int main() {
+  test_interpreter();
+  test_lowered();
+  test_threaded();
+  test_calls<DefaultTraits>("switch");
+  test_calls<ThreadedTraits>("threaded");
+  test_inline_caches();
+  test_generators();
+  test_executor();
+  test_exceptions();
+  test_packed_registers();
+  test_jit();
+  test_aot();
+  test_superinstructions();
+  test_profile();
+  test_tiering();
   return 0;
 }
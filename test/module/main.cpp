@@ -0,0 +1,159 @@
+#include <cstdio>
+#include <iostream>
+
+#include "program/arena.h"
+#include "program/func.h"
+#include "program/linker.h"
+#include "program/validator.h"
+#include "interpreter/code_frame.h"
+#include "interpreter/interpreter.h"
+#include "module/image.h"
+#include "module/writer.h"
+
+using namespace zvm;
+
+void test_module_image() {
+  ProgramArena arena;
+
+  Func select {arena.resource()};
+  select.arg_count = 2;
+  select.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Int32,
+  };
+  select.return_type = RegisterTypes::Int32;
+  select.block = arena.block({
+    arena.create<IfStatement>(0, arena.block({
+      arena.create<ReturnStatement>(1),
+    })),
+    arena.create<LoadStatement>(2, 99),
+    arena.create<ReturnStatement>(2),
+  });
+
+  // done(): throws and returns the void register
+  Func done {arena.resource()};
+  done.block = arena.block({
+    arena.create<TryStatement>(void_register(), arena.block({
+      arena.create<ThrowStatement>(void_register()),
+    })),
+    arena.create<ReturnStatement>(void_register()),
+  });
+
+  Interface global;
+  global.func_map[1] = &select;
+  global.func_map[2] = &done;
+
+  const RegisterType selector_type = RegisterTypes::FirstInterfaceType + 1;
+  Interface selector;
+  selector.func_map[7] = &select;
+
+  InterfaceTypeTable interface_types;
+  interface_types[selector_type] = &selector;
+
+  Func func {arena.resource()};
+  func.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+  };
+  func.return_type = RegisterTypes::Int32;
+  func.block = arena.block({
+    arena.create<LoadStatement>(1, 7),
+    arena.create<RepeatStatement>(arena.block({
+      arena.create<IfStatement>(0, arena.block({
+        arena.create<BreakStatement>(),
+      })),
+      arena.create<FinallyStatement>(arena.block({
+        arena.create<LoadStatement>(0, 1),
+      }), arena.block({
+        arena.create<LoadStatement>(1, 8),
+      })),
+    })),
+    arena.create<CallStatement>(void_register(), void_register(), 2),
+    arena.create<CallStatement>(3, void_register(), 1, arena.args({2, 1})),
+    arena.create<ReturnStatement>(3),
+  });
+
+  Linkage linkage;
+  link_module({&func}, global, interface_types, linkage);
+
+  auto bytes = write_module({&func}, global, interface_types);
+  auto image = load_module_image(std::vector<char>(bytes));
+
+  const char* path = "zvm_test_module.zvmm";
+  write_module_file(path, {&func}, global, interface_types);
+  auto mapped = open_module_image(path);
+  std::remove(path);
+
+  // A corrupt image is rejected rather than loaded
+  auto corrupt = bytes;
+  corrupt[image->header->instructions.offset] = 0x7f;
+  auto rejected = load_module_image(std::move(corrupt));
+
+  Interpreter<DefaultTraits> interpreter {global, interface_types};
+  InterpreterFrame<DefaultTraits> tree_frame {interpreter, func};
+  auto tree_exit = tree_frame.execute();
+
+  CodeFrame<DefaultTraits> code_frame {mapped->code(0), mapped.get()};
+  auto code_exit = code_frame.execute();
+
+  bool valid = true;
+  for (uint32_t i = 0; i < image->func_count; ++i) {
+    valid = validate_image_func(*image, i) && valid;
+  }
+
+  std::cout
+    << "module: loaded " << (image != nullptr)
+    << ", mapped " << (mapped != nullptr)
+    << ", corrupt rejected " << (rejected == nullptr)
+    << ", funcs " << image->func_count
+    << ", tree " << static_cast<int>(tree_exit)
+    << "/" << tree_frame.return_value()
+    << ", lowered " << static_cast<int>(code_exit)
+    << "/" << code_frame.return_value()
+    << ", valid " << valid
+    << "\n";
+}
+
+void test_deep_module() {
+  ProgramArena arena;
+
+  // Far deeper than the native stack would allow with recursion
+  const unsigned depth = 200000;
+  Func func {arena.resource()};
+  func.registers = {RegisterTypes::Bool};
+  func.return_type = RegisterTypes::Bool;
+  Block block = arena.block({arena.create<ReturnStatement>(0)});
+  for (unsigned i = 0; i < depth; ++i) {
+    block = arena.block({
+      arena.create<LoadStatement>(0, 1),
+      arena.create<IfStatement>(0, std::move(block)),
+    });
+  }
+  func.block = std::move(block);
+
+  Interface global;
+  InterfaceTypeTable interface_types;
+
+  auto image = load_module_image(write_module({&func}, global, interface_types));
+  bool valid = image && validate_image_func(*image, 0);
+
+  CodeFrame<DefaultTraits> code_frame {image->code(0), image.get()};
+  auto exit = code_frame.execute();
+
+  std::cout
+    << "deep module: loaded " << (image != nullptr)
+    << ", valid " << valid
+    << ", nodes " << image->header->nodes.count
+    << ", lowered " << static_cast<int>(exit)
+    << "/" << code_frame.return_value()
+    << "\n";
+}
+
+int main() {
+  test_module_image();
+  test_deep_module();
+  return 0;
+}
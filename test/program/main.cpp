@@ -1,77 +1,711 @@
+#include <cstring>
 #include <string>
 #include <iostream>
-
-#include <unordered_set>
+#include <memory>
+#include <sstream>
+#include <type_traits>
+#include <vector>
+#include "program/arena.h"
+#include "program/flat.h"
+#include "program/linker.h"
+#include "program/optimizer.h"
+#include "program/parser.h"
+#include "program/printer.h"
+#include "program/register_allocator.h"
+#include "program/revalidation.h"
+#include "program/traverse.h"
 #include "program/validator.h"
 
 using namespace zvm;
 
-template<typename T>
-struct Allocator {
-  std::unordered_set<T*> pointers;
+void test_validator() {
+  ProgramArena arena;
 
-  Allocator() {}
+  Func func {arena.resource()};
 
-  Allocator(const Allocator& other) = delete;
-  Allocator& operator=(const Allocator& other) = delete;
+  func.arg_count = 1;
 
-  ~Allocator() {
-    for (T* ptr : pointers) {
-      delete ptr;
-    }
-  }
+  func.registers = {
+    RegisterTypes::Bool,
+    RegisterTypes::Int32,
+    RegisterTypes::UInt64,
+  };
 
-  template<typename U, typename ...Args>
-  U* create(Args ...args) {
-    auto* ptr = new U(std::forward<Args>(args)...);
-    pointers.insert(ptr);
-    return ptr;
-  }
+  func.return_type = RegisterTypes::Bool;
+
+  func.block = arena.block({
+    arena.create<LoadStatement>(1, 123),
+    arena.create<LoadStatement>(1, 456),
+    arena.create<IfStatement>(0, arena.block({
+      arena.create<ReturnStatement>(0),
+    }), arena.block({
+      arena.create<ReturnStatement>(0),
+    })),
+  });
+
+  Interface global;
+
+  std::cout << validate_func(func, global, {}) << "\n";
+}
+
+void test_arena() {
+  ProgramArena arena;
+
+  Func callee {arena.resource()};
+  callee.arg_count = 2;
+  callee.registers = {RegisterTypes::Int32, RegisterTypes::Int32};
+  callee.return_type = RegisterTypes::Int32;
+
+  Interface global;
+  global.func_map[1] = &callee;
 
-  template<typename U>
-  U* insert(U* ptr) {
-    pointers.insert(ptr);
-    return ptr;
+  Func func {arena.resource()};
+  func.registers = {RegisterTypes::Int32, RegisterTypes::Int32};
+  func.return_type = RegisterTypes::Int32;
+
+  Block block = arena.block(10001);
+  for (int i = 0; i < 5000; ++i) {
+    block.push_back(arena.create<LoadStatement>(0, i));
+    block.push_back(arena.create<CallStatement>(
+      1, void_register(), 1, arena.args({0, 1})));
   }
+  block.push_back(arena.create<ReturnStatement>(1));
+
+  func.block = arena.block({
+    arena.create<RepeatStatement>(std::move(block)),
+  });
+
+  std::cout
+    << "arena: " << validate_func(func, global, {})
+    << ", in arena " << (func.block.get_allocator().resource() == arena.resource())
+    << "\n";
+}
+
+void test_linker() {
+  ProgramArena arena;
+
+  Func a {arena.resource()};
+  a.return_type = RegisterTypes::Void;
+  Func b {arena.resource()};
+  b.return_type = RegisterTypes::Void;
+
+  const RegisterType first_type = RegisterTypes::FirstInterfaceType + 1;
+  const RegisterType second_type = RegisterTypes::FirstInterfaceType + 2;
+
+  Interface first;
+  first.func_map[10] = &a;
+  first.func_map[20] = &b;
+  Interface second;
+  second.func_map[20] = &a;
+
+  InterfaceTypeTable interface_types;
+  interface_types[first_type] = &first;
+  interface_types[second_type] = &second;
+
+  Interface global;
+  global.func_map[1] = &b;
 
-  void destroy(T* ptr) {
-    if (auto erased = pointers.erase(ptr); erased > 0) {
-      delete ptr;
-    }
+  Func func {arena.resource()};
+  func.registers = {second_type};
+  auto* global_call = arena.create<CallStatement>(
+    void_register(), void_register(), 1);
+  auto* interface_call = arena.create<CallStatement>(
+    void_register(), 0, 20);
+  func.block = arena.block({
+    arena.create<IfStatement>(0, arena.block({global_call})),
+    interface_call,
+  });
+
+  Linkage linkage;
+  bool linked = link_module({&func}, global, interface_types, linkage);
+
+  // Calls through second_type only need its one method, so each
+  // vtable has a single entry
+  std::cout
+    << "linker: " << linked
+    << (global_call->callee == &b)
+    << (linkage.method(first_type, interface_call->slot) == &b)
+    << (linkage.method(second_type, interface_call->slot) == &a)
+    << ", vtable entries " << linkage.vtables.size()
+    << "\n";
+}
+
+void test_recursive_subtypes() {
+  ProgramArena arena;
+
+  const RegisterType list_type = RegisterTypes::FirstInterfaceType + 1;
+  const RegisterType node_type = RegisterTypes::FirstInterfaceType + 2;
+
+  // list { next() -> list }, node { next() -> node, value() -> Int32 }
+  Func list_next {arena.resource()};
+  list_next.return_type = list_type;
+  Func node_next {arena.resource()};
+  node_next.return_type = node_type;
+  Func node_value {arena.resource()};
+  node_value.return_type = RegisterTypes::Int32;
+
+  Interface list;
+  list.func_map[1] = &list_next;
+  Interface node;
+  node.func_map[1] = &node_next;
+  node.func_map[2] = &node_value;
+
+  InterfaceTypeTable interface_types;
+  interface_types[list_type] = &list;
+  interface_types[node_type] = &node;
+
+  Func to_list {arena.resource()};
+  to_list.arg_count = 1;
+  to_list.registers = {node_type};
+  to_list.return_type = list_type;
+  to_list.block = arena.block({
+    arena.create<ReturnStatement>(0),
+  });
+
+  Func to_node {arena.resource()};
+  to_node.arg_count = 1;
+  to_node.registers = {list_type};
+  to_node.return_type = node_type;
+  to_node.block = arena.block({
+    arena.create<ReturnStatement>(0),
+  });
+
+  Interface global;
+  SubtypeCache cache;
+
+  std::cout
+    << "subtypes: to_list " << validate_func(to_list, global, interface_types, 0, &cache)
+    << ", to_node " << validate_func(to_node, global, interface_types, 0, &cache)
+    << ", cached " << cache.results.size();
+
+  // Replacing an entry keeps the table's size; its new generation
+  // clears the cached results
+  interface_types[node_type] = &list;
+  interface_types.changed();
+
+  std::cout
+    << ", replaced to_node " << validate_func(to_node, global, interface_types, 0, &cache)
+    << "\n";
+}
+
+void test_validate_module() {
+  ProgramArena arena;
+
+  std::vector<std::unique_ptr<Func>> storage;
+  std::vector<Pointer<Func>> funcs;
+
+  for (int i = 0; i < 1000; ++i) {
+    auto func = std::make_unique<Func>(arena.resource());
+    func->registers = {RegisterTypes::Int32};
+    func->return_type = RegisterTypes::Int32;
+    // Every tenth func breaks outside of a repeat
+    func->block = arena.block({
+      i % 10 == 0
+        ? static_cast<Statement*>(arena.create<BreakStatement>())
+        : static_cast<Statement*>(arena.create<LoadStatement>(0, i)),
+      arena.create<ReturnStatement>(0),
+    });
+    funcs.push_back(func.get());
+    storage.push_back(std::move(func));
   }
-};
 
-void test_validator() {
-  Allocator<Statement> allocator;
+  Interface global;
+  auto result = validate_module(funcs, global, {}, 1, 4);
 
-  Func func;
+  std::cout
+    << "validate module: valid " << result.is_valid()
+    << ", invalid " << result.invalid_count
+    << ", results " << static_cast<int>(result.results[0])
+    << " " << static_cast<int>(result.results[1])
+    << ", token " << (funcs[1]->validation_token.load() == 1)
+    << "\n";
+}
 
-  func.arg_count = 1;
+void test_parser() {
+  const char* text =
+    "func 0 args 1 returns i32\n"
+    "  registers 257 bool i32 i32\n"
+    "  load r1 1\n"
+    "  load r2 5\n"
+    "  repeat\n"
+    "    if r1\n"
+    "      break\n"
+    "    end\n"
+    "  end\n"
+    "  try r3\n"
+    "    call r3 r0 7 r1 r2\n"
+    "  catch\n"
+    "    throw r3\n"
+    "  end\n"
+    "  finally\n"
+    "    yield r2\n"
+    "  always\n"
+    "    call _ _ 1\n"
+    "  end\n"
+    "  return r3\n"
+    "end\n"
+    "func 1\n"
+    "end\n"
+    "func 2 args 2 returns i32\n"
+    "  registers bool i32\n"
+    "  return r1\n"
+    "end\n"
+    "interface 0 global\n"
+    "  method 1 1\n"
+    "end\n"
+    "interface 1\n"
+    "  method 7 2\n"
+    "end\n"
+    "type 257 1\n";
 
-  func.registers = {
+  ParsedModule module;
+  std::istringstream in {text};
+  bool parsed = parse_module(in, module);
+
+  std::ostringstream out;
+  print_module(out, module.func_list(), module.global(), module.interface_types);
+
+  ParseError error;
+  ParsedModule bad;
+  const char* bad_text = "func 0 # comment\n  if r0\n  else\n  catch\n";
+  bool rejected = !parse_module(bad_text, std::strlen(bad_text), bad, &error);
+
+  std::cout
+    << "parser: parsed " << parsed
+    << ", round trip " << (out.str() == text)
+    << ", funcs " << module.funcs.size()
+    << ", rejected " << rejected << " at line " << error.line
+    << ", valid " << validate_func(module.funcs[0], module.global(), module.interface_types)
+    << "\n";
+}
+
+void test_register_layout() {
+  RegisterList registers {
     RegisterTypes::Bool,
+    RegisterTypes::Int64,
     RegisterTypes::Int32,
-    RegisterTypes::UInt64,
+    RegisterTypes::Int8,
+    RegisterTypes::Int16,
   };
 
-  func.return_type = RegisterTypes::Bool;
+  std::cout << "register layout: " << registers.frame_size << " bytes, offsets";
+  for (auto& slot : registers.slots) {
+    std::cout << " " << slot.offset;
+  }
+  std::cout << "\n";
+}
 
-  func.block = make_block({
-    allocator.create<LoadStatement>(1, 123),
-    allocator.create<LoadStatement>(1, 456),
-    allocator.create<IfStatement>(0, make_block({
-      allocator.create<ReturnStatement>(0),
-    }), make_block({
-      allocator.create<ReturnStatement>(0),
-    })),
-  });
+void test_register_compaction() {
+  const char* text =
+    "func 0 args 1 returns i32\n"
+    "  registers i32 i32 i32 bool i32 i32 i32 i32 i32\n"
+    "  load r1 1\n"
+    "  call r2 _ 1 r0 r1\n"
+    "  load r3 1\n"
+    "  repeat\n"
+    "    load r4 2\n"
+    "    call r2 _ 1 r2 r4\n"
+    "    if r3\n"
+    "      break\n"
+    "    end\n"
+    "  end\n"
+    "  finally\n"
+    "    load r5 3\n"
+    "    return r5\n"
+    "  always\n"
+    "    load r6 4\n"
+    "    call r7 _ 1 r6 r2\n"
+    "  end\n"
+    "  return r2\n"
+    "end\n"
+    "func 1 args 2 returns i32\n"
+    "  registers i32 i32\n"
+    "  return r0\n"
+    "end\n"
+    "interface 0 global\n"
+    "  method 1 1\n"
+    "end\n";
+
+  ParsedModule module;
+  parse_module(text, std::strlen(text), module);
+
+  auto& func = module.funcs[0];
+  auto before = func.registers.size();
+  auto removed = compact_registers(func);
+
+  // The returned r5 stays live through the finally block, so it
+  // cannot share with r6 or r7; r8 is never referenced
+  const char* expected =
+    "func 0 args 1 returns i32\n"
+    "  registers i32 i32 bool i32\n"
+    "  load r1 1\n"
+    "  call r0 _ 1 r0 r1\n"
+    "  load r2 1\n"
+    "  repeat\n"
+    "    load r1 2\n"
+    "    call r0 _ 1 r0 r1\n"
+    "    if r2\n"
+    "      break\n"
+    "    end\n"
+    "  end\n"
+    "  finally\n"
+    "    load r1 3\n"
+    "    return r1\n"
+    "  always\n"
+    "    load r3 4\n"
+    "    call r3 _ 1 r3 r0\n"
+    "  end\n"
+    "  return r0\n"
+    "end\n";
+
+  std::ostringstream out;
+  print_func(out, func, 0);
+
+  std::cout
+    << "register compaction: " << before
+    << " registers, removed " << removed
+    << ", expected " << (out.str() == expected)
+    << ", valid " << validate_func(func, module.global(), module.interface_types)
+    << "\n";
+}
+
+void test_optimizer() {
+  const char* text =
+    "func 0 args 1 returns i32\n"
+    "  registers i32 bool i32 i32\n"
+    "  load r1 1\n"
+    "  load r2 5\n"
+    "  load r2 6\n"
+    "  if r1\n"
+    "    load r3 7\n"
+    "    return r3\n"
+    "    load r2 9\n"
+    "  else\n"
+    "    return r0\n"
+    "  end\n"
+    "  return r2\n"
+    "end\n"
+    "func 1 args 1 returns i32\n"
+    "  registers i32 bool i32\n"
+    "  load r1 1\n"
+    "  repeat\n"
+    "    if r1\n"
+    "      load r1 0\n"
+    "      load r2 3\n"
+    "    else\n"
+    "      break\n"
+    "    end\n"
+    "  end\n"
+    "  return r0\n"
+    "end\n";
+
+  const char* expected =
+    "func 0 args 1 returns i32\n"
+    "  registers i32 bool i32 i32\n"
+    "  load r3 7\n"
+    "  return r3\n"
+    "end\n"
+    "func 1 args 1 returns i32\n"
+    "  registers i32 bool i32\n"
+    "  load r1 1\n"
+    "  repeat\n"
+    "    if r1\n"
+    "      load r1 0\n"
+    "    else\n"
+    "      break\n"
+    "    end\n"
+    "  end\n"
+    "  return r0\n"
+    "end\n";
+
+  ParsedModule module;
+  parse_module(text, std::strlen(text), module);
+
+  std::cout << "optimizer: removed";
+  std::ostringstream out;
+  uint32_t index = 0;
+  for (auto& func : module.funcs) {
+    std::cout << " " << optimize_func(func);
+    print_func(out, func, index++);
+  }
+
+  std::cout
+    << ", expected " << (out.str() == expected)
+    << ", valid " << validate_func(module.funcs[0], module.global(), module.interface_types)
+    << " " << validate_func(module.funcs[1], module.global(), module.interface_types)
+    << "\n";
+}
+
+struct TraversalCounter {
+  std::size_t entered = 0;
+  std::size_t left = 0;
+  std::size_t stop_after = 0;
+  bool skip_ifs = false;
+
+  template<typename S>
+  TraversalAction enter_statement(const S& stmt) {
+    ++this->entered;
+    if (this->stop_after && this->entered == this->stop_after)
+      return TraversalAction::Stop;
+    if (this->skip_ifs && is_statement_type<IfStatement>(stmt))
+      return TraversalAction::Skip;
+    return TraversalAction::Continue;
+  }
+
+  template<typename S>
+  void leave_statement(const S& stmt) {
+    ++this->left;
+  }
+};
+
+struct LoadRewriter {
+  template<typename S>
+  void enter_statement(S& stmt) {}
+
+  void enter_statement(LoadStatement& stmt) {
+    stmt.value = 5;
+  }
+
+  template<typename S>
+  void leave_statement(S& stmt) {}
+};
+
+void test_traversal() {
+  ProgramArena arena;
+
+  // Far deeper than the native stack would allow with recursion
+  const unsigned depth = 200000;
+  Func func {arena.resource()};
+  func.registers = {RegisterTypes::Bool};
+  func.return_type = RegisterTypes::Bool;
+  Block block = arena.block({arena.create<ReturnStatement>(0)});
+  for (unsigned i = 0; i < depth; ++i) {
+    block = arena.block({
+      arena.create<LoadStatement>(0, 1),
+      arena.create<IfStatement>(0, std::move(block)),
+    });
+  }
+  func.block = std::move(block);
 
   Interface global;
+  InterfaceTypeTable interface_types;
+
+  TraversalCounter all;
+  bool completed = traverse_block(func.block, all);
+
+  TraversalCounter skipped;
+  skipped.skip_ifs = true;
+  traverse_block(func.block, skipped);
+
+  TraversalCounter stopped;
+  stopped.stop_after = 10;
+  bool stopped_completed = traverse_block(func.block, stopped);
+
+  // Sources honour the same actions
+  auto flat = flatten_func(func);
+  FlatSource source {flat};
+  TraversalCounter source_skipped;
+  source_skipped.skip_ifs = true;
+  traverse_source(source, source_skipped);
+  TraversalCounter source_stopped;
+  source_stopped.stop_after = 10;
+  bool source_completed = traverse_source(source, source_stopped);
+
+  LoadRewriter rewriter;
+  traverse_mutable_block(func.block, rewriter);
+  auto& nested = cast_statement<IfStatement>(*func.block[1]);
+
+  std::cout
+    << "traversal: completed " << completed
+    << ", entered " << all.entered
+    << ", balanced " << (all.left == all.entered)
+    << ", skipped " << skipped.entered << "/" << skipped.left
+    << ", stopped " << stopped_completed << " " << stopped.entered << "/" << stopped.left
+    << ", source skipped " << source_skipped.entered << "/" << source_skipped.left
+    << ", source stopped " << source_completed << " " << source_stopped.entered
+    << "/" << source_stopped.left
+    << ", rewritten " << cast_statement<LoadStatement>(*func.block[0]).value
+    << " " << cast_statement<LoadStatement>(*nested.true_block[0]).value
+    << ", valid " << validate_func(func, global, interface_types)
+    << ", stack frames " << traversal_stack().frames.size()
+    << "\n";
+}
+
+void test_revalidation() {
+  const char* text =
+    "func 0 args 2 returns i32\n"
+    "  registers bool i32\n"
+    "  return r1\n"
+    "end\n"
+    "func 1 returns i32\n"
+    "  registers bool i32 i32\n"
+    "  call r2 _ 0 r0 r1\n"
+    "  return r2\n"
+    "end\n"
+    "func 2 args 1 returns i32\n"
+    "  registers 257 bool i32 i32\n"
+    "  call r3 r0 7 r1 r2\n"
+    "  return r3\n"
+    "end\n"
+    "func 3\n"
+    "  registers i32\n"
+    "  load r0 3\n"
+    "end\n"
+    "interface 0 global\n"
+    "  method 0 0\n"
+    "end\n"
+    "interface 1\n"
+    "  method 7 0\n"
+    "end\n"
+    "type 257 1\n";
+
+  ParsedModule module;
+  parse_module(text, std::strlen(text), module);
+
+  IncrementalValidator validator {module.global(), module.interface_types, 1};
+  for (auto& func : module.funcs) {
+    validator.add(func);
+  }
+
+  auto initial = validator.revalidate();
+
+  validator.global_changed(0);
+  auto global = validator.revalidate();
+
+  validator.interface_changed(257);
+  auto interface = validator.revalidate();
+
+  // Func 0 is both a global func and a method of type 257
+  validator.func_changed(module.funcs[0]);
+  auto signature = validator.revalidate();
+
+  validator.func_changed(module.funcs[3], false);
+  auto body = validator.revalidate();
+
+  auto& methods = module.interfaces[1].func_map;
+  methods.erase(7);
+  validator.interface_changed(257);
+  auto removed = validator.revalidate();
+  bool removed_valid = validator.is_valid();
+  bool caller_valid = validator.is_valid(module.funcs[2]);
+
+  methods[7] = &module.funcs[0];
+  validator.interface_changed(257);
+  validator.revalidate();
+
+  std::cout
+    << "revalidation: initial " << initial
+    << ", global " << global
+    << ", interface " << interface
+    << ", signature " << signature
+    << ", body " << body
+    << ", removed " << removed
+    << ", valid " << removed_valid << " " << caller_valid << " " << validator.is_valid()
+    << ", token " << module.funcs[2].validation_token.load()
+    << "\n";
+}
+
+// Bytes of the tree form: each statement and its pointer in a block
+struct TreeSize {
+  std::size_t bytes = 0;
+
+  template<typename S>
+  void enter_statement(const S& stmt) {
+    this->bytes += sizeof(S) + sizeof(Statement*);
+    if constexpr (std::is_same_v<S, CallStatement>)
+      this->bytes += stmt.args.size() * sizeof(Register);
+  }
+
+  template<typename S>
+  void leave_statement(const S& stmt) {}
+};
+
+void test_flat() {
+  const char* text =
+    "func 0 args 2 returns i32\n"
+    "  registers bool i32 i32 i32\n"
+    "  load r2 5\n"
+    "  if r0\n"
+    "    call r3 _ 0 r0 r2\n"
+    "    repeat\n"
+    "      if r0\n"
+    "        break\n"
+    "      end\n"
+    "    end\n"
+    "  else\n"
+    "    try r3\n"
+    "      load r1 7\n"
+    "    catch\n"
+    "      throw r3\n"
+    "    end\n"
+    "  end\n"
+    "  finally\n"
+    "    yield r1\n"
+    "  always\n"
+    "    load r2 9\n"
+    "  end\n"
+    "  return r1\n"
+    "end\n"
+    "func 1 returns i32\n"
+    "  registers bool i32\n"
+    "  if r1\n"
+    "    return r1\n"
+    "  end\n"
+    "  return r1\n"
+    "end\n"
+    "interface 0 global\n"
+    "  method 0 0\n"
+    "end\n";
+
+  ParsedModule module;
+  parse_module(text, std::strlen(text), module);
+
+  ProgramArena arena;
+  bool round_trip = true;
+  bool same_validation = true;
+  for (auto& func : module.funcs) {
+    auto flat = flatten_func(func);
+
+    Func expanded {arena.resource()};
+    expanded.block = expand_flat_func(flat, arena);
+    round_trip &= flatten_func(expanded).hash() == flat.hash();
+
+    FlatSource source {flat};
+    same_validation &=
+      validate_func(func, source, module.global(), module.interface_types) ==
+      validate_func(func, module.global(), module.interface_types);
+  }
+
+  auto& func = module.funcs[0];
+  auto flat = flatten_func(func);
+  TreeSize tree;
+  traverse_block(func.block, tree);
 
-  std::cout << validate_func(func, global, {});
+  FlatSource source {flat};
+  std::cout
+    << "flat: round trip " << round_trip
+    << ", same validation " << same_validation
+    << ", valid " << validate_func(func, source, module.global(), module.interface_types)
+    << ", mismatched " << validate_func(module.funcs[1], source, module.global(), module.interface_types)
+    << ", statements " << flat.size()
+    << ", ifs " << flat.count(StatementKind::If)
+    << ", loads " << flat.count(StatementKind::Load)
+    << ", half size " << (flat.memory_size() * 2 <= tree.bytes)
+    << "\n";
 }
 
 int main() {
   test_validator();
+  test_arena();
+  test_linker();
+  test_recursive_subtypes();
+  test_validate_module();
+  test_parser();
+  test_register_layout();
+  test_register_compaction();
+  test_optimizer();
+  test_traversal();
+  test_revalidation();
+  test_flat();
   return 0;
 }
@@ -0,0 +1,40 @@
+#include <fstream>
+#include <iostream>
+
+#include "program/parser.h"
+#include "interpreter/aot.h"
+
+using namespace zvm;
+
+// Translates a text module into C++ for zvm_add_aot_module:
+//
+//   zvm_aot <module> <output.cpp>
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "usage: zvm_aot <module> <output.cpp>\n";
+    return 2;
+  }
+
+  std::ifstream in {argv[1]};
+  if (!in) {
+    std::cerr << argv[1] << ": cannot open\n";
+    return 1;
+  }
+
+  ParsedModule module;
+  ParseError error;
+  if (!parse_module(in, module, &error)) {
+    std::cerr << argv[1] << ":" << error.line << ": " << error.message << "\n";
+    return 1;
+  }
+
+  std::ofstream out {argv[2]};
+  emit_aot_module(out, module.func_list(), module.global(), module.interface_types);
+  out.close();
+  if (!out) {
+    std::cerr << argv[2] << ": cannot write\n";
+    return 1;
+  }
+
+  return 0;
+}